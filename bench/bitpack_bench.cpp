@@ -0,0 +1,80 @@
+// Throughput of the bit packing kernels in src/bitpack.cpp.
+// Build and run with `make bench`.
+
+#include "bitpack.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const size_t BITS = 8 * 1024 * 1024;
+static const int ROUNDS = 8;
+
+// Every kernel has to agree with the scalar one, tails included
+static bool check(const BitpackKernel& k, const BitpackKernel& ref) {
+    std::mt19937 rng(1);
+    for (size_t n = 1; n < 300; n++) {
+        std::vector<uint8_t> bits((n + 7) / 8);
+        for (auto& b : bits) b = rng();
+        
+        std::vector<uint8_t> a(2 * n), b(2 * n);
+        k.expand(bits.data(), n, a.data(), 0x10, 0x04, 0x01);
+        ref.expand(bits.data(), n, b.data(), 0x10, 0x04, 0x01);
+        if (a != b) return false;
+        
+        for (size_t stride = 1; stride <= 3; stride++) {
+            std::vector<uint8_t> in((n - 1) * stride + 1);
+            for (auto& x : in) x = rng();
+            
+            std::vector<uint8_t> x(bits.size(), 0xaa), y(bits.size(), 0x55);
+            k.collapse(in.data(), stride, n, 0x10, x.data());
+            ref.collapse(in.data(), stride, n, 0x10, y.data());
+            if (x != y) return false;
+        }
+    }
+    return true;
+}
+
+template <typename F>
+static double mbit_per_s(F fn) {
+    fn();  // warm up
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < ROUNDS; i++) fn();
+    auto t1 = std::chrono::steady_clock::now();
+    double s = std::chrono::duration<double>(t1 - t0).count();
+    return BITS * (double)ROUNDS / s / 1e6;
+}
+
+int main() {
+    std::vector<uint8_t> bits(BITS / 8);
+    std::vector<uint8_t> stream(2 * BITS);
+    std::mt19937 rng(42);
+    for (auto& b : bits) b = rng();
+    for (auto& b : stream) b = rng();
+    
+    const auto& kernels = bitpack_kernels();
+    printf("%-8s %14s %14s %14s\n", "kernel", "expand", "collapse/1", "collapse/2");
+    
+    for (const auto& k : kernels) {
+        if (!check(k, kernels.front())) {
+            printf("%-8s MISMATCH against scalar\n", k.name);
+            return 1;
+        }
+        
+        double e = mbit_per_s([&] {
+            k.expand(bits.data(), BITS, stream.data(), 0x10, 0x04, 0x01);
+        });
+        double c1 = mbit_per_s([&] {
+            k.collapse(stream.data(), 1, BITS, 0x10, bits.data());
+        });
+        double c2 = mbit_per_s([&] {
+            k.collapse(stream.data(), 2, BITS, 0x10, bits.data());
+        });
+        
+        printf("%-8s %9.0f Mb/s %9.0f Mb/s %9.0f Mb/s\n", k.name, e, c1, c2);
+    }
+    
+    printf("\nruntime pick: %s (MPSSE tops out at 30 Mb/s)\n", bitpack_best().name);
+    return 0;
+}
@@ -0,0 +1,212 @@
+// Throughput of the whole host stack (Jtag, Dap, Device, Flash) against the
+// simulated target in src/sim.cpp, so no adapter is needed. Times are the
+// sim's own clock (1 MHz TCK plus modelled USB time), which makes every run
+// give the same numbers. Build and run with `make bench`.
+
+#include "sim.h"
+#include "jtag.h"
+#include "device.h"
+#include "flash.h"
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <vector>
+
+static const uint32_t SRAM = 0x20000000;
+static const uint32_t FLASH = 0x08000000;
+static const uint32_t SIZE = 16 * 1024;
+
+struct Link {
+    const char* name;
+    SimConfig cfg;
+};
+
+static SimConfig link(unsigned latency_us, unsigned ns_per_byte, int ap_wait) {
+    SimConfig c;
+    c.usb_latency_us = latency_us;
+    c.usb_ns_per_byte = ns_per_byte;
+    c.ap_wait = ap_wait;
+    return c;
+}
+
+// One operation's cost, from the counters either side of it. Each starts
+// without the idle cycles earlier WAITs made the DAP add, so it meets the
+// AP's busy time and pays for its own WAITs.
+static bool measure(const char* op, SimAdapter& sim, Jtag& jtag, Device& dev,
+                    const std::function<bool()>& fn) {
+    dev.debug_port().reset_backoff();
+    uint64_t t0 = sim.ticks();
+    Dap::Stats d0 = dev.debug_port().stats();
+    JtagAdapter::Stats u0 = sim.stats();
+    
+    if (!fn()) {
+        printf("  %-18s FAILED\n", op);
+        return false;
+    }
+    jtag.flush();
+    
+    const Dap::Stats& d1 = dev.debug_port().stats();
+    const JtagAdapter::Stats& u1 = sim.stats();
+    double s = (sim.ticks() - t0) / 1e6;
+    double scans = d1.dr_scans - d0.dr_scans;
+    
+    printf("  %-18s %9.1f ms %9.1f KB/s %7.2f scans/word %7llu xfers %6llu waits %4d idle\n", op,
+           s * 1e3, SIZE / 1024.0 / s, scans / (SIZE / 4), (unsigned long long)(u1.transfers - u0.transfers),
+           (unsigned long long)(d1.waits - d0.waits), dev.debug_port().backoff_cycles());
+    return true;
+}
+
+// Attach quietly; only the table goes to stdout
+static std::unique_ptr<Device> attach(Jtag& jtag) {
+    std::ostringstream quiet;
+    std::streambuf* out = std::cout.rdbuf(quiet.rdbuf());
+    bool ok = jtag.init() && jtag.scan_chain();
+    std::unique_ptr<Device> dev;
+    if (ok) {
+        dev.reset(new Device(jtag.taps()[0].idcode, &jtag, {0}));
+        ok = dev->init() && dev->halt();   // programming leaves it halted anyway
+    }
+    std::cout.rdbuf(out);
+    if (!ok) dev.reset();
+    return dev;
+}
+
+static bool run(const Link& l, const std::vector<uint8_t>& data) {
+    SimAdapter sim(l.cfg);
+    Jtag jtag(&sim);
+    
+    std::unique_ptr<Device> dev = attach(jtag);
+    if (!dev) {
+        printf("%s: attach failed\n", l.name);
+        return false;
+    }
+    
+    Flash flash(dev.get(), &jtag);
+    if (!flash.detect() || !flash.load_driver()) {
+        printf("%s: no flash driver\n", l.name);
+        return false;
+    }
+    
+    // Most WAITs a slow link sees come while attaching
+    printf("%s\n", l.name);
+    printf("  %-18s %9.1f ms %54llu waits %4d idle\n", "attach", sim.ticks() / 1e3,
+           (unsigned long long)dev->debug_port().stats().waits, dev->debug_port().backoff_cycles());
+    std::vector<uint8_t> buf(SIZE);
+    
+    // Program first: erase skips blank sectors, so it needs something there
+    bool ok = measure("read SRAM", sim, jtag, *dev, [&] {
+                  return dev->read_mem(SRAM, buf.data(), SIZE);
+              }) &&
+              measure("write SRAM", sim, jtag, *dev, [&] {
+                  return dev->write_mem(SRAM, data.data(), SIZE);
+              }) &&
+              measure("program (loader)", sim, jtag, *dev, [&] {
+                  return flash.program(FLASH, data.data(), SIZE);
+              }) &&
+              measure("erase", sim, jtag, *dev, [&] {
+                  return flash.erase(FLASH, SIZE);
+              }) &&
+              measure("program (no loader)", sim, jtag, *dev, [&] {
+                  flash.set_loader(false);
+                  return flash.program(FLASH, data.data(), SIZE);
+              }) &&
+              measure("verify (CRC)", sim, jtag, *dev, [&] {
+                  return flash.verify(FLASH, data.data(), SIZE);
+              });
+    
+    printf("\n");
+    return ok;
+}
+
+// Not a measurement: a part with 2 KB pages, so sector geometry comes from
+// the device database rather than the STM32F1 default. The image starts
+// mid-page and covers nine pages.
+static bool pages_2k(std::vector<uint8_t> data) {
+    DeviceDB::instance().add({0x1BA01477, "STM32F103 (2K pages)", "sim", 64 * 1024, 20 * 1024,
+                              {{FLASH, 64 * 1024, 2048}}, false, false, "stm32f1",
+                              {{0xE0042000, 0xfff, 0x414, false}}});
+    SimConfig cfg;
+    cfg.page_size = 2048;
+    SimAdapter sim(cfg);
+    Jtag jtag(&sim);
+    
+    std::unique_ptr<Device> dev = attach(jtag);
+    Flash flash(dev.get(), &jtag);
+    if (!dev || dev->info()->flash_regions[0].sector_size != 2048 ||
+        !flash.detect() || !flash.load_driver()) {
+        printf("2K pages: attach failed\n");
+        return false;
+    }
+    
+    const uint32_t start = FLASH + 512;
+    std::vector<uint8_t> buf(SIZE);
+    FlashUpdateStats first, second;
+    bool ok = flash.update(start, data.data(), SIZE, &first) && first.sectors_written == 9 &&
+              flash.read(start, buf.data(), SIZE) && buf == data;
+    
+    // One changed byte is one page erased and written
+    data[5000] ^= 0xff;
+    ok = ok && flash.update(start, data.data(), SIZE, &second) &&
+         second.sectors_erased == 1 && second.sectors_written == 1 &&
+         flash.read(start, buf.data(), SIZE) && buf == data;
+    
+    uint64_t erased = flash.stats().sectors_erased;
+    bool is_blank = false;
+    ok = ok && flash.erase(start, SIZE) && flash.stats().sectors_erased - erased == 9 &&
+         flash.blank(FLASH, 10 * 2048, &is_blank) && is_blank;
+    
+    printf("2K pages: update and erase %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// Not a measurement either: loader writes ending in a short chunk after
+// an odd number of full buffers, so the last wait is on the buffer the
+// stub reaches second
+static bool loader_tails() {
+    SimAdapter sim;
+    Jtag jtag(&sim);
+    std::unique_ptr<Device> dev = attach(jtag);
+    Flash flash(dev.get(), &jtag);
+    if (!dev || !flash.detect() || !flash.load_driver()) {
+        printf("loader tails: attach failed\n");
+        return false;
+    }
+    
+    std::mt19937 rng(7);
+    bool ok = true;
+    for (uint32_t len : {16386u, 20000u, 33000u}) {
+        std::vector<uint8_t> data(len), buf(len);
+        for (auto& b : data) b = rng();
+        ok = ok && flash.erase(FLASH, len) && flash.program(FLASH, data.data(), len) &&
+             flash.read(FLASH, buf.data(), len) && buf == data;
+    }
+    
+    printf("loader tails: %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main() {
+    std::vector<uint8_t> data(SIZE);
+    std::mt19937 rng(42);
+    for (auto& b : data) b = rng();
+    
+    // Latency is the USB round trip per flush; high speed polls every
+    // 125 us microframe, full speed every 1 ms frame. A bus access that
+    // outlasts the gap to the next scan is answered with WAIT.
+    const Link links[] = {
+        {"ideal link", link(0, 0, 0)},
+        {"FT2232H, high speed, AP busy 10 TCKs", link(125, 20, 10)},
+        {"FT232R-class, full speed, AP busy 2 TCKs", link(1000, 700, 2)},
+    };
+    
+    printf("%u KB per operation, simulated time\n\n", SIZE / 1024);
+    
+    bool ok = true;
+    for (const auto& l : links) ok &= run(l, data);
+    ok &= pages_2k(data);
+    ok &= loader_tails();
+    return ok ? 0 : 1;
+}
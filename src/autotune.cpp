@@ -0,0 +1,157 @@
+#include "autotune.h"
+#include "jtag.h"
+#include "dap.h"
+#include <iostream>
+#include <random>
+#include <vector>
+
+static const int ROUNDS = 4;             // of each test per step
+static const int PATTERN_BITS = 1024;
+static const int TAR_WORDS = 16;
+
+static bool bit(const std::vector<uint8_t>& v, int i) {
+    return (v[i / 8] >> (i % 8)) & 1;
+}
+
+// Random bytes with a run of zeros, a run of ones and 0x55s mixed in, for
+// the edges that show up marginal timing
+static std::vector<uint8_t> pattern(std::mt19937& rng, int bits) {
+    std::vector<uint8_t> p((bits + 7) / 8);
+    for (size_t i = 0; i < p.size(); i++) {
+        switch (i % 32) {
+            case 0: case 1: p[i] = 0x00; break;
+            case 2: case 3: p[i] = 0xff; break;
+            case 4: p[i] = 0x55; break;
+            default: p[i] = rng(); break;
+        }
+    }
+    return p;
+}
+
+// From Test-Logic-Reset every TAP with an IDCODE selects it, the rest
+// BYPASS. The IDCODEs come out first and then, delayed by the chain's DR
+// length, what went in.
+static bool idcode_loopback(Jtag& jtag, std::mt19937& rng, bool* stable) {
+    const auto& taps = jtag.taps();
+    int dr_len = 0;
+    for (const auto& t : taps) dr_len += t.idcode ? 32 : 1;
+    
+    std::vector<uint8_t> in = pattern(rng, dr_len + PATTERN_BITS);
+    std::vector<uint8_t> out(in.size());
+    jtag.reset();
+    jtag.queue_dr(in.data(), dr_len + PATTERN_BITS, out.data());
+    if (!jtag.flush()) return false;
+    
+    int pos = 0;
+    *stable = true;
+    for (const auto& t : taps) {
+        if (!t.idcode) {
+            pos++;
+            continue;
+        }
+        uint32_t id = 0;
+        for (int i = 0; i < 32; i++) id |= (uint32_t)bit(out, pos + i) << i;
+        if (id != t.idcode) *stable = false;
+        pos += 32;
+    }
+    
+    for (int i = 0; i < PATTERN_BITS; i++) {
+        if (bit(out, dr_len + i) != bit(in, i)) return false;
+    }
+    return *stable;
+}
+
+// All-ones IR puts every TAP in BYPASS: a one-bit delay each
+static bool bypass_loopback(Jtag& jtag, std::mt19937& rng) {
+    const auto& taps = jtag.taps();
+    int ir_len = 0;
+    for (const auto& t : taps) ir_len += t.ir_len;
+    int n = taps.size();
+    
+    std::vector<uint8_t> ones((ir_len + 7) / 8, 0xff);
+    std::vector<uint8_t> in = pattern(rng, n + PATTERN_BITS);
+    std::vector<uint8_t> out(in.size());
+    jtag.queue_ir(ones.data(), ir_len);
+    jtag.queue_dr(in.data(), n + PATTERN_BITS, out.data());
+    if (!jtag.flush()) return false;
+    
+    for (int i = 0; i < PATTERN_BITS; i++) {
+        if (bit(out, n + i) != bit(in, i)) return false;
+    }
+    return true;
+}
+
+// TAR is read/write on every MEM-AP and touches nothing on the bus. The
+// DP's own complaints about garbled ACKs are expected here, so stay quiet.
+static bool dp_registers(Dap& dap, uint8_t ap, std::mt19937& rng) {
+    uint32_t wrote[TAR_WORDS], read[TAR_WORDS];
+    std::vector<Dap::Op> ops;
+    for (int i = 0; i < TAR_WORDS; i++) {
+        wrote[i] = rng() & ~3u;
+        ops.push_back(Dap::ap_wr(Dap::AP_TAR, wrote[i]));
+        ops.push_back(Dap::ap_rd(Dap::AP_TAR, &read[i]));
+    }
+    
+    dap.set_quiet(true);
+    dap.invalidate();
+    bool ok = dap.clear_errors() && dap.transfer(ap, ops.data(), ops.size());
+    dap.set_quiet(false);
+    
+    for (int i = 0; ok && i < TAR_WORDS; i++) ok = read[i] == wrote[i];
+    return ok;
+}
+
+// Why the chain fails at the current TCK, nullptr if it doesn't
+static const char* self_test(Jtag& jtag, Dap* dap, uint8_t ap, uint32_t seed) {
+    std::mt19937 rng(seed);
+    for (int r = 0; r < ROUNDS; r++) {
+        bool stable = true;
+        if (!idcode_loopback(jtag, rng, &stable)) return stable ? "IDCODE loopback" : "IDCODEs unstable";
+        if (!bypass_loopback(jtag, rng)) return "BYPASS loopback";
+    }
+    if (dap && !dp_registers(*dap, ap, rng)) return "DP register test";
+    return nullptr;
+}
+
+// Marginal speeds fail now and then, so a pass has to happen twice
+static bool passes(Jtag& jtag, Dap* dap, uint8_t ap, uint32_t khz) {
+    const char* why = self_test(jtag, dap, ap, khz);
+    if (!why) why = self_test(jtag, dap, ap, khz + 1);
+    
+    std::cout << "  " << khz << " kHz: " << (why ? "fail, " : "pass") << (why ? why : "") << "\n";
+    return !why;
+}
+
+uint32_t autotune(Jtag& jtag, Dap* dap, uint8_t ap, uint32_t min_khz, uint32_t max_khz, int margin_pct) {
+    uint32_t lo = jtag.set_clock(min_khz);
+    if (!lo) {
+        std::cerr << "This adapter's TCK can't be set\n";
+        return 0;
+    }
+    if (!passes(jtag, dap, ap, lo)) {
+        std::cerr << "The chain fails its self-test even at " << lo << " kHz\n";
+        return 0;
+    }
+    
+    // A good fixture runs at the adapter's limit; otherwise bisect to 5%
+    uint32_t hi = jtag.set_clock(max_khz);
+    if (passes(jtag, dap, ap, hi)) {
+        lo = hi;
+    } else {
+        while (hi - lo > lo / 20) {
+            uint32_t got = jtag.set_clock(lo + (hi - lo) / 2);
+            if (got <= lo || got >= hi) break;   // nothing the adapter can do in between
+            if (passes(jtag, dap, ap, got)) lo = got;
+            else hi = got;
+        }
+    }
+    
+    uint32_t khz = jtag.set_clock(lo - (uint64_t)lo * margin_pct / 100);
+    if (!passes(jtag, dap, ap, khz)) khz = jtag.set_clock(min_khz);
+    
+    // Leave the chain as scan_chain() did
+    jtag.reset();
+    if (dap) dap->invalidate();
+    std::cout << "Fastest clean TCK " << lo << " kHz, using " << khz << " kHz\n";
+    return khz;
+}
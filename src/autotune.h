@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+class Jtag;
+class Dap;
+
+// Fastest TCK between min_khz and max_khz at which the scanned chain passes
+// a self-test, found by bisection, less margin_pct percent. Each step
+// checks that every IDCODE reads back the same, that random patterns come
+// through the IDCODE and BYPASS registers unchanged, and, given a DP, that
+// MEM-AP TAR writes read back. Leaves the adapter at the result; 0 when
+// even min_khz fails or the adapter's TCK can't be set.
+uint32_t autotune(Jtag& jtag, Dap* dap, uint8_t ap, uint32_t min_khz, uint32_t max_khz, int margin_pct);
@@ -0,0 +1,59 @@
+#include "bitbang.h"
+#include "bitpack.h"
+
+void BitbangQueue::set(uint8_t mask, bool value) {
+    if (value) state |= mask;
+    else state &= ~mask;
+    buf.push_back(state);
+}
+
+void BitbangQueue::tms(uint32_t bits, int len) {
+    for (int i = 0; i < len; i++) {
+        if ((bits >> i) & 1) state |= TMS;
+        else state &= ~TMS;
+        
+        state &= ~TCK;
+        buf.push_back(state);
+        state |= TCK;
+        buf.push_back(state);
+    }
+}
+
+void BitbangQueue::shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) {
+    if (len <= 0) return;
+    
+    if (tdo) caps.push_back({tdo, len, buf.size()});
+    
+    uint8_t base = state & ~(TCK | TMS | TDI);
+    size_t pos = buf.size();
+    buf.resize(pos + 2 * len);
+    uint8_t* out = buf.data() + pos;
+    
+    if (tdi) {
+        bitpack_expand(tdi, len, out, base, TDI, TCK);
+    } else {
+        for (int i = 0; i < len; i++) {
+            out[2*i] = base;
+            out[2*i + 1] = base | TCK;
+        }
+    }
+    
+    // Last bit leaves Shift
+    if (exit) {
+        out[2 * len - 2] |= TMS;
+        out[2 * len - 1] |= TMS;
+    }
+    
+    state = out[2 * len - 1];
+}
+
+void BitbangQueue::clear() {
+    buf.clear();
+    caps.clear();
+}
+
+void BitbangQueue::decode_sync(const uint8_t* rx) const {
+    // TDO after the TCK-low byte shows up in the echo of the next byte
+    for (const auto& c : caps)
+        bitpack_collapse(rx + c.offset + 1, 2, c.len, TDO, c.dst);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Builds the pin-state byte stream for the FTDI bitbang adapters. Every
+// clock is two bytes: TCK low with TMS/TDI applied, then TCK high. TDO is
+// sampled while TCK is low.
+class BitbangQueue {
+public:
+    static constexpr uint8_t TCK = 0x01;
+    static constexpr uint8_t TMS = 0x02;
+    static constexpr uint8_t TDI = 0x04;
+    static constexpr uint8_t TRST = 0x08;
+    static constexpr uint8_t TDO = 0x10;
+    
+    struct Capture {
+        uint8_t* dst;
+        int len;
+        size_t offset;  // stream index of the first TCK-low byte
+    };
+    
+    BitbangQueue() : state(0) {}
+    
+    void set(uint8_t mask, bool value);
+    void tms(uint32_t bits, int len);
+    void shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit);
+    void clear();
+    
+    // Synchronous bitbang echoes one byte per byte written, sampled just
+    // before the write is applied. rx must cover the whole stream.
+    void decode_sync(const uint8_t* rx) const;
+    
+    bool empty() const { return buf.empty(); }
+    const std::vector<uint8_t>& stream() const { return buf; }
+    const std::vector<Capture>& captures() const { return caps; }
+    uint8_t pins() const { return state; }
+    
+private:
+    uint8_t state;
+    std::vector<uint8_t> buf;
+    std::vector<Capture> caps;
+};
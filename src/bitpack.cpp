@@ -0,0 +1,236 @@
+#include "bitpack.h"
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BITPACK_X86 1
+#include <immintrin.h>
+#endif
+
+// Scalar reference, one bit at a time
+
+static void expand_scalar(const uint8_t* bits, size_t n, uint8_t* out,
+                          uint8_t base, uint8_t set, uint8_t clk) {
+    for (size_t i = 0; i < n; i++) {
+        uint8_t v = base | (((bits[i/8] >> (i % 8)) & 1) ? set : 0);
+        out[2*i] = v;
+        out[2*i + 1] = v | clk;
+    }
+}
+
+static void collapse_scalar(const uint8_t* in, size_t stride, size_t n,
+                            uint8_t mask, uint8_t* bits) {
+    memset(bits, 0, (n + 7) / 8);
+    for (size_t i = 0; i < n; i++) {
+        if (in[i * stride] & mask)
+            bits[i/8] |= 1 << (i % 8);
+    }
+}
+
+// Table driven: a byte spreads to eight 0x00/0xff lanes, and eight sampled
+// bytes fold back to a byte with one multiply
+
+static const uint64_t* spread_table() {
+    static const auto table = [] {
+        static uint64_t t[256];
+        for (int b = 0; b < 256; b++) {
+            uint64_t v = 0;
+            for (int i = 0; i < 8; i++)
+                if (b & (1 << i)) v |= 0xffull << (8 * i);
+            t[b] = v;
+        }
+        return t;
+    }();
+    return table;
+}
+
+static void expand_table(const uint8_t* bits, size_t n, uint8_t* out,
+                         uint8_t base, uint8_t set, uint8_t clk) {
+    const uint64_t* spread = spread_table();
+    const uint64_t ones = 0x0101010101010101ull;
+    uint64_t base8 = base * ones, set8 = set * ones;
+    
+    size_t full = n / 8;
+    for (size_t i = 0; i < full; i++) {
+        uint64_t v = base8 | (spread[bits[i]] & set8);
+        uint8_t* o = out + 16 * i;
+        for (int k = 0; k < 8; k++) {
+            uint8_t b = v >> (8 * k);
+            o[2*k] = b;
+            o[2*k + 1] = b | clk;
+        }
+    }
+    
+    if (n % 8)
+        expand_scalar(bits + full, n % 8, out + 16 * full, base, set, clk);
+}
+
+static void collapse_table(const uint8_t* in, size_t stride, size_t n,
+                           uint8_t mask, uint8_t* bits) {
+    size_t full = n / 8;
+    for (size_t i = 0; i < full; i++) {
+        const uint8_t* p = in + 8 * i * stride;
+        uint64_t v = 0;
+        for (int k = 0; k < 8; k++)
+            v |= (uint64_t)((p[k * stride] & mask) != 0) << (8 * k);
+        
+        // Gather bit 0 of every lane into the top byte
+        bits[i] = (v * 0x0102040810204080ull) >> 56;
+    }
+    
+    if (n % 8)
+        collapse_scalar(in + 8 * full * stride, stride, n % 8, mask, bits + full);
+}
+
+#ifdef BITPACK_X86
+
+// SSE2: 16 bits per step. Each input byte is broadcast to eight lanes,
+// tested against its lane's bit and interleaved with the clocked copy.
+
+__attribute__((target("sse2")))
+static void expand_sse2(const uint8_t* bits, size_t n, uint8_t* out,
+                        uint8_t base, uint8_t set, uint8_t clk) {
+    const __m128i sel = _mm_set_epi8(-128, 64, 32, 16, 8, 4, 2, 1,
+                                     -128, 64, 32, 16, 8, 4, 2, 1);
+    const __m128i vbase = _mm_set1_epi8(base);
+    const __m128i vset = _mm_set1_epi8(set);
+    const __m128i vclk = _mm_set1_epi8(clk);
+    
+    size_t blocks = n / 16;
+    for (size_t i = 0; i < blocks; i++) {
+        __m128i b = _mm_set_epi64x(bits[2*i + 1] * 0x0101010101010101ll,
+                                   bits[2*i] * 0x0101010101010101ll);
+        __m128i m = _mm_cmpeq_epi8(_mm_and_si128(b, sel), sel);
+        __m128i lo = _mm_or_si128(vbase, _mm_and_si128(m, vset));
+        __m128i hi = _mm_or_si128(lo, vclk);
+        
+        __m128i* o = (__m128i*)(out + 32 * i);
+        _mm_storeu_si128(o, _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128(o + 1, _mm_unpackhi_epi8(lo, hi));
+    }
+    
+    if (n % 16)
+        expand_table(bits + 2 * blocks, n % 16, out + 32 * blocks, base, set, clk);
+}
+
+__attribute__((target("sse2")))
+static void collapse_sse2(const uint8_t* in, size_t stride, size_t n,
+                          uint8_t mask, uint8_t* bits) {
+    if (stride != 1 && stride != 2) {
+        collapse_table(in, stride, n, mask, bits);
+        return;
+    }
+    
+    const __m128i vmask = _mm_set1_epi8(mask);
+    const __m128i even = _mm_set1_epi16(0x00ff);
+    
+    // Loads must stop at the last sample, not the end of its stride
+    size_t blocks = n ? ((n - 1) * stride + 1) / (16 * stride) : 0;
+    for (size_t i = 0; i < blocks; i++) {
+        __m128i v;
+        if (stride == 1) {
+            v = _mm_loadu_si128((const __m128i*)(in + 16 * i));
+        } else {
+            const __m128i* p = (const __m128i*)(in + 32 * i);
+            __m128i a = _mm_and_si128(_mm_loadu_si128(p), even);
+            __m128i b = _mm_and_si128(_mm_loadu_si128(p + 1), even);
+            v = _mm_packus_epi16(a, b);
+        }
+        
+        __m128i m = _mm_cmpeq_epi8(_mm_and_si128(v, vmask), _mm_setzero_si128());
+        uint16_t r = ~_mm_movemask_epi8(m);
+        memcpy(bits + 2 * i, &r, 2);
+    }
+    
+    if (n > 16 * blocks)
+        collapse_table(in + 16 * blocks * stride, stride, n - 16 * blocks, mask, bits + 2 * blocks);
+}
+
+// AVX2: the same with 32 bits per step. Unpacks work within 128-bit lanes,
+// so the halves are put back in order with a cross-lane permute.
+
+__attribute__((target("avx2")))
+static void expand_avx2(const uint8_t* bits, size_t n, uint8_t* out,
+                        uint8_t base, uint8_t set, uint8_t clk) {
+    const __m256i sel = _mm256_set1_epi64x(0x8040201008040201ll);
+    const __m256i vbase = _mm256_set1_epi8(base);
+    const __m256i vset = _mm256_set1_epi8(set);
+    const __m256i vclk = _mm256_set1_epi8(clk);
+    const long long ones = 0x0101010101010101ll;
+    
+    size_t blocks = n / 32;
+    for (size_t i = 0; i < blocks; i++) {
+        const uint8_t* p = bits + 4 * i;
+        __m256i b = _mm256_set_epi64x(p[3] * ones, p[2] * ones, p[1] * ones, p[0] * ones);
+        __m256i m = _mm256_cmpeq_epi8(_mm256_and_si256(b, sel), sel);
+        __m256i lo = _mm256_or_si256(vbase, _mm256_and_si256(m, vset));
+        __m256i hi = _mm256_or_si256(lo, vclk);
+        
+        // in-lane interleave: lane 0 holds bytes 0/1, lane 1 bytes 2/3
+        __m256i a = _mm256_unpacklo_epi8(lo, hi);
+        __m256i c = _mm256_unpackhi_epi8(lo, hi);
+        
+        __m256i* o = (__m256i*)(out + 64 * i);
+        _mm256_storeu_si256(o, _mm256_permute2x128_si256(a, c, 0x20));
+        _mm256_storeu_si256(o + 1, _mm256_permute2x128_si256(a, c, 0x31));
+    }
+    
+    if (n % 32)
+        expand_sse2(bits + 4 * blocks, n % 32, out + 64 * blocks, base, set, clk);
+}
+
+__attribute__((target("avx2")))
+static void collapse_avx2(const uint8_t* in, size_t stride, size_t n,
+                          uint8_t mask, uint8_t* bits) {
+    if (stride != 1 && stride != 2) {
+        collapse_table(in, stride, n, mask, bits);
+        return;
+    }
+    
+    const __m256i vmask = _mm256_set1_epi8(mask);
+    const __m256i even = _mm256_set1_epi16(0x00ff);
+    
+    size_t blocks = n ? ((n - 1) * stride + 1) / (32 * stride) : 0;
+    for (size_t i = 0; i < blocks; i++) {
+        __m256i v;
+        if (stride == 1) {
+            v = _mm256_loadu_si256((const __m256i*)(in + 32 * i));
+        } else {
+            const __m256i* p = (const __m256i*)(in + 64 * i);
+            __m256i a = _mm256_and_si256(_mm256_loadu_si256(p), even);
+            __m256i b = _mm256_and_si256(_mm256_loadu_si256(p + 1), even);
+            v = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        }
+        
+        __m256i m = _mm256_cmpeq_epi8(_mm256_and_si256(v, vmask), _mm256_setzero_si256());
+        uint32_t r = ~(uint32_t)_mm256_movemask_epi8(m);
+        memcpy(bits + 4 * i, &r, 4);
+    }
+    
+    if (n > 32 * blocks)
+        collapse_sse2(in + 32 * blocks * stride, stride, n - 32 * blocks, mask, bits + 4 * blocks);
+}
+
+#endif
+
+const std::vector<BitpackKernel>& bitpack_kernels() {
+    static const auto kernels = [] {
+        std::vector<BitpackKernel> k = {
+            {"scalar", expand_scalar, collapse_scalar},
+            {"table", expand_table, collapse_table},
+        };
+#ifdef BITPACK_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+            k.push_back({"sse2", expand_sse2, collapse_sse2});
+        if (__builtin_cpu_supports("avx2"))
+            k.push_back({"avx2", expand_avx2, collapse_avx2});
+#endif
+        return k;
+    }();
+    return kernels;
+}
+
+const BitpackKernel& bitpack_best() {
+    static const BitpackKernel& best = bitpack_kernels().back();
+    return best;
+}
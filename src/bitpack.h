@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Bit vector <-> adapter byte stream kernels. Bit vectors are LSB first.
+//
+// expand: one bit becomes two stream bytes, base | (bit ? set : 0) and
+// the same with clk added (the TCK low and high halves of a cycle).
+// collapse: sample n bytes at the given stride and pack (byte & mask) != 0
+// into ceil(n / 8) bytes, clearing the padding bits of the last one.
+// Nothing past the last sample is read.
+typedef void (*BitpackExpand)(const uint8_t* bits, size_t n, uint8_t* out,
+                              uint8_t base, uint8_t set, uint8_t clk);
+typedef void (*BitpackCollapse)(const uint8_t* in, size_t stride, size_t n,
+                                uint8_t mask, uint8_t* bits);
+
+struct BitpackKernel {
+    const char* name;
+    BitpackExpand expand;
+    BitpackCollapse collapse;
+};
+
+// Every kernel this CPU can run, slowest first
+const std::vector<BitpackKernel>& bitpack_kernels();
+
+// Fastest kernel, picked at runtime
+const BitpackKernel& bitpack_best();
+
+inline void bitpack_expand(const uint8_t* bits, size_t n, uint8_t* out,
+                           uint8_t base, uint8_t set, uint8_t clk) {
+    bitpack_best().expand(bits, n, out, base, set, clk);
+}
+
+inline void bitpack_collapse(const uint8_t* in, size_t stride, size_t n,
+                             uint8_t mask, uint8_t* bits) {
+    bitpack_best().collapse(in, stride, n, mask, bits);
+}
@@ -23,6 +23,15 @@ Config Config::load(const std::string& file) {
         else if (key == "pid") cfg.pid = std::stoul(val, 0, 0);
         else if (key == "clock") cfg.clock_speed = std::stoi(val);
         else if (key == "adapter") cfg.adapter_type = val;
+        else if (key == "serial") cfg.serial = val;
+        else if (key == "usb_path") cfg.usb_path = val;
+        else if (key == "tap") cfg.tap = std::stoi(val);
+        else if (key == "broadcast") cfg.broadcast = (val == "true");
+        else if (key == "loader") cfg.use_loader = (val == "true");
+        else if (key == "diff") cfg.diff = (val == "true");
+        else if (key == "verify") cfg.verify_crc = (val != "readback");
+        else if (key == "socket") cfg.socket = val;
+        else if (key == "devdb") cfg.devdb = val;
     }
     
     return cfg;
@@ -36,6 +45,15 @@ void Config::save(const std::string& file) const {
     f << "pid=0x" << std::hex << pid << "\n";
     f << "clock=" << std::dec << clock_speed << "\n";
     f << "adapter=" << adapter_type << "\n";
+    if (!serial.empty()) f << "serial=" << serial << "\n";
+    if (!usb_path.empty()) f << "usb_path=" << usb_path << "\n";
+    if (tap >= 0) f << "tap=" << tap << "\n";
+    f << "broadcast=" << (broadcast ? "true" : "false") << "\n";
+    f << "loader=" << (use_loader ? "true" : "false") << "\n";
+    f << "diff=" << (diff ? "true" : "false") << "\n";
+    f << "verify=" << (verify_crc ? "crc" : "readback") << "\n";
+    if (!socket.empty()) f << "socket=" << socket << "\n";
+    if (!devdb.empty()) f << "devdb=" << devdb << "\n";
 }
 
 Config Config::from_args(int argc, char* argv[]) {
@@ -52,10 +70,43 @@ Config Config::from_args(int argc, char* argv[]) {
             if (i + 1 < argc) cfg.vid = std::stoul(argv[++i], 0, 0);
         } else if (arg == "--pid") {
             if (i + 1 < argc) cfg.pid = std::stoul(argv[++i], 0, 0);
+        } else if (arg == "--adapter") {
+            if (i + 1 < argc) cfg.adapter_type = argv[++i];
+        } else if (arg == "--serial") {
+            if (i + 1 < argc) cfg.serial = argv[++i];
+        } else if (arg == "--usb-path") {
+            if (i + 1 < argc) cfg.usb_path = argv[++i];
+        } else if (arg == "--tap") {
+            if (i + 1 < argc) cfg.tap = std::stoi(argv[++i]);
+        } else if (arg == "--broadcast") {
+            cfg.broadcast = true;
+        } else if (arg == "--clock") {
+            if (i + 1 < argc) cfg.clock_speed = std::stoul(argv[++i], 0, 0);
+        } else if (arg == "--no-loader") {
+            cfg.use_loader = false;
+        } else if (arg == "--full") {
+            cfg.diff = false;
+        } else if (arg == "--readback") {
+            cfg.verify_crc = false;
+        } else if (arg == "--socket") {
+            if (i + 1 < argc) cfg.socket = argv[++i];
+        } else if (arg == "--no-daemon") {
+            cfg.no_daemon = true;
+        } else if (arg == "--devdb") {
+            if (i + 1 < argc) cfg.devdb = argv[++i];
+        } else if (arg == "--format") {
+            if (i + 1 < argc) cfg.format = argv[++i];
+        } else if (arg == "--rediscover") {
+            cfg.rediscover = true;
+        } else if (arg == "--stats") {
+            cfg.stats = true;
+        } else if (arg == "--stats-json") {
+            if (i + 1 < argc) cfg.stats_json = argv[++i];
         } else if (arg == "--config") {
             if (i + 1 < argc) {
-                cfg.config_file = argv[++i];
-                cfg = load(cfg.config_file);
+                std::string file = argv[++i];
+                cfg = load(file);
+                cfg.config_file = file;
             }
         }
     }
@@ -11,6 +11,20 @@ struct Config {
     uint32_t pid = 0x6010;
     uint32_t clock_speed = 1000;  // kHz
     std::string adapter_type = "ftdi";
+    std::string serial;           // pick an adapter by USB serial number
+    std::string usb_path;         // ... or by where it is plugged in
+    int tap = -1;                 // chain position, -1 for the first known part
+    bool broadcast = false;       // drive every TAP like the chosen one at once
+    bool use_loader = true;       // RAM flash loader when the driver has one
+    bool diff = true;             // only rewrite sectors that changed
+    bool verify_crc = true;       // verify by on-target CRC, not readback
+    std::string socket;           // daemon socket, empty for the per-user default
+    bool no_daemon = false;       // don't hand the command to a running daemon
+    std::string devdb;            // compiled device database, empty for the built-in one
+    std::string format;           // dump output: bin, ihex or hex; empty to go by file name
+    bool rediscover = false;      // ignore the cached CoreSight topology
+    bool stats = false;           // print per-layer counters after the command
+    std::string stats_json;       // ... or write them as JSON here, "-" for stdout
     std::string config_file;
     
     static Config load(const std::string& file);
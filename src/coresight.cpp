@@ -0,0 +1,310 @@
+#include "coresight.h"
+#include "dap.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+static const int MAX_APS = 256;
+static const int MAX_DEPTH = 8;
+static const uint32_t ROM_ENTRIES = 960;   // 0x000-0xEFC
+static const uint32_t ROM_CHUNK = 16;      // entries read at a time
+static const uint16_t ARM = 0x43B;
+static const char CACHE_MAGIC[] = "jtag-iie topology 1";
+
+// The identification registers at the top of every component's 4 KB:
+// DEVARCH at 0xFBC, then PIDR4-7, PIDR0-3 and CIDR0-3 from 0xFD0
+static const uint32_t IDENT = 0xFBC;
+static const uint32_t IDENT_WORDS = 17;
+static const int I_DEVARCH = 0;
+static const int I_PIDR4 = 5;
+static const int I_PIDR0 = 9;
+static const int I_CIDR0 = 13;
+
+struct Ident {
+    uint8_t cls;
+    uint16_t designer;
+    uint16_t part;
+    uint32_t devarch;
+    uint64_t pidr;
+};
+
+static const char* const KIND_NAMES[] = {"rom", "scs", "dwt", "fpb", "itm", "etm", "tpiu", "other"};
+
+const char* cs_kind_name(CsKind kind) {
+    return KIND_NAMES[(int)kind];
+}
+
+int CsTopology::cores() const {
+    int n = 0;
+    for (const auto& c : components) {
+        if (c.kind == CsKind::Scs) n++;
+    }
+    return n;
+}
+
+uint32_t CsTopology::base(CsKind kind) const {
+    for (const auto& c : components) {
+        if (c.kind == kind && c.ap == mem_ap) return c.base;
+    }
+    return 0;
+}
+
+// False when the read fails, which also sets *failed, or there's no
+// component (bad CIDR preamble)
+static bool read_ident(const CsRead& read, uint8_t ap, uint32_t base, Ident* id, bool* failed = nullptr) {
+    uint32_t w[IDENT_WORDS];
+    if (!read(ap, base + IDENT, w, IDENT_WORDS)) {
+        if (failed) *failed = true;
+        return false;
+    }
+    
+    const uint32_t* cidr = w + I_CIDR0;
+    if ((cidr[0] & 0xff) != 0x0d || (cidr[1] & 0x0f) != 0 || (cidr[2] & 0xff) != 0x05 ||
+        (cidr[3] & 0xff) != 0xb1)
+        return false;
+    
+    uint8_t p[8];
+    for (int i = 0; i < 4; i++) {
+        p[i] = w[I_PIDR0 + i];
+        p[4 + i] = w[I_PIDR4 + i];
+    }
+    
+    id->cls = (cidr[1] >> 4) & 0xf;
+    id->part = p[0] | ((p[1] & 0xf) << 8);
+    id->designer = ((p[4] & 0xf) << 8) | (p[1] >> 4) | ((p[2] & 7) << 4);
+    id->devarch = w[I_DEVARCH];
+    id->pidr = 0;
+    for (int i = 0; i < 8; i++) id->pidr |= (uint64_t)p[i] << (8 * i);
+    return true;
+}
+
+static CsKind classify(const Ident& id) {
+    if (id.cls == 0x1) return CsKind::Rom;
+    
+    // ARMv8-M and CoreSight 3 parts name their architecture in DEVARCH
+    if ((id.devarch & (1u << 20)) && (id.devarch >> 21) == 0x23B) {
+        switch (id.devarch & 0xffff) {
+            case 0x0af7: return CsKind::Rom;
+            case 0x2a04: return CsKind::Scs;
+            case 0x1a02: return CsKind::Dwt;
+            case 0x1a03: return CsKind::Fpb;
+            case 0x1a01: return CsKind::Itm;
+            case 0x4a13: return CsKind::Etm;
+        }
+    }
+    
+    // Earlier ones by ARM part number: Cortex-M0/M0+, M3, M4 and M7
+    if (id.designer != ARM) return CsKind::Other;
+    switch (id.part) {
+        case 0x000: case 0x008: case 0x00c: return CsKind::Scs;
+        case 0x002: case 0x00a: return CsKind::Dwt;
+        case 0x003: case 0x00b: case 0x00e: return CsKind::Fpb;
+        case 0x001: return CsKind::Itm;
+        case 0x924: case 0x925: case 0x975: return CsKind::Etm;
+        case 0x923: case 0x9a1: return CsKind::Tpiu;
+    }
+    return CsKind::Other;
+}
+
+struct Walk {
+    const CsRead& read;
+    CsTopology* topo;
+    std::set<uint64_t> seen;   // tables that point at each other
+    bool failed = false;       // a read went wrong, so the walk is incomplete
+};
+
+static void visit(Walk& w, uint8_t ap, uint32_t base, int depth);
+
+static void walk_rom(Walk& w, uint8_t ap, uint32_t rom, int depth) {
+    for (uint32_t i = 0; i < ROM_ENTRIES; i += ROM_CHUNK) {
+        uint32_t e[ROM_CHUNK];
+        if (!w.read(ap, rom + 4 * i, e, ROM_CHUNK)) {
+            w.failed = true;
+            return;
+        }
+        
+        for (uint32_t k = 0; k < ROM_CHUNK; k++) {
+            if (e[k] == 0) return;
+            
+            // Present, 32-bit format; the offset is signed
+            if ((e[k] & 3) == 3) visit(w, ap, rom + (e[k] & 0xfffff000), depth + 1);
+        }
+    }
+}
+
+static void visit(Walk& w, uint8_t ap, uint32_t base, int depth) {
+    if (depth > MAX_DEPTH || !w.seen.insert((uint64_t)ap << 32 | base).second) return;
+    
+    Ident id;
+    if (!read_ident(w.read, ap, base, &id, &w.failed)) return;
+    
+    CsKind kind = classify(id);
+    w.topo->components.push_back({ap, base, kind, id.designer, id.part, id.cls});
+    if (kind == CsKind::Scs && w.topo->mem_ap < 0) w.topo->mem_ap = ap;
+    if (kind == CsKind::Rom) walk_rom(w, ap, base, depth);
+}
+
+std::string cs_cache_dir() {
+    std::string dir;
+#ifdef _WIN32
+    const char* local = getenv("LOCALAPPDATA");
+    if (!local || !*local) return "";
+    dir = std::string(local) + "\\jtag-iie";
+    _mkdir(dir.c_str());
+#else
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (xdg && *xdg) dir = xdg;
+    else if (home && *home) dir = std::string(home) + "/.cache";
+    else return "";
+    mkdir(dir.c_str(), 0700);
+    dir += "/jtag-iie";
+    mkdir(dir.c_str(), 0700);
+#endif
+    return dir;
+}
+
+static std::string cache_file(uint32_t idcode, uint64_t rom_pidr) {
+    std::string dir = cs_cache_dir();
+    if (dir.empty()) return "";
+    
+    char name[64];
+    snprintf(name, sizeof(name), "/topology-%08x-%016llx", idcode, (unsigned long long)rom_pidr);
+    return dir + name;
+}
+
+static bool load(const std::string& file, CsTopology* topo) {
+    std::ifstream f(file);
+    std::string line;
+    if (!f || !std::getline(f, line) || line != CACHE_MAGIC) return false;
+    
+    CsTopology t;
+    t.rom_pidr = topo->rom_pidr;
+    while (std::getline(f, line)) {
+        std::istringstream in(line);
+        std::string what;
+        in >> what >> std::hex;
+        
+        if (what == "mem_ap") {
+            in >> std::dec >> t.mem_ap;
+        } else if (what == "ap") {
+            unsigned index;
+            CsAp ap;
+            in >> index >> ap.idr >> ap.base;
+            ap.index = index;
+            t.aps.push_back(ap);
+        } else if (what == "component") {
+            unsigned ap, designer, part, cls;
+            std::string kind;
+            CsComponent c;
+            in >> ap >> c.base >> kind >> designer >> part >> cls;
+            
+            int k = 0;
+            while (k < (int)CsKind::Other && kind != KIND_NAMES[k]) k++;
+            c.ap = ap;
+            c.kind = (CsKind)k;
+            c.designer = designer;
+            c.part = part;
+            c.cls = cls;
+            t.components.push_back(c);
+        }
+        if (in.fail()) return false;
+    }
+    
+    if (t.aps.empty()) return false;
+    *topo = t;
+    return true;
+}
+
+// Written under a private name and renamed, so a concurrent connect never
+// reads half a file
+static void save(const std::string& file, const CsTopology& t) {
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    std::string tmp = file + "." + std::to_string(pid) + "." +
+                      std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream f(tmp);
+        f << CACHE_MAGIC << "\n" << std::hex;
+        for (const auto& ap : t.aps)
+            f << "ap " << (unsigned)ap.index << " " << ap.idr << " " << ap.base << "\n";
+        for (const auto& c : t.components) {
+            f << "component " << (unsigned)c.ap << " " << c.base << " " << cs_kind_name(c.kind) << " "
+              << c.designer << " " << c.part << " " << (unsigned)c.cls << "\n";
+        }
+        f << std::dec << "mem_ap " << t.mem_ap << "\n";
+        if (!f) {
+            std::remove(tmp.c_str());
+            return;
+        }
+    }
+#ifdef _WIN32
+    std::remove(file.c_str());
+#endif
+    if (std::rename(tmp.c_str(), file.c_str()) != 0) std::remove(tmp.c_str());
+}
+
+bool cs_discover(Dap& dap, const CsRead& read, uint32_t idcode, bool rediscover, CsTopology* topo) {
+    *topo = CsTopology();
+    
+    // The cache key costs one AP read and one block read: AP 0's ROM table
+    // PIDR, which tells apart parts behind the same kind of DP. A key that
+    // couldn't be read is neither loaded nor saved.
+    Walk w{read, topo, {}};
+    uint32_t base0 = 0;
+    Ident rom;
+    if (!dap.ap_read(0, Dap::AP_BASE, &base0)) w.failed = true;
+    else if ((base0 & 1) && base0 != 0xffffffff && read_ident(read, 0, base0 & ~0xfffu, &rom, &w.failed))
+        topo->rom_pidr = rom.pidr;
+    
+    std::string file = cache_file(idcode, topo->rom_pidr);
+    if (!rediscover && !w.failed && !file.empty() && load(file, topo)) return true;
+    
+    // APs are numbered from 0 without gaps in practice; IDR 0 ends them
+    for (int ap = 0; ap < MAX_APS; ap++) {
+        uint32_t idr = 0;
+        if (!dap.ap_read(ap, Dap::AP_IDR, &idr)) {
+            w.failed = true;
+            break;
+        }
+        if (idr == 0) break;
+        
+        // MEM-APs are class 0x8 in IDR[16:13]
+        uint32_t base = 0;
+        bool mem = ((idr >> 13) & 0xf) == 0x8;
+        if (mem && !dap.ap_read(ap, Dap::AP_BASE, &base)) {
+            w.failed = true;
+            base = 0;
+        }
+        topo->aps.push_back({(uint8_t)ap, idr, base});
+        
+        if (mem && (base & 1) && base != 0xffffffff) visit(w, ap, base & ~0xfffu, 0);
+    }
+    
+    if (topo->aps.empty()) return false;
+    
+    // What was found is still used this time, but a transient error mustn't
+    // stick for every later connect
+    if (w.failed) {
+        std::cerr << "CoreSight discovery hit a read error; topology is incomplete and not cached\n";
+        return true;
+    }
+    if (!file.empty()) save(file, *topo);
+    return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+class Dap;
+
+enum class CsKind { Rom, Scs, Dwt, Fpb, Itm, Etm, Tpiu, Other };
+
+const char* cs_kind_name(CsKind kind);
+
+// One component found through a ROM table. designer is the JEP106 code as
+// (continuation << 8) | id, so ARM is 0x43B.
+struct CsComponent {
+    uint8_t ap;
+    uint32_t base;
+    CsKind kind;
+    uint16_t designer;
+    uint16_t part;
+    uint8_t cls;       // CIDR1[7:4]: 1 ROM table, 9 CoreSight, 0xE system
+};
+
+struct CsAp {
+    uint8_t index;
+    uint32_t idr;
+    uint32_t base;     // BASE as read, entry present in bit 0
+};
+
+// APs and debug components of one target, in discovery order
+struct CsTopology {
+    uint64_t rom_pidr = 0;      // PIDR0-7 of AP 0's ROM table, a byte each
+    std::vector<CsAp> aps;
+    std::vector<CsComponent> components;
+    int mem_ap = -1;            // AP that reaches the first SCS
+    
+    int cores() const;
+    
+    // First component of this kind on mem_ap, 0 when there isn't one
+    uint32_t base(CsKind kind) const;
+};
+
+// n words at addr through MEM-AP ap
+using CsRead = std::function<bool(uint8_t ap, uint32_t addr, uint32_t* words, uint32_t n)>;
+
+// Enumerate the APs by IDR and walk each MEM-AP's ROM table, nested ones
+// included. A topology already on disk for this IDCODE and ROM PIDR is
+// used instead of walking, unless rediscover is set; a fresh walk is
+// saved there unless a read failed during it.
+bool cs_discover(Dap& dap, const CsRead& read, uint32_t idcode, bool rediscover, CsTopology* topo);
+
+// $XDG_CACHE_HOME/jtag-iie (or ~/.cache/jtag-iie), %LOCALAPPDATA%\jtag-iie
+// on Windows; created on demand
+std::string cs_cache_dir();
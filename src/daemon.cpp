@@ -0,0 +1,344 @@
+#include "daemon.h"
+#include <iostream>
+#include <mutex>
+#include <streambuf>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#ifdef _WIN32
+
+std::string daemon_socket_path() {
+    return "";
+}
+
+bool daemon_serve(const std::string& path, const DaemonHandler& handler) {
+    (void)path; (void)handler;
+    std::cerr << "Daemon mode needs Unix domain sockets, not available in this build\n";
+    return false;
+}
+
+bool daemon_call(const std::string& path, const std::vector<std::string>& args, int* status) {
+    (void)path; (void)args; (void)status;
+    return false;
+}
+
+#else
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const uint32_t MAX_FRAME = 1 << 20;
+static const size_t OUT_CHUNK = 4096;
+
+static bool write_all(int fd, const void* data, size_t n) {
+    const char* p = (const char*)data;
+    while (n) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t n) {
+    char* p = (char*)data;
+    while (n) {
+        ssize_t r = recv(fd, p, n, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static bool send_frame(int fd, char type, const void* data, uint32_t len) {
+    uint8_t head[5] = {(uint8_t)type, (uint8_t)len, (uint8_t)(len >> 8),
+                       (uint8_t)(len >> 16), (uint8_t)(len >> 24)};
+    return write_all(fd, head, 5) && write_all(fd, data, len);
+}
+
+static bool recv_frame(int fd, char* type, std::string* payload) {
+    uint8_t head[5];
+    if (!read_all(fd, head, 5)) return false;
+
+    uint32_t len = head[1] | (head[2] << 8) | (head[3] << 16) | ((uint32_t)head[4] << 24);
+    if (len > MAX_FRAME) return false;
+
+    *type = head[0];
+    payload->resize(len);
+    return read_all(fd, payload->data(), len);
+}
+
+// A stream sent as 'O' or 'E' frames. The tied stream is flushed first,
+// so stdout and stderr reach the client in the order they were written.
+// Commands may write from more than one thread (dump's writer prints while
+// the reader reports errors), so streams on one connection share a lock
+// over their buffers and the frames they send.
+class FrameOut : public std::streambuf {
+public:
+    FrameOut(int fd, char type, std::recursive_mutex& lock, FrameOut* tied = nullptr)
+        : fd(fd), type(type), lock(lock), tied(tied) {}
+    ~FrameOut() { sync(); }
+
+protected:
+    int overflow(int c) override {
+        if (c == EOF) return 0;
+        std::lock_guard<std::recursive_mutex> g(lock);
+        buf.push_back((char)c);
+        if (buf.size() >= OUT_CHUNK) sync();
+        return c;
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        std::lock_guard<std::recursive_mutex> g(lock);
+        buf.append(s, n);
+        if (buf.size() >= OUT_CHUNK) sync();
+        return n;
+    }
+
+    // A client that went away just loses the output
+    int sync() override {
+        std::lock_guard<std::recursive_mutex> g(lock);
+        if (tied) tied->sync();
+        if (!buf.empty()) send_frame(fd, type, buf.data(), buf.size());
+        buf.clear();
+        return 0;
+    }
+
+private:
+    int fd;
+    char type;
+    std::recursive_mutex& lock;
+    FrameOut* tied;
+    std::string buf;
+};
+
+// Reads a line at a time from the client, asking with an 'I' frame
+class FrameIn : public std::streambuf {
+public:
+    FrameIn(int fd, FrameOut* prompt) : fd(fd), prompt(prompt) {}
+
+protected:
+    int underflow() override {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+
+        // Whatever asked the question has to be on screen first
+        prompt->pubsync();
+
+        char type;
+        if (!send_frame(fd, 'I', nullptr, 0) || !recv_frame(fd, &type, &line) ||
+            type != 'D' || line.empty())
+            return traits_type::eof();
+
+        setg(line.data(), line.data(), line.data() + line.size());
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    int fd;
+    FrameOut* prompt;
+    std::string line;
+};
+
+std::string daemon_socket_path() {
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    if (dir && *dir) return std::string(dir) + "/jtag-iie.sock";
+    return "/tmp/jtag-iie-" + std::to_string(getuid()) + ".sock";
+}
+
+static bool make_addr(const std::string& path, sockaddr_un* addr) {
+    if (path.size() >= sizeof(addr->sun_path)) {
+        std::cerr << "Socket path too long: " << path << "\n";
+        return false;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path.c_str(), path.size());
+    return true;
+}
+
+static void serve_client(int fd, const DaemonHandler& handler, bool* stop) {
+    char type;
+    std::string payload;
+    if (!recv_frame(fd, &type, &payload) || type != 'C') return;
+
+    std::vector<std::string> args;
+    for (size_t pos = 0; pos < payload.size(); ) {
+        size_t end = payload.find('\0', pos);
+        if (end == std::string::npos) end = payload.size();
+        args.push_back(payload.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    if (args.empty()) return;
+
+    // File names on the command line are relative to the client
+    std::string cwd = args[0];
+    args.erase(args.begin());
+
+    int status = 1;
+    {
+        std::recursive_mutex lock;
+        FrameOut out(fd, 'O', lock);
+        FrameOut err(fd, 'E', lock, &out);
+        FrameIn in(fd, &out);
+
+        std::streambuf* old_out = std::cout.rdbuf(&out);
+        std::streambuf* old_err = std::cerr.rdbuf(&err);
+        std::streambuf* old_in = std::cin.rdbuf(&in);
+
+        // The daemon resolves its own relative paths (config, devdb, the
+        // topology cache) from where it was started, so it goes back there
+        int home = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (chdir(cwd.c_str()) < 0) std::cerr << "Can't enter " << cwd << ": " << strerror(errno) << "\n";
+
+        // Option parsing throws on bad numbers; that mustn't end the daemon
+        try {
+            status = handler(args, stop);
+        } catch (const std::exception& e) {
+            std::cerr << "Bad arguments: " << e.what() << "\n";
+        }
+
+        if (home >= 0) {
+            if (fchdir(home) < 0) std::cerr << "Can't return to the daemon's directory: " << strerror(errno) << "\n";
+            close(home);
+        }
+
+        std::cout.flush();
+        std::cerr.flush();
+        std::cout.rdbuf(old_out);
+        std::cerr.rdbuf(old_err);
+        std::cin.rdbuf(old_in);
+        std::cout.clear();
+        std::cerr.clear();
+        std::cin.clear();
+    }
+
+    uint8_t st[4] = {(uint8_t)status, (uint8_t)(status >> 8), (uint8_t)(status >> 16),
+                     (uint8_t)(status >> 24)};
+    send_frame(fd, 'X', st, 4);
+}
+
+bool daemon_serve(const std::string& path, const DaemonHandler& handler) {
+    sockaddr_un addr;
+    if (!make_addr(path, &addr)) return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        std::cerr << "socket: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    // Nobody answered on it, so any socket file there is stale. Only this
+    // user may connect.
+    unlink(path.c_str());
+    mode_t mask = umask(0077);
+    int r = bind(fd, (sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+
+    if (r < 0 || listen(fd, 8) < 0) {
+        std::cerr << "Can't listen on " << path << ": " << strerror(errno) << "\n";
+        close(fd);
+        return false;
+    }
+
+    std::cout << "Listening on " << path << std::endl;
+
+    bool stop = false;
+    while (!stop) {
+        int client = accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "accept: " << strerror(errno) << "\n";
+            break;
+        }
+        serve_client(client, handler, &stop);
+        close(client);
+    }
+
+    close(fd);
+    unlink(path.c_str());
+    return true;
+}
+
+// The default path can sit in /tmp, where anyone could put a socket that
+// fakes a daemon: only talk to one this user owns and that is run by them
+static bool trusted(const std::string& path, int fd) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) < 0 || !S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+        std::cerr << "Ignoring " << path << ": not a socket owned by this user\n";
+        return false;
+    }
+#ifdef SO_PEERCRED
+    ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid()) {
+        std::cerr << "Ignoring " << path << ": the daemon runs as another user\n";
+        return false;
+    }
+#else
+    (void)fd;
+#endif
+    return true;
+}
+
+bool daemon_call(const std::string& path, const std::vector<std::string>& args, int* status) {
+    sockaddr_un addr;
+    if (!make_addr(path, &addr)) return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || !trusted(path, fd)) {
+        close(fd);
+        return false;
+    }
+
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) cwd[0] = 0;
+
+    std::string payload = cwd;
+    payload.push_back('\0');
+    for (const auto& a : args) {
+        payload += a;
+        payload.push_back('\0');
+    }
+    if (!send_frame(fd, 'C', payload.data(), payload.size())) {
+        close(fd);
+        return false;
+    }
+
+    *status = 1;
+    char type;
+    std::string data;
+    while (recv_frame(fd, &type, &data)) {
+        if (type == 'O') {
+            fwrite(data.data(), 1, data.size(), stdout);
+            fflush(stdout);
+        } else if (type == 'E') {
+            fwrite(data.data(), 1, data.size(), stderr);
+        } else if (type == 'I') {
+            std::string line;
+            if (std::getline(std::cin, line)) line += "\n";
+            send_frame(fd, 'D', line.data(), line.size());
+        } else if (type == 'X' && data.size() == 4) {
+            *status = (uint8_t)data[0] | ((uint8_t)data[1] << 8) | ((uint8_t)data[2] << 16) |
+                      ((uint32_t)(uint8_t)data[3] << 24);
+            close(fd);
+            return true;
+        }
+    }
+
+    close(fd);
+    std::cerr << "Lost the connection to the daemon\n";
+    return true;
+}
+
+#endif
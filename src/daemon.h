@@ -0,0 +1,31 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// A probe daemon keeps the adapter open and the target attached between
+// commands. Clients connect to a Unix socket, send one command and read
+// its output until the exit status, one connection per command.
+//
+// Frames are a type byte, a 4-byte little-endian length and the payload:
+//   client -> daemon  'C'  working directory, then the command line, each
+//                          NUL-terminated
+//                     'D'  one line of stdin, answering 'I'
+//   daemon -> client  'O'  stdout bytes
+//                     'E'  stderr bytes
+//                     'I'  the command is reading stdin
+//                     'X'  4-byte exit status, last frame of the command
+
+// $XDG_RUNTIME_DIR/jtag-iie.sock, or one per user in /tmp
+std::string daemon_socket_path();
+
+// Runs a command for each client, in the client's working directory and
+// with std::cout, std::cerr and std::cin connected to it, until a command
+// sets *stop. Commands run one at a time.
+using DaemonHandler = std::function<int(const std::vector<std::string>& args, bool* stop)>;
+bool daemon_serve(const std::string& path, const DaemonHandler& handler);
+
+// Hands args to a running daemon and relays its output. False when no
+// daemon is listening, so the caller can do the work itself.
+bool daemon_call(const std::string& path, const std::vector<std::string>& args, int* status);
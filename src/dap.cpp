@@ -0,0 +1,335 @@
+#include "dap.h"
+#include "jtag.h"
+#include <iostream>
+
+static const int MAX_RETRIES = 10;
+static const int MAX_IDLE_CYCLES = 1024;
+
+Dap::Dap(Jtag* j, const std::vector<int>& t)
+    : jtag(j), taps(t), width(t.empty() ? 1 : t.size()), cur_ir(0xff), ir_seen(0),
+      idle_cycles(0), ctrl(0), jtag_resets(0), quiet(false) {}
+
+bool Dap::init() {
+    invalidate();
+    jtag_resets = jtag->reset_count();
+    idle_cycles = 0;
+    ctrl = CDBGPWRUPREQ | CSYSPWRUPREQ | ORUNDETECT;
+    
+    // Power up the debug and system domains, clearing any stale errors
+    if (!dp_write(DP_CTRL_STAT, ctrl | STICKYERR | STICKYCMP | STICKYORUN))
+        return false;
+    
+    for (int i = 0; i < 100; i++) {
+        uint32_t stat = 0;
+        if (!dp_read(DP_CTRL_STAT, &stat)) return false;
+        if ((stat & (CDBGPWRUPACK | CSYSPWRUPACK)) == (CDBGPWRUPACK | CSYSPWRUPACK))
+            return true;
+        jtag->delay(100);
+    }
+    
+    std::cerr << "Debug power-up not acknowledged\n";
+    return false;
+}
+
+void Dap::set_ir(uint8_t ir) {
+    // Another TAP's IR scan will have put ours in BYPASS
+    if (jtag->ir_count() != ir_seen) cur_ir = 0xff;
+    
+    if (ir == cur_ir) {
+        stats_.ir_elided++;
+        return;
+    }
+    jtag->queue_ir(taps, &ir, IR_LEN);
+    cur_ir = ir;
+    ir_seen = jtag->ir_count();
+    stats_.ir_scans++;
+}
+
+void Dap::queue_op(const Op& op, uint8_t* out) {
+    set_ir(op.ap ? IR_APACC : IR_DPACC);
+    
+    // RnW, A[3:2], DATIN[31:0]
+    uint64_t req = ((uint64_t)op.value << 3) | (((op.reg >> 2) & 3) << 1) | (op.read ? 1 : 0);
+    uint8_t buf[5];
+    for (int i = 0; i < 5; i++) buf[i] = req >> (8 * i);
+    
+    jtag->queue_dr(taps, buf, 35, out);
+    if (idle_cycles) jtag->idle(idle_cycles);
+}
+
+static uint64_t unpack35(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 5; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v & ((1ull << 35) - 1);
+}
+
+void Dap::invalidate() {
+    shadow = Shadow();
+    cur_ir = 0xff;
+}
+
+void Dap::emit(const Op& op) {
+    batch.push_back(op);
+    
+    if (op.ap) {
+        ApShadow& aps = next.ap[next.select >> 24];
+        if (!op.read && op.reg == AP_CSW) {
+            aps.csw = op.value;
+            aps.csw_valid = true;
+        } else if (!op.read && op.reg == AP_TAR) {
+            aps.tar = op.value;
+            aps.tar_valid = true;
+        } else if (op.reg == AP_DRW) {
+            // Single auto-increment by the access size, wrapping at 1 KB
+            if (!aps.csw_valid) aps.tar_valid = false;
+            else if (((aps.csw >> 4) & 3) == 1) {
+                uint32_t step = 1u << (aps.csw & 3);
+                aps.tar = (aps.tar & ~0x3ffu) | ((aps.tar + step) & 0x3ff);
+            } else if ((aps.csw >> 4) & 3) {
+                aps.tar_valid = false;
+            }
+        }
+    } else if (!op.read && op.reg == DP_SELECT) {
+        next.select = op.value;
+        next.select_valid = true;
+    }
+}
+
+int Dap::run(uint8_t ap, const Op* ops, int n) {
+    // A TAP reset puts IDCODE in the IR and may have reset the DP
+    if (jtag->reset_count() != jtag_resets) {
+        jtag_resets = jtag->reset_count();
+        invalidate();
+    }
+    
+    // Build the batch against a scratch copy of the shadow, which only
+    // becomes the real one if every scan is acknowledged
+    next = shadow;
+    ApShadow& aps = next.ap[ap];
+    batch.clear();
+    scan_of.assign(n, -1);
+    
+    for (int i = 0; i < n; i++) {
+        const Op& op = ops[i];
+        
+        if (op.ap) {
+            uint32_t sel = ((uint32_t)ap << 24) | (op.reg & 0xf0);
+            if (!next.select_valid || next.select != sel) emit(dp_wr(DP_SELECT, sel));
+            else stats_.dr_elided++;
+            
+            // Resuming in the middle of an auto-increment run
+            if (op.inc && !(aps.tar_valid && aps.tar == op.tar))
+                emit(ap_wr(AP_TAR, op.tar));
+            
+            bool same = !op.read &&
+                ((op.reg == AP_CSW && aps.csw_valid && aps.csw == op.value) ||
+                 (op.reg == AP_TAR && aps.tar_valid && aps.tar == op.value));
+            if (same) {
+                stats_.dr_elided++;
+                scan_of[i] = (int)batch.size() - 1;
+                continue;
+            }
+        } else if (!op.read && op.reg == DP_SELECT && next.select_valid && next.select == op.value) {
+            stats_.dr_elided++;
+            scan_of[i] = (int)batch.size() - 1;
+            continue;
+        }
+        
+        emit(op);
+        scan_of[i] = (int)batch.size() - 1;
+    }
+    
+    // RDBUFF delivers the last read and acknowledges the last write
+    emit(dp_rd(DP_RDBUFF, nullptr));
+    
+    // 5 bytes of response per DP per scan
+    int stride = 5 * width;
+    resp.assign(batch.size() * stride, 0);
+    for (size_t k = 0; k < batch.size(); k++)
+        queue_op(batch[k], &resp[stride * k]);
+    stats_.dr_scans += batch.size();
+    
+    if (!jtag->flush()) {
+        invalidate();
+        return -1;
+    }
+    
+    // Scans before 'completed' are known to have finished
+    int completed = batch.size();
+    bool ok = true;
+    for (size_t k = 0; k < batch.size(); k++) {
+        const uint8_t* r = &resp[stride * k];
+        
+        // A fault on any DP fails the batch; a WAIT on any holds it up
+        int ack = ACK_OK;
+        for (int m = 0; m < width; m++) {
+            int a = unpack35(r + 5 * m) & 7;
+            if (a == ACK_WAIT) ack = a;
+            else if (a != ACK_OK) {
+                ack = a;
+                break;
+            }
+        }
+        
+        if (ack == ACK_WAIT) {
+            // Everything before k was accepted. A write in flight will
+            // still land; a read's result is gone and has to be redone.
+            stats_.waits++;
+            completed = k;
+            if (k > 0 && batch[k - 1].read) completed = k - 1;
+            break;
+        }
+        
+        if (ack != ACK_OK) {
+            if (!quiet) std::cerr << "DAP: bad ACK " << ack << "\n";
+            ok = false;
+            break;
+        }
+        
+        // This scan carries the result of the previous one
+        if (k > 0 && batch[k - 1].read) {
+            uint32_t v = unpack35(r) >> 3;
+            bool same = true;
+            for (int m = 1; m < width; m++) {
+                if ((unpack35(r + 5 * m) >> 3) != v) same = false;
+            }
+            
+            if (!same) {
+                stats_.disagree++;
+                completed = k - 1;
+                break;
+            }
+            if (batch[k - 1].dst) *batch[k - 1].dst = v;
+        }
+    }
+    
+    if (!ok) {
+        invalidate();
+        return -1;
+    }
+    
+    if (completed == (int)batch.size()) {
+        shadow = next;
+        return n;
+    }
+    
+    // What the DP holds after a partial batch isn't worth reconstructing
+    invalidate();
+    if (!recover()) return -1;
+    
+    int done = 0;
+    while (done < n && scan_of[done] < completed) done++;
+    return done;
+}
+
+void Dap::backoff(int attempt) {
+    idle_cycles = idle_cycles ? idle_cycles * 2 : 1;
+    if (idle_cycles > MAX_IDLE_CYCLES) idle_cycles = MAX_IDLE_CYCLES;
+    
+    if (attempt > 1)
+        jtag->delay(10 << (attempt - 2));
+}
+
+// Clear STICKYORUN so accesses after the WAIT take effect again
+bool Dap::recover() {
+    std::vector<uint8_t> out(10 * width);
+    for (int attempt = 1; attempt <= MAX_RETRIES; attempt++) {
+        queue_op(dp_wr(DP_CTRL_STAT, ctrl | STICKYORUN), &out[0]);
+        queue_op(dp_rd(DP_RDBUFF, nullptr), &out[5 * width]);
+        if (!jtag->flush()) return false;
+        
+        bool ok = true;
+        for (int i = 0; i < 2 * width; i++) {
+            if ((unpack35(&out[5 * i]) & 7) != ACK_OK) ok = false;
+        }
+        if (ok) return true;
+        
+        // Still stuck behind the AP: cancel the transaction
+        if (attempt == MAX_RETRIES / 2) {
+            uint8_t abort[5] = {0x08, 0, 0, 0, 0};  // DAPABORT
+            set_ir(IR_ABORT);
+            jtag->queue_dr(taps, abort, 35);
+        }
+        backoff(attempt);
+    }
+    
+    if (!quiet) std::cerr << "DAP: stuck in WAIT\n";
+    return false;
+}
+
+bool Dap::transfer(uint8_t ap, const Op* ops, int n, bool check) {
+    std::vector<Op> list(ops, ops + n);
+    uint32_t stat = 0;
+    if (check) list.push_back(dp_rd(DP_CTRL_STAT, &stat));
+    
+    int total = list.size();
+    int done = 0;
+    int attempt = 0;
+    while (done < total) {
+        int r = run(ap, list.data() + done, total - done);
+        if (r < 0) {
+            clear_errors();
+            return false;
+        }
+        
+        // Only count attempts that made no progress
+        done += r;
+        if (r > 0) attempt = 0;
+        if (done < total) {
+            if (++attempt > MAX_RETRIES) {
+                if (!quiet) std::cerr << (width > 1 ? "DAP: TAPs keep waiting or disagreeing\n"
+                                                    : "DAP: too many WAITs\n");
+                return false;
+            }
+            backoff(attempt);
+        }
+    }
+    
+    if (check && (stat & STICKYERR)) {
+        if (!quiet) std::cerr << "DAP: transfer fault\n";
+        invalidate();
+        clear_errors();
+        return false;
+    }
+    
+    return true;
+}
+
+bool Dap::clear_errors() {
+    Op op = dp_wr(DP_CTRL_STAT, ctrl | STICKYERR | STICKYCMP | STICKYORUN);
+    bool ok = run(0, &op, 1) == 1;
+    invalidate();
+    return ok;
+}
+
+bool Dap::dp_read(uint8_t reg, uint32_t* value) {
+    Op op = dp_rd(reg, value);
+    return transfer(0, &op, 1, false);
+}
+
+bool Dap::dp_write(uint8_t reg, uint32_t value) {
+    Op op = dp_wr(reg, value);
+    return transfer(0, &op, 1, false);
+}
+
+bool Dap::ap_read(uint8_t ap, uint8_t reg, uint32_t* value) {
+    Op op = ap_rd(reg, value);
+    return transfer(ap, &op, 1);
+}
+
+bool Dap::ap_write(uint8_t ap, uint8_t reg, uint32_t value) {
+    Op op = ap_wr(reg, value);
+    return transfer(ap, &op, 1);
+}
+
+bool Dap::ap_read_block(uint8_t ap, uint8_t reg, uint32_t* values, uint32_t n) {
+    std::vector<Op> ops(n);
+    for (uint32_t i = 0; i < n; i++) ops[i] = ap_rd(reg, &values[i]);
+    return transfer(ap, ops.data(), n);
+}
+
+bool Dap::ap_write_block(uint8_t ap, uint8_t reg, const uint32_t* values, uint32_t n) {
+    std::vector<Op> ops(n);
+    for (uint32_t i = 0; i < n; i++) ops[i] = ap_wr(reg, values[i]);
+    return transfer(ap, ops.data(), n);
+}
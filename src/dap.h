@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class Jtag;
+
+// ARM ADIv5 JTAG-DP transaction layer. Every DPACC/APACC scan returns the
+// result of the previous read, so reads are pipelined and a batch closes
+// with an RDBUFF read. Overrun detection is enabled: after a WAIT nothing
+// else in the batch takes effect, and the batch resumes from there.
+// SELECT, CSW and TAR writes that would not change anything are skipped.
+//
+// On a chain the DP is reached through its TAP's index. Given several
+// TAPs (identical parts), every scan goes to all of them at once: writes
+// land on each, and a read only completes once they all return the same
+// value, so polls wait for the slowest. A batch resumed after a WAIT or a
+// disagreement repeats its later scans on the TAPs that had taken them,
+// which is harmless for memory and AP register accesses.
+class Dap {
+public:
+    // JTAG-DP instructions
+    static constexpr int IR_LEN = 4;
+    static constexpr uint8_t IR_ABORT = 0x8;
+    static constexpr uint8_t IR_DPACC = 0xa;
+    static constexpr uint8_t IR_APACC = 0xb;
+    static constexpr uint8_t IR_IDCODE = 0xe;
+    static constexpr uint8_t IR_BYPASS = 0xf;
+    
+    // DP registers
+    static constexpr uint8_t DP_CTRL_STAT = 0x4;
+    static constexpr uint8_t DP_SELECT = 0x8;
+    static constexpr uint8_t DP_RDBUFF = 0xc;
+    
+    // CTRL/STAT bits
+    static constexpr uint32_t ORUNDETECT = 1u << 0;
+    static constexpr uint32_t STICKYORUN = 1u << 1;
+    static constexpr uint32_t STICKYCMP = 1u << 4;
+    static constexpr uint32_t STICKYERR = 1u << 5;
+    static constexpr uint32_t CDBGPWRUPREQ = 1u << 28;
+    static constexpr uint32_t CDBGPWRUPACK = 1u << 29;
+    static constexpr uint32_t CSYSPWRUPREQ = 1u << 30;
+    static constexpr uint32_t CSYSPWRUPACK = 1u << 31;
+    
+    // MEM-AP registers
+    static constexpr uint8_t AP_CSW = 0x00;
+    static constexpr uint8_t AP_TAR = 0x04;
+    static constexpr uint8_t AP_DRW = 0x0c;
+    static constexpr uint8_t AP_BASE = 0xf8;
+    static constexpr uint8_t AP_IDR = 0xfc;
+    
+    // One DPACC or APACC access. reg is the full register address; for AP
+    // accesses bits [7:4] go to SELECT.APBANKSEL. A DRW access under
+    // auto-increment carries the address it targets, so TAR can be
+    // reloaded when a batch resumes at it.
+    struct Op {
+        bool ap;
+        bool read;
+        uint8_t reg;
+        uint32_t value;
+        uint32_t* dst;
+        bool inc = false;
+        uint32_t tar = 0;
+    };
+    
+    static Op dp_rd(uint8_t reg, uint32_t* dst) { return {false, true, reg, 0, dst}; }
+    static Op dp_wr(uint8_t reg, uint32_t v) { return {false, false, reg, v, nullptr}; }
+    static Op ap_rd(uint8_t reg, uint32_t* dst) { return {true, true, reg, 0, dst}; }
+    static Op ap_wr(uint8_t reg, uint32_t v) { return {true, false, reg, v, nullptr}; }
+    static Op drw_rd(uint32_t tar, uint32_t* dst) { return {true, true, AP_DRW, 0, dst, true, tar}; }
+    static Op drw_wr(uint32_t tar, uint32_t v) { return {true, false, AP_DRW, v, nullptr, true, tar}; }
+    
+    Dap(Jtag* jtag, const std::vector<int>& taps = {});
+    
+    bool init();
+    
+    bool dp_read(uint8_t reg, uint32_t* value);
+    bool dp_write(uint8_t reg, uint32_t value);
+    bool ap_read(uint8_t ap, uint8_t reg, uint32_t* value);
+    bool ap_write(uint8_t ap, uint8_t reg, uint32_t value);
+    
+    // Pipelined: n reads of one register cost n + 1 scans
+    bool ap_read_block(uint8_t ap, uint8_t reg, uint32_t* values, uint32_t n);
+    bool ap_write_block(uint8_t ap, uint8_t reg, const uint32_t* values, uint32_t n);
+    
+    // Runs ops on one AP in as few flushes as WAITs allow, retrying from
+    // the first op that didn't complete. A read whose result was lost to
+    // a WAIT is issued again. With check set, CTRL/STAT is read in the same
+    // batch and a sticky error fails the call.
+    bool transfer(uint8_t ap, const Op* ops, int n, bool check = true);
+    
+    // One attempt: returns how many leading ops completed, -1 on a
+    // protocol error or sticky fault
+    int run(uint8_t ap, const Op* ops, int n);
+    
+    bool clear_errors();
+    
+    // Forget the shadowed SELECT/CSW/TAR and the current IR
+    void invalidate();
+    
+    // Run-Test/Idle cycles added after each AP access since WAITs were
+    // seen; reset_backoff() starts again from none, as init() does
+    int backoff_cycles() const { return idle_cycles; }
+    void reset_backoff() { idle_cycles = 0; }
+    
+    // Failures are still returned, just not reported on std::cerr, for
+    // callers that expect them
+    void set_quiet(bool on) { quiet = on; }
+    
+    struct Stats {
+        uint64_t dr_scans = 0;
+        uint64_t ir_scans = 0;
+        uint64_t dr_elided = 0;   // SELECT/CSW/TAR writes the shadow skipped
+        uint64_t ir_elided = 0;
+        uint64_t waits = 0;
+        uint64_t disagree = 0;    // broadcast reads retried
+    };
+    const Stats& stats() const { return stats_; }
+    
+private:
+    enum { ACK_WAIT = 0x1, ACK_OK = 0x2 };
+    
+    // Host-side copy of what the DP and each MEM-AP currently hold. TAR
+    // follows auto-increment, including the 1 KB wrap.
+    struct ApShadow {
+        bool csw_valid = false;
+        bool tar_valid = false;
+        uint32_t csw = 0;
+        uint32_t tar = 0;
+    };
+    
+    struct Shadow {
+        bool select_valid = false;
+        uint32_t select = 0;
+        ApShadow ap[256];
+    };
+    
+    void emit(const Op& op);
+    
+    void set_ir(uint8_t ir);
+    void queue_op(const Op& op, uint8_t* resp);
+    bool recover();
+    void backoff(int attempt);
+    
+    Jtag* jtag;
+    std::vector<int> taps;
+    int width;                // DPs answering each scan
+    uint8_t cur_ir;
+    uint32_t ir_seen;         // Jtag::ir_count() after our last IR scan
+    int idle_cycles;
+    uint32_t ctrl;
+    uint32_t jtag_resets;
+    bool quiet;
+    
+    Shadow shadow;
+    Shadow next;
+    Stats stats_;
+    
+    std::vector<Op> batch;
+    std::vector<int> scan_of;
+    std::vector<uint8_t> resp;
+};
@@ -0,0 +1,547 @@
+#include "device.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Source format: a [NAME] section per part with key = value lines, and #
+// comments. Sizes take a K or M suffix.
+//
+//   [STM32F103C8]
+//   vendor = STMicroelectronics
+//   idcode = 0x1BA01477
+//   flash  = 0x08000000 64K 1K       base, size, sector size; one per region
+//   ram    = 20K
+//   fpu    = no
+//   dsp    = no
+//   driver = stm32f1
+//   match  = 0xE0042000 0xfff 0x410  address (or rom+offset), mask, value
+//
+// Compiled format, every field a little-endian 32-bit word:
+//
+//   header   magic, then part, bucket, region and match counts and the
+//            size of the string table
+//   buckets  first part and part count, for a power of two of buckets
+//            picked by hashing the IDCODE without its version field
+//   parts    grouped by bucket, in source order within each
+//   regions, matches
+//   strings  NUL-terminated, referenced by offset; offset 0 is ""
+//
+// Opening a file only checks that the sections fit, so it costs the same
+// for four parts or four thousand; records are checked as they're decoded.
+
+static const char MAGIC[8] = {'J', 'T', 'A', 'G', 'D', 'D', 'B', '1'};
+static const uint32_t PART_MASK = 0x0fffffff;
+static const uint32_t FLAG_FPU = 1u << 0;
+static const uint32_t FLAG_DSP = 1u << 1;
+static const uint32_t MATCH_ROM = 1u << 0;
+
+struct DbHeader {
+    char magic[8];
+    uint32_t parts;
+    uint32_t buckets;
+    uint32_t regions;
+    uint32_t matches;
+    uint32_t strings;
+    uint32_t reserved;
+};
+
+struct DbBucket {
+    uint32_t first;
+    uint32_t count;
+};
+
+struct DbPart {
+    uint32_t idcode;
+    uint32_t name;
+    uint32_t vendor;
+    uint32_t driver;
+    uint32_t flash_size;
+    uint32_t ram_size;
+    uint32_t flags;
+    uint32_t region;
+    uint32_t regions;
+    uint32_t match;
+    uint32_t matches;
+};
+
+struct DbRegion {
+    uint32_t addr;
+    uint32_t size;
+    uint32_t sector_size;
+};
+
+struct DbMatch {
+    uint32_t addr;
+    uint32_t mask;
+    uint32_t value;
+    uint32_t flags;
+};
+
+// The parts this build knows without a database file
+static const char BUILTIN[] = R"(
+[STM32F103C8]
+vendor = STMicroelectronics
+idcode = 0x1BA01477
+flash = 0x08000000 64K 1K
+ram = 20K
+driver = stm32f1
+match = 0xE0042000 0xfff 0x410
+match = 0xE000ED00 0x00f00000 0x00100000
+
+# Same IDCODE and DBGMCU_IDCODE as the STM32; its Cortex-M3 is r2, not r1
+[GD32F103C8]
+vendor = GigaDevice
+idcode = 0x1BA01477
+flash = 0x08000000 64K 1K
+ram = 20K
+driver = stm32f1
+match = 0xE000ED00 0x00f00000 0x00200000
+
+[STM32F407VG]
+vendor = STMicroelectronics
+idcode = 0x2BA01477
+flash = 0x08000000 1M 16K
+ram = 192K
+fpu = yes
+dsp = yes
+
+[LPC1768]
+vendor = NXP
+idcode = 0x4BA00477
+flash = 0x00000000 512K 4K
+ram = 64K
+)";
+
+static uint32_t bucket_of(uint32_t idcode, uint32_t buckets) {
+    uint32_t h = (idcode & PART_MASK) * 0x9E3779B1u;
+    return (h ^ (h >> 15)) & (buckets - 1);
+}
+
+static std::string trim(const std::string& s) {
+    size_t a = s.find_first_not_of(" \t\r");
+    if (a == std::string::npos) return "";
+    size_t b = s.find_last_not_of(" \t\r");
+    return s.substr(a, b - a + 1);
+}
+
+static bool parse_number(const std::string& s, uint32_t* v) {
+    if (s.empty()) return false;
+    char* end;
+    unsigned long n = strtoul(s.c_str(), &end, 0);
+    if (*end == 'K' || *end == 'k') {
+        n *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        n *= 1024 * 1024;
+        end++;
+    }
+    *v = n;
+    return *end == 0;
+}
+
+static bool parse_bool(const std::string& s, bool* v) {
+    if (s == "yes" || s == "true") *v = true;
+    else if (s == "no" || s == "false") *v = false;
+    else return false;
+    return true;
+}
+
+static bool parse_source(std::istream& in, const std::string& name, std::vector<DeviceInfo>* parts) {
+    std::string line;
+    int n = 0;
+    while (std::getline(in, line)) {
+        n++;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+        
+        auto fail = [&](const char* what) {
+            std::cerr << name << ":" << n << ": " << what << "\n";
+            return false;
+        };
+        
+        if (line[0] == '[') {
+            if (line.back() != ']' || line.size() < 3) return fail("bad section");
+            DeviceInfo d{};
+            d.name = line.substr(1, line.size() - 2);
+            parts->push_back(d);
+            continue;
+        }
+        if (parts->empty()) return fail("key outside a [part] section");
+        
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) return fail("expected key = value");
+        std::string key = trim(line.substr(0, eq));
+        std::string val = trim(line.substr(eq + 1));
+        DeviceInfo& d = parts->back();
+        
+        std::istringstream words(val);
+        std::string a, b, c;
+        words >> a >> b >> c;
+        
+        bool ok = true;
+        if (key == "vendor") {
+            d.vendor = val;
+        } else if (key == "idcode") {
+            ok = parse_number(val, &d.idcode);
+        } else if (key == "flash") {
+            FlashRegion r;
+            ok = parse_number(a, &r.addr) && parse_number(b, &r.size) &&
+                 parse_number(c, &r.sector_size) && r.sector_size;
+            d.flash_regions.push_back(r);
+            d.flash_size += r.size;
+        } else if (key == "ram") {
+            ok = parse_number(val, &d.ram_size);
+        } else if (key == "fpu") {
+            ok = parse_bool(val, &d.has_fpu);
+        } else if (key == "dsp") {
+            ok = parse_bool(val, &d.has_dsp);
+        } else if (key == "driver") {
+            d.flash_driver = val;
+        } else if (key == "match") {
+            DeviceMatch m{};
+            m.rom = a.rfind("rom+", 0) == 0;
+            ok = parse_number(m.rom ? a.substr(4) : a, &m.addr) && parse_number(b, &m.mask) &&
+                 parse_number(c, &m.value);
+            d.match.push_back(m);
+        } else {
+            return fail("unknown key");
+        }
+        if (!ok) return fail("bad value");
+    }
+    
+    for (const auto& d : *parts) {
+        if (!d.idcode) {
+            std::cerr << name << ": " << d.name << " has no idcode\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename T>
+static void append(std::vector<uint8_t>& out, const T& v) {
+    const uint8_t* p = (const uint8_t*)&v;
+    out.insert(out.end(), p, p + sizeof(T));
+}
+
+static std::vector<uint8_t> build(const std::vector<DeviceInfo>& parts) {
+    uint32_t buckets = 1;
+    while (buckets < parts.size()) buckets *= 2;
+    
+    std::vector<uint32_t> order(parts.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {
+        return bucket_of(parts[x].idcode, buckets) < bucket_of(parts[y].idcode, buckets);
+    });
+    
+    std::string strings(1, '\0');
+    std::map<std::string, uint32_t> offsets{{"", 0}};
+    auto str = [&](const std::string& s) {
+        auto it = offsets.find(s);
+        if (it != offsets.end()) return it->second;
+        uint32_t off = strings.size();
+        strings += s;
+        strings.push_back('\0');
+        offsets[s] = off;
+        return off;
+    };
+    
+    std::vector<DbBucket> table(buckets, DbBucket{0, 0});
+    std::vector<DbPart> recs;
+    std::vector<DbRegion> regions;
+    std::vector<DbMatch> matches;
+    for (uint32_t i : order) {
+        const DeviceInfo& d = parts[i];
+        DbBucket& b = table[bucket_of(d.idcode, buckets)];
+        if (!b.count) b.first = recs.size();
+        b.count++;
+        
+        DbPart p;
+        p.idcode = d.idcode;
+        p.name = str(d.name);
+        p.vendor = str(d.vendor);
+        p.driver = str(d.flash_driver);
+        p.flash_size = d.flash_size;
+        p.ram_size = d.ram_size;
+        p.flags = (d.has_fpu ? FLAG_FPU : 0) | (d.has_dsp ? FLAG_DSP : 0);
+        p.region = regions.size();
+        p.regions = d.flash_regions.size();
+        p.match = matches.size();
+        p.matches = d.match.size();
+        recs.push_back(p);
+        
+        for (const auto& r : d.flash_regions) regions.push_back({r.addr, r.size, r.sector_size});
+        for (const auto& m : d.match) matches.push_back({m.addr, m.mask, m.value, m.rom ? MATCH_ROM : 0});
+    }
+    
+    DbHeader h;
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.parts = recs.size();
+    h.buckets = buckets;
+    h.regions = regions.size();
+    h.matches = matches.size();
+    h.strings = strings.size();
+    h.reserved = 0;
+    
+    std::vector<uint8_t> out;
+    append(out, h);
+    for (const auto& b : table) append(out, b);
+    for (const auto& p : recs) append(out, p);
+    for (const auto& r : regions) append(out, r);
+    for (const auto& m : matches) append(out, m);
+    out.insert(out.end(), strings.begin(), strings.end());
+    return out;
+}
+
+// Offsets of each section, or false if they don't fit in len
+struct DbLayout {
+    DbHeader h;
+    uint64_t buckets, parts, regions, matches, strings;
+};
+
+static bool layout(const uint8_t* data, size_t len, DbLayout* l) {
+    if (len < sizeof(DbHeader)) return false;
+    memcpy(&l->h, data, sizeof(DbHeader));
+    if (memcmp(l->h.magic, MAGIC, sizeof(MAGIC))) return false;
+    if (!l->h.buckets || (l->h.buckets & (l->h.buckets - 1)) || !l->h.strings) return false;
+    
+    l->buckets = sizeof(DbHeader);
+    l->parts = l->buckets + (uint64_t)l->h.buckets * sizeof(DbBucket);
+    l->regions = l->parts + (uint64_t)l->h.parts * sizeof(DbPart);
+    l->matches = l->regions + (uint64_t)l->h.regions * sizeof(DbRegion);
+    l->strings = l->matches + (uint64_t)l->h.matches * sizeof(DbMatch);
+    
+    // Every string offset below h.strings then ends inside the table
+    return l->strings + l->h.strings <= len && data[l->strings + l->h.strings - 1] == 0;
+}
+
+DeviceDB& DeviceDB::instance() {
+    static DeviceDB db;
+    return db;
+}
+
+DeviceDB::DeviceDB() : data(nullptr), len(0), mapping(nullptr) {
+    std::vector<DeviceInfo> parts;
+    std::istringstream in(BUILTIN);
+    if (!parse_source(in, "built-in device table", &parts)) return;
+    
+    image = build(parts);
+    attach(image.data(), image.size(), "built-in device table");
+}
+
+DeviceDB::~DeviceDB() {
+    unmap();
+}
+
+void DeviceDB::unmap() {
+#ifndef _WIN32
+    if (mapping) munmap(mapping, len);
+#endif
+    mapping = nullptr;
+    data = nullptr;
+    len = 0;
+}
+
+bool DeviceDB::attach(const uint8_t* d, size_t n, const std::string& name) {
+    DbLayout l;
+    if (!layout(d, n, &l)) {
+        std::cerr << name << ": not a compiled device database\n";
+        return false;
+    }
+    data = d;
+    len = n;
+    decoded.clear();
+    return true;
+}
+
+// Loaded before any Device exists: parts decoded from the old database
+// are dropped
+bool DeviceDB::load(const std::string& file) {
+    DbLayout l;
+
+#ifdef _WIN32
+    std::ifstream f(file, std::ios::binary);
+    if (!f) {
+        std::cerr << "Can't open " << file << "\n";
+        return false;
+    }
+    std::vector<uint8_t> buf((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    if (!layout(buf.data(), buf.size(), &l)) {
+        std::cerr << file << ": not a compiled device database\n";
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> g(lock);
+    unmap();
+    image = std::move(buf);
+    return attach(image.data(), image.size(), file);
+#else
+    int fd = open(file.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        std::cerr << "Can't open " << file << ": " << strerror(errno) << "\n";
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    
+    size_t n = st.st_size;
+    void* m = n ? mmap(nullptr, n, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (m == MAP_FAILED || !layout((const uint8_t*)m, n, &l)) {
+        std::cerr << file << ": not a compiled device database\n";
+        if (m != MAP_FAILED) munmap(m, n);
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> g(lock);
+    unmap();
+    image.clear();
+    mapping = m;
+    return attach((const uint8_t*)m, n, file);
+#endif
+}
+
+bool DeviceDB::compile(const std::string& src, const std::string& out, uint32_t* count) {
+    std::ifstream in(src);
+    if (!in) {
+        std::cerr << "Can't open " << src << "\n";
+        return false;
+    }
+    
+    std::vector<DeviceInfo> parts;
+    if (!parse_source(in, src, &parts)) return false;
+    
+    std::vector<uint8_t> bin = build(parts);
+    std::ofstream f(out, std::ios::binary);
+    if (!f.write((const char*)bin.data(), bin.size())) {
+        std::cerr << "Can't write " << out << "\n";
+        return false;
+    }
+    if (count) *count = parts.size();
+    return true;
+}
+
+// Called with the lock held
+const DeviceInfo* DeviceDB::decode(uint32_t index) const {
+    auto it = decoded.find(index);
+    if (it != decoded.end()) return &it->second;
+    
+    DbLayout l;
+    layout(data, len, &l);
+    
+    DbPart p;
+    memcpy(&p, data + l.parts + (uint64_t)index * sizeof(DbPart), sizeof(p));
+    if (p.name >= l.h.strings || p.vendor >= l.h.strings || p.driver >= l.h.strings ||
+        (uint64_t)p.region + p.regions > l.h.regions || (uint64_t)p.match + p.matches > l.h.matches) {
+        std::cerr << "Device database record " << index << " is corrupt\n";
+        return nullptr;
+    }
+    
+    const char* strings = (const char*)data + l.strings;
+    DeviceInfo d;
+    d.idcode = p.idcode;
+    d.name = strings + p.name;
+    d.vendor = strings + p.vendor;
+    d.flash_driver = strings + p.driver;
+    d.flash_size = p.flash_size;
+    d.ram_size = p.ram_size;
+    d.has_fpu = p.flags & FLAG_FPU;
+    d.has_dsp = p.flags & FLAG_DSP;
+    
+    for (uint32_t i = 0; i < p.regions; i++) {
+        DbRegion r;
+        memcpy(&r, data + l.regions + (uint64_t)(p.region + i) * sizeof(DbRegion), sizeof(r));
+        d.flash_regions.push_back({r.addr, r.size, r.sector_size});
+    }
+    for (uint32_t i = 0; i < p.matches; i++) {
+        DbMatch m;
+        memcpy(&m, data + l.matches + (uint64_t)(p.match + i) * sizeof(DbMatch), sizeof(m));
+        d.match.push_back({m.addr, m.mask, m.value, (m.flags & MATCH_ROM) != 0});
+    }
+    
+    return &decoded.emplace(index, std::move(d)).first->second;
+}
+
+std::vector<const DeviceInfo*> DeviceDB::candidates(uint32_t idcode) const {
+    std::lock_guard<std::mutex> g(lock);
+    std::vector<const DeviceInfo*> out;
+    
+    for (const auto& d : extra) {
+        if ((d.idcode & PART_MASK) == (idcode & PART_MASK)) out.push_back(&d);
+    }
+    if (!data) return out;
+    
+    DbLayout l;
+    layout(data, len, &l);
+    
+    DbBucket b;
+    memcpy(&b, data + l.buckets + (uint64_t)bucket_of(idcode, l.h.buckets) * sizeof(DbBucket), sizeof(b));
+    if ((uint64_t)b.first + b.count > l.h.parts) return out;
+    
+    for (uint32_t i = b.first; i < b.first + b.count; i++) {
+        uint32_t id;
+        memcpy(&id, data + l.parts + (uint64_t)i * sizeof(DbPart), 4);
+        if ((id & PART_MASK) != (idcode & PART_MASK)) continue;
+        
+        const DeviceInfo* d = decode(i);
+        if (d) out.push_back(d);
+    }
+    return out;
+}
+
+const DeviceInfo* DeviceDB::find(uint32_t idcode) const {
+    std::vector<const DeviceInfo*> list = candidates(idcode);
+    return list.empty() ? nullptr : list[0];
+}
+
+const DeviceInfo* DeviceDB::identify(uint32_t idcode, uint32_t rom_base,
+                                     const std::function<bool(uint32_t, uint32_t*)>& read) const {
+    std::vector<const DeviceInfo*> list = candidates(idcode);
+    if (list.size() < 2) return list.empty() ? nullptr : list[0];
+    
+    // Candidates tend to check the same few registers
+    std::map<uint32_t, std::pair<bool, uint32_t>> seen;
+    auto word = [&](uint32_t addr, uint32_t* v) {
+        auto it = seen.find(addr);
+        if (it == seen.end()) {
+            uint32_t x = 0;
+            bool ok = read(addr, &x);
+            it = seen.emplace(addr, std::make_pair(ok, x)).first;
+        }
+        *v = it->second.second;
+        return it->second.first;
+    };
+    
+    for (const DeviceInfo* d : list) {
+        bool ok = true;
+        for (const auto& m : d->match) {
+            uint32_t v;
+            if ((m.rom && !rom_base) || !word(m.rom ? rom_base + m.addr : m.addr, &v) ||
+                (v & m.mask) != m.value) {
+                ok = false;
+                break;
+            }
+        }
+        if (ok) return d;
+    }
+    
+    std::cerr << "No part with IDCODE 0x" << std::hex << idcode << std::dec
+              << " matches the target, assuming " << list[0]->name << "\n";
+    return list[0];
+}
+
+void DeviceDB::add(const DeviceInfo& dev) {
+    std::lock_guard<std::mutex> g(lock);
+    extra.push_back(dev);
+}
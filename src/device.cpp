@@ -1,87 +1,27 @@
 #include "device.h"
 #include "jtag.h"
+#include "perf.h"
 #include <iostream>
 #include <cstring>
 
-DeviceDB& DeviceDB::instance() {
-    static DeviceDB db;
-    return db;
-}
-
-DeviceDB::DeviceDB() {
-    // STM32F103C8 (Blue Pill)
-    devices.push_back({
-        .idcode = 0x1BA01477,
-        .name = "STM32F103C8",
-        .vendor = "STMicroelectronics",
-        .flash_size = 64 * 1024,
-        .ram_size = 20 * 1024,
-        .flash_regions = {{0x08000000, 64 * 1024, 1024}},
-        .has_fpu = false,
-        .has_dsp = false
-    });
-    
-    // STM32F407VG (Discovery)
-    devices.push_back({
-        .idcode = 0x2BA01477,
-        .name = "STM32F407VG",
-        .vendor = "STMicroelectronics",
-        .flash_size = 1024 * 1024,
-        .ram_size = 192 * 1024,
-        .flash_regions = {{0x08000000, 1024 * 1024, 16 * 1024}},
-        .has_fpu = true,
-        .has_dsp = true
-    });
-    
-    // GD32F103C8 (Clone)
-    devices.push_back({
-        .idcode = 0x1BA01477,  // Same as STM32
-        .name = "GD32F103C8",
-        .vendor = "GigaDevice",
-        .flash_size = 64 * 1024,
-        .ram_size = 20 * 1024,
-        .flash_regions = {{0x08000000, 64 * 1024, 1024}},
-        .has_fpu = false,
-        .has_dsp = false
-    });
-    
-    // LPC1768
-    devices.push_back({
-        .idcode = 0x4BA00477,
-        .name = "LPC1768",
-        .vendor = "NXP",
-        .flash_size = 512 * 1024,
-        .ram_size = 64 * 1024,
-        .flash_regions = {{0x00000000, 512 * 1024, 4096}},
-        .has_fpu = false,
-        .has_dsp = false
-    });
-}
-
-const DeviceInfo* DeviceDB::find(uint32_t idcode) const {
-    uint32_t part = idcode & 0x0fffffff;
-    
-    for (const auto& dev : devices) {
-        if ((dev.idcode & 0x0fffffff) == part) {
-            return &dev;
-        }
-    }
-    
-    return nullptr;
-}
-
-void DeviceDB::add(const DeviceInfo& dev) {
-    devices.push_back(dev);
-}
-
-Device::Device(uint32_t id, Jtag* j) : id(id), jtag(j), info_(nullptr) {
+Device::Device(uint32_t id, Jtag* j, const std::vector<int>& taps)
+    : id(id), jtag(j), info_(nullptr), dap(j, taps), mem_ap(0), rediscover(false), fp_base(0), fp_rev(0) {
     info_ = DeviceDB::instance().find(id);
     is_arm = (id & 0xf000) == 0x4000 || (id & 0xf000) == 0x3000 || (id & 0xf000) == 0x1000;
-    dap_base = 0xE00FF000;  // Default for ARM
 }
 
 Device::~Device() {}
 
+int Device::default_tap(const Jtag& jtag) {
+    const auto& taps = jtag.taps();
+    if (taps.empty()) return -1;
+    
+    for (size_t i = 0; i < taps.size(); i++) {
+        if (DeviceDB::instance().find(taps[i].idcode)) return i;
+    }
+    return 0;
+}
+
 bool Device::init() {
     if (!info_) {
         std::cerr << "Unknown device ID: 0x" << std::hex << id << std::dec << "\n";
@@ -93,80 +33,304 @@ bool Device::init() {
         return false;
     }
     
+    if (!dap.init()) {
+        std::cerr << "Failed to power up debug port\n";
+        return false;
+    }
+    
+    // The core is behind whichever AP leads to an SCS; without one (no ROM
+    // table, or a read failed) AP 0 and the architectural addresses it is
+    auto read = [this](uint8_t ap, uint32_t addr, uint32_t* words, uint32_t n) {
+        return mem_block(ap, addr, 4, n, nullptr, (uint8_t*)words);
+    };
+    if (cs_discover(dap, read, id, rediscover, &topo) && topo.mem_ap >= 0)
+        mem_ap = topo.mem_ap;
+    
+    // Parts sharing an IDCODE are told apart by reading the target; the ROM
+    // table base is in the MEM-AP's BASE register when bit 0 says so
+    if (DeviceDB::instance().candidates(id).size() > 1) {
+        uint32_t base = 0;
+        for (const auto& ap : topo.aps) {
+            if (ap.index == mem_ap && (ap.base & 1)) base = ap.base;
+        }
+        info_ = DeviceDB::instance().identify(id, base & ~0xfffu, [this](uint32_t addr, uint32_t* v) {
+            return read_mem(addr, (uint8_t*)v, 4);
+        });
+    }
+    
     std::cout << "Found " << info_->vendor << " " << info_->name << "\n";
     return true;
 }
 
+// Debug registers in the System Control Space
+static const uint32_t DHCSR = 0xE000EDF0;
+static const uint32_t DCRSR = 0xE000EDF4;
+static const uint32_t DCRDR = 0xE000EDF8;
+
+static const uint32_t S_REGRDY = 1u << 16;
+static const uint32_t S_HALT = 1u << 17;
+static const uint32_t REGWnR = 1u << 16;
+
 bool Device::halt() {
     // Write DHCSR to halt
     uint32_t dhcsr = 0xA05F0003;  // DBGKEY | C_HALT | C_DEBUGEN
-    return write_mem(0xE000EDF0, (uint8_t*)&dhcsr, 4);
+    if (!write_mem(DHCSR, (uint8_t*)&dhcsr, 4)) return false;
+    
+    for (int i = 0; i < 100; i++) {
+        bool h = false;
+        if (!is_halted(&h)) return false;
+        if (h) return true;
+    }
+    
+    std::cerr << "Core did not halt\n";
+    return false;
+}
+
+bool Device::is_halted(bool* halted) {
+    uint32_t dhcsr = 0;
+    if (!read_mem(DHCSR, (uint8_t*)&dhcsr, 4)) return false;
+    *halted = (dhcsr & S_HALT) != 0;
+    return true;
+}
+
+// Core registers go through DCRSR/DCRDR and are only reachable while halted.
+// 0-15 are R0-R15, 16 is xPSR.
+static bool wait_regrdy(Device* dev) {
+    for (int i = 0; i < 100; i++) {
+        uint32_t dhcsr = 0;
+        if (!dev->read_mem(DHCSR, (uint8_t*)&dhcsr, 4)) return false;
+        if (dhcsr & S_REGRDY) return true;
+    }
+    std::cerr << "Core register transfer timed out\n";
+    return false;
+}
+
+bool Device::read_reg(int reg, uint32_t* value) {
+    uint32_t sel = reg;
+    if (!write_mem(DCRSR, (uint8_t*)&sel, 4)) return false;
+    if (!wait_regrdy(this)) return false;
+    return read_mem(DCRDR, (uint8_t*)value, 4);
+}
+
+bool Device::write_reg(int reg, uint32_t value) {
+    uint32_t sel = REGWnR | reg;
+    if (!write_mem(DCRDR, (uint8_t*)&value, 4)) return false;
+    if (!write_mem(DCRSR, (uint8_t*)&sel, 4)) return false;
+    return wait_regrdy(this);
 }
 
 bool Device::resume() {
     // Clear C_HALT in DHCSR
     uint32_t dhcsr = 0xA05F0001;  // DBGKEY | C_DEBUGEN
-    return write_mem(0xE000EDF0, (uint8_t*)&dhcsr, 4);
+    return write_mem(DHCSR, (uint8_t*)&dhcsr, 4);
 }
 
-bool Device::reset() {
-    // AIRCR reset
-    uint32_t aircr = 0x05FA0004;  // VECTRESET
-    return write_mem(0xE000ED0C, (uint8_t*)&aircr, 4);
+bool Device::step() {
+    // Interrupts stay masked for the step. C_MASKINTS can only change
+    // while halted, so it is set with C_HALT still on and the step follows.
+    uint32_t dhcsr = 0xA05F000B;  // DBGKEY | C_MASKINTS | C_HALT | C_DEBUGEN
+    if (!write_mem(DHCSR, (uint8_t*)&dhcsr, 4)) return false;
+    dhcsr = 0xA05F000D;  // DBGKEY | C_MASKINTS | C_STEP | C_DEBUGEN
+    if (!write_mem(DHCSR, (uint8_t*)&dhcsr, 4)) return false;
+    
+    for (int i = 0; i < 100; i++) {
+        bool h = false;
+        if (!is_halted(&h)) return false;
+        if (h) {
+            dhcsr = 0xA05F0003;  // drop C_MASKINTS again
+            return write_mem(DHCSR, (uint8_t*)&dhcsr, 4);
+        }
+    }
+    
+    std::cerr << "Core did not halt after step\n";
+    return false;
 }
 
-bool Device::ap_select(uint8_t ap, uint32_t addr) {
-    uint32_t select = (ap << 24) | (addr & 0xf0);
-    uint8_t buf[4];
-    memcpy(buf, &select, 4);
-    jtag->shift_ir((uint8_t*)"\x8a", 5);  // DPACC
-    jtag->shift_dr(buf, 35, buf);  // 35-bit transfer
-    return true;
+uint32_t Device::component(CsKind kind, uint32_t fallback) const {
+    uint32_t base = topo.base(kind);
+    return base ? base : fallback;
 }
 
-bool Device::mem_ap_transfer(uint32_t addr, uint32_t* data, bool write) {
-    (void)addr;  // Suppress unused parameter warning
+// Flash Patch and Breakpoint unit: FP_CTRL, then the comparators from +8
+static const uint32_t FPB = 0xE0002000;
+static const uint32_t FP_COMP0 = 8;
+
+bool Device::fpb_init() {
+    if (!fp_comp.empty()) return true;
     
-    uint8_t ir = write ? 0x8b : 0x8b;  // APACC
-    uint8_t buf[4];
+    fp_base = component(CsKind::Fpb, FPB);
+    uint32_t ctrl = 0;
+    if (!read_mem(fp_base, (uint8_t*)&ctrl, 4)) return false;
     
-    if (write) {
-        memcpy(buf, data, 4);
-        jtag->shift_ir(&ir, 3);
-        jtag->shift_dr(buf, 35, nullptr);
-    } else {
-        jtag->shift_ir(&ir, 3);
-        jtag->shift_dr(nullptr, 35, buf);
-        memcpy(data, buf, 4);
+    uint32_t num = ((ctrl >> 4) & 0xf) | ((ctrl >> 8) & 0x70);
+    if (num == 0) {
+        std::cerr << "No FPB breakpoint comparators\n";
+        return false;
     }
+    fp_rev = ctrl >> 28;
+    
+    // KEY | ENABLE, and every comparator off
+    ctrl = 3;
+    if (!write_mem(fp_base, (uint8_t*)&ctrl, 4)) return false;
+    std::vector<uint8_t> zero(num * 4, 0);
+    if (!write_mem(fp_base + FP_COMP0, zero.data(), zero.size())) return false;
     
+    fp_comp.assign(num, 0);
     return true;
 }
 
-bool Device::read_mem(uint32_t addr, uint8_t* buf, uint32_t len) {
-    if (len % 4) return false;
-    
-    uint32_t* ptr = (uint32_t*)buf;
-    uint32_t words = len / 4;
+// Comparator value matching addr. Revision 1 only reaches code below
+// 0x20000000, and picks the halfword with the top bits.
+bool Device::fpb_comp(uint32_t addr, uint32_t* comp) const {
+    if (fp_rev == 0) {
+        if (addr >= 0x20000000) return false;
+        *comp = (addr & 0x1FFFFFFC) | (addr & 2 ? 0x80000000 : 0x40000000) | 1;
+    } else {
+        *comp = (addr & ~1u) | 1;
+    }
+    return true;
+}
+
+bool Device::set_breakpoint(uint32_t addr) {
+    uint32_t comp;
+    if (!fpb_init() || !fpb_comp(addr, &comp)) return false;
     
-    for (uint32_t i = 0; i < words; i++) {
-        if (!mem_ap_transfer(addr + i*4, &ptr[i], false))
-            return false;
+    for (uint32_t c : fp_comp) {
+        if (c == comp) return true;
     }
+    for (size_t i = 0; i < fp_comp.size(); i++) {
+        if (fp_comp[i]) continue;
+        if (!write_mem(fp_base + FP_COMP0 + 4 * i, (uint8_t*)&comp, 4)) return false;
+        fp_comp[i] = comp;
+        return true;
+    }
+    return false;
+}
+
+bool Device::clear_breakpoint(uint32_t addr) {
+    uint32_t comp;
+    if (!fpb_comp(addr, &comp)) return true;
     
+    for (size_t i = 0; i < fp_comp.size(); i++) {
+        if (fp_comp[i] != comp) continue;
+        uint32_t zero = 0;
+        if (!write_mem(fp_base + FP_COMP0 + 4 * i, (uint8_t*)&zero, 4)) return false;
+        fp_comp[i] = 0;
+    }
     return true;
 }
 
-bool Device::write_mem(uint32_t addr, const uint8_t* buf, uint32_t len) {
-    if (len % 4) return false;
+bool Device::clear_breakpoints() {
+    for (size_t i = 0; i < fp_comp.size(); i++) {
+        if (!fp_comp[i]) continue;
+        uint32_t zero = 0;
+        if (!write_mem(fp_base + FP_COMP0 + 4 * i, (uint8_t*)&zero, 4)) return false;
+        fp_comp[i] = 0;
+    }
+    return true;
+}
+
+bool Device::reset() {
+    // AIRCR reset
+    uint32_t aircr = 0x05FA0004;  // VECTRESET
+    bool ok = write_mem(0xE000ED0C, (uint8_t*)&aircr, 4);
+    dap.invalidate();
+    return ok;
+}
+
+// CSW: privileged data access, plus the size field. Single accesses leave
+// TAR alone so polling a register costs one DRW scan.
+static const uint32_t CSW_SINGLE = 0x23000000;
+static const uint32_t CSW_INC = 0x23000010;
+
+// TAR only auto-increments within a 1 KB block
+static const uint32_t TAR_WRAP = 1024;
+
+// Elements per transfer, so a failure doesn't cost a whole dump
+static const uint32_t BATCH_BYTES = 4096;
+
+// n elements of size bytes starting at addr on MEM-AP ap, with CSW set once and TAR
+// written once per 1 KB block. DRW accesses in between stream back to
+// back on the same IR.
+bool Device::mem_block(uint8_t ap, uint32_t addr, int size, uint32_t n, const uint8_t* wr, uint8_t* rd) {
+    uint32_t csw = (n == 1 ? CSW_SINGLE : CSW_INC) | (size == 4 ? 2 : size == 2 ? 1 : 0);
+    uint32_t lane_mask = size == 4 ? 0xffffffff : (1u << (8 * size)) - 1;
     
-    const uint32_t* ptr = (const uint32_t*)buf;
-    uint32_t words = len / 4;
+    std::vector<uint32_t> values;
+    std::vector<Dap::Op> ops;
+    uint32_t per_batch = BATCH_BYTES / size;
     
-    for (uint32_t i = 0; i < words; i++) {
-        if (!mem_ap_transfer(addr + i*4, (uint32_t*)&ptr[i], true))
+    for (uint32_t base = 0; base < n; base += per_batch) {
+        uint32_t count = n - base < per_batch ? n - base : per_batch;
+        
+        values.assign(count, 0);
+        ops.clear();
+        ops.push_back(Dap::ap_wr(Dap::AP_CSW, csw));
+        
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t a = addr + (base + i) * size;
+            if (i == 0 || a % TAR_WRAP == 0)
+                ops.push_back(Dap::ap_wr(Dap::AP_TAR, a));
+            
+            // Narrow accesses use the byte lanes of their address
+            int shift = 8 * (a & 3);
+            if (wr) {
+                uint32_t v = 0;
+                memcpy(&v, wr + (base + i) * size, size);
+                ops.push_back(Dap::drw_wr(a, v << shift));
+            } else {
+                ops.push_back(Dap::drw_rd(a, &values[i]));
+            }
+        }
+        
+        if (!dap.transfer(ap, ops.data(), ops.size()))
             return false;
+        
+        if (rd) {
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t a = addr + (base + i) * size;
+                uint32_t v = (values[i] >> (8 * (a & 3))) & lane_mask;
+                memcpy(rd + (base + i) * size, &v, size);
+            }
+        }
     }
     
     return true;
 }
+
+bool Device::read_mem(uint32_t addr, uint8_t* buf, uint32_t len) {
+    PerfTimer t;
+    int size = addr % 4 == 0 && len % 4 == 0 ? 4 : addr % 2 == 0 && len % 2 == 0 ? 2 : 1;
+    bool ok = mem_block(mem_ap, addr, size, len / size, nullptr, buf);
+    
+    stats_.reads++;
+    stats_.bytes_read += len;
+    stats_.mem_us += t.us();
+    return ok;
+}
+
+bool Device::read_repeat(uint32_t addr, uint32_t* values, uint32_t n) {
+    PerfTimer t;
+    std::vector<Dap::Op> ops;
+    ops.reserve(n + 2);
+    ops.push_back(Dap::ap_wr(Dap::AP_CSW, CSW_SINGLE | 2));
+    ops.push_back(Dap::ap_wr(Dap::AP_TAR, addr));
+    for (uint32_t i = 0; i < n; i++) ops.push_back(Dap::drw_rd(addr, &values[i]));
+    bool ok = dap.transfer(mem_ap, ops.data(), ops.size());
+    
+    stats_.reads++;
+    stats_.bytes_read += 4 * n;
+    stats_.mem_us += t.us();
+    return ok;
+}
+
+bool Device::write_mem(uint32_t addr, const uint8_t* buf, uint32_t len) {
+    PerfTimer t;
+    int size = addr % 4 == 0 && len % 4 == 0 ? 4 : addr % 2 == 0 && len % 2 == 0 ? 2 : 1;
+    bool ok = mem_block(mem_ap, addr, size, len / size, buf, nullptr);
+    
+    stats_.writes++;
+    stats_.bytes_written += len;
+    stats_.mem_us += t.us();
+    return ok;
+}
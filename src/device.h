@@ -3,7 +3,13 @@
 #include <cstdint>
 #include <string>
 #include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
 #include <cstring>
+#include "dap.h"
+#include "coresight.h"
 
 class Jtag;
 
@@ -13,6 +19,16 @@ struct FlashRegion {
     uint32_t sector_size;
 };
 
+// A read that tells apart parts sharing an IDCODE: the word at addr, or
+// at the CoreSight ROM table base plus addr when rom is set, must equal
+// value under mask
+struct DeviceMatch {
+    uint32_t addr;
+    uint32_t mask;
+    uint32_t value;
+    bool rom;
+};
+
 struct DeviceInfo {
     uint32_t idcode;
     std::string name;
@@ -22,44 +38,135 @@ struct DeviceInfo {
     std::vector<FlashRegion> flash_regions;
     bool has_fpu;
     bool has_dsp;
+    std::string flash_driver;           // "stm32f1", empty for none
+    std::vector<DeviceMatch> match;
 };
 
+// Parts by JTAG IDCODE (version field ignored), from a compiled database
+// file or the built-in table, which is compiled the same way at startup.
+// The file is mapped, hash-indexed by IDCODE and only the records asked
+// for are decoded. See devdb.cpp for the source and binary formats.
 class DeviceDB {
 public:
     static DeviceDB& instance();
+    ~DeviceDB();
+    
+    // Use a compiled database instead of the built-in table
+    bool load(const std::string& file);
+    
+    // Source text to a compiled database file
+    static bool compile(const std::string& src, const std::string& out, uint32_t* parts = nullptr);
     
     const DeviceInfo* find(uint32_t idcode) const;
+    
+    // Every part with this IDCODE, in source order
+    std::vector<const DeviceInfo*> candidates(uint32_t idcode) const;
+    
+    // The first candidate whose match reads all agree with the target, the
+    // first one at all if none do. rom_base is 0 when there's no ROM table.
+    const DeviceInfo* identify(uint32_t idcode, uint32_t rom_base,
+                               const std::function<bool(uint32_t, uint32_t*)>& read) const;
+    
     void add(const DeviceInfo& dev);
     
 private:
     DeviceDB();
     
-    std::vector<DeviceInfo> devices;
+    void unmap();
+    bool attach(const uint8_t* data, size_t len, const std::string& name);
+    const DeviceInfo* decode(uint32_t index) const;
+    
+    const uint8_t* data;
+    size_t len;
+    void* mapping;                      // data when it is a mapped file
+    std::vector<uint8_t> image;         // data when it isn't
+    
+    std::deque<DeviceInfo> extra;       // add()ed, searched first
+    mutable std::unordered_map<uint32_t, DeviceInfo> decoded;
+    mutable std::mutex lock;            // gang boards identify in parallel
 };
 
 class Device {
 public:
-    Device(uint32_t id, Jtag* jtag);
+    // taps picks the device's TAP on a scanned chain; several identical
+    // ones are driven together (see Dap)
+    Device(uint32_t id, Jtag* jtag, const std::vector<int>& taps = {});
     ~Device();
     
     bool init();
     const DeviceInfo* info() const { return info_; }
     
+    // First TAP on a scanned chain the database knows, else 0; -1 for an
+    // empty chain
+    static int default_tap(const Jtag& jtag);
+    
     bool halt();
     bool resume();
     bool reset();
+    bool is_halted(bool* halted);
+    
+    // Execute one instruction from halt and halt again
+    bool step();
+    
+    // Hardware breakpoints on FPB comparators. set fails when they are all
+    // in use or the FPB can't reach addr.
+    bool set_breakpoint(uint32_t addr);
+    bool clear_breakpoint(uint32_t addr);
+    bool clear_breakpoints();
+    
+    bool read_reg(int reg, uint32_t* value);
+    bool write_reg(int reg, uint32_t value);
     
     bool read_mem(uint32_t addr, uint8_t* buf, uint32_t len);
     bool write_mem(uint32_t addr, const uint8_t* buf, uint32_t len);
     
+    // n reads of the word at addr, TAR left alone, pipelined back to back:
+    // a register sampled as fast as the link goes
+    bool read_repeat(uint32_t addr, uint32_t* values, uint32_t n);
+    
+    // APs and debug components found at init
+    const CsTopology& topology() const { return topo; }
+    
+    // Walk the ROM tables at init even when a cached topology matches
+    void set_rediscover(bool on) { rediscover = on; }
+    
+    // A component on the core's AP as the ROM table places it, else the
+    // architectural address given
+    uint32_t component(CsKind kind, uint32_t fallback) const;
+    
+    Dap& debug_port() { return dap; }
+    const Dap& debug_port() const { return dap; }
+    
+    // Memory traffic through the MEM-AP
+    struct Stats {
+        uint64_t reads = 0;
+        uint64_t writes = 0;
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+        uint64_t mem_us = 0;       // with perf_timing on
+    };
+    const Stats& stats() const { return stats_; }
+    
 private:
     uint32_t id;
     Jtag* jtag;
     const DeviceInfo* info_;
     
     bool is_arm;
-    uint32_t dap_base;
     
-    bool ap_select(uint8_t ap, uint32_t addr);
-    bool mem_ap_transfer(uint32_t addr, uint32_t* data, bool write);
+    Dap dap;
+    uint8_t mem_ap;
+    CsTopology topo;
+    bool rediscover;
+    
+    // FPB comparator values, 0 when free; empty until first used
+    std::vector<uint32_t> fp_comp;
+    uint32_t fp_base;
+    uint32_t fp_rev;
+    
+    Stats stats_;
+    
+    bool fpb_init();
+    bool fpb_comp(uint32_t addr, uint32_t* comp) const;
+    bool mem_block(uint8_t ap, uint32_t addr, int size, uint32_t n, const uint8_t* wr, uint8_t* rd);
 };
@@ -0,0 +1,152 @@
+#include "dump.h"
+#include "flash.h"
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Read and written a chunk at a time; a multiple of 16 so hexdump lines
+// never straddle two
+static const uint32_t CHUNK = 64 * 1024;
+
+bool dump_format(const std::string& name, DumpFormat* fmt) {
+    if (name == "bin") *fmt = DumpFormat::Bin;
+    else if (name == "ihex") *fmt = DumpFormat::Ihex;
+    else if (name == "hex") *fmt = DumpFormat::Hexdump;
+    else return false;
+    return true;
+}
+
+DumpFormat dump_format_for(const std::string& path) {
+    auto ends_with = [&](const char* ext) {
+        std::string e = ext;
+        return path.size() > e.size() && path.compare(path.size() - e.size(), e.size(), e) == 0;
+    };
+    if (ends_with(".bin")) return DumpFormat::Bin;
+    if (ends_with(".hex") || ends_with(".ihex")) return DumpFormat::Ihex;
+    return DumpFormat::Hexdump;
+}
+
+// Text is built in one string per chunk and written with a single call;
+// a printf per byte was most of the time of a large dump
+class DumpWriter {
+public:
+    explicit DumpWriter(DumpFormat fmt) : fmt(fmt), upper(~0u) {}
+    
+    void write(std::ostream& out, uint32_t addr, const uint8_t* data, uint32_t n) {
+        if (fmt == DumpFormat::Bin) {
+            out.write((const char*)data, n);
+            return;
+        }
+        
+        text.clear();
+        if (fmt == DumpFormat::Ihex) ihex(addr, data, n);
+        else hexdump(addr, data, n);
+        out.write(text.data(), text.size());
+    }
+    
+    void finish(std::ostream& out) {
+        if (fmt != DumpFormat::Ihex) return;
+        text.clear();
+        record(0x01, 0, nullptr, 0);
+        out.write(text.data(), text.size());
+    }
+
+private:
+    void byte(uint8_t b, const char* digits) {
+        text += digits[b >> 4];
+        text += digits[b & 0xf];
+    }
+    
+    // Same layout the dump command has always printed
+    void hexdump(uint32_t addr, const uint8_t* data, uint32_t n) {
+        static const char digits[] = "0123456789abcdef";
+        for (uint32_t i = 0; i < n; i++) {
+            if (i % 16 == 0) {
+                for (int shift = 24; shift >= 0; shift -= 8) byte((addr + i) >> shift, digits);
+                text += ": ";
+            }
+            byte(data[i], digits);
+            text += ' ';
+            if (i % 16 == 15) text += '\n';
+        }
+        if (n % 16) text += '\n';
+    }
+    
+    void record(uint8_t type, uint16_t addr, const uint8_t* data, uint32_t n) {
+        static const char digits[] = "0123456789ABCDEF";
+        uint8_t sum = n + (addr >> 8) + addr + type;
+        text += ':';
+        byte(n, digits);
+        byte(addr >> 8, digits);
+        byte(addr, digits);
+        byte(type, digits);
+        for (uint32_t i = 0; i < n; i++) {
+            byte(data[i], digits);
+            sum += data[i];
+        }
+        byte(-sum, digits);
+        text += '\n';
+    }
+    
+    // 16-byte data records, with an extended linear address record
+    // whenever the upper half of the address changes
+    void ihex(uint32_t addr, const uint8_t* data, uint32_t n) {
+        for (uint32_t i = 0; i < n;) {
+            uint32_t a = addr + i;
+            if (a >> 16 != upper) {
+                upper = a >> 16;
+                uint8_t ela[2] = {(uint8_t)(upper >> 8), (uint8_t)upper};
+                record(0x04, 0, ela, 2);
+            }
+            
+            uint32_t len = n - i < 16 ? n - i : 16;
+            if (len > 0x10000 - (a & 0xffff)) len = 0x10000 - (a & 0xffff);
+            record(0x00, a, data + i, len);
+            i += len;
+        }
+    }
+    
+    DumpFormat fmt;
+    uint32_t upper;        // last extended linear address written
+    std::string text;
+};
+
+bool dump_memory(Flash& flash, uint32_t addr, uint32_t len, DumpFormat fmt, std::ostream& out,
+                 const DumpProgress& progress) {
+    DumpWriter writer(fmt);
+    std::vector<uint8_t> bufs[2] = {std::vector<uint8_t>(CHUNK), std::vector<uint8_t>(CHUNK)};
+    std::thread busy;
+    bool ok = true;
+    
+    // Chunk i is read into one buffer while the writer still has chunk i-1
+    // in the other
+    uint32_t n = 0;
+    for (uint32_t done = 0, i = 0; done < len; done += n, i++) {
+        n = len - done < CHUNK ? len - done : CHUNK;
+        std::vector<uint8_t>& buf = bufs[i & 1];
+        bool read = flash.read(addr + done, buf.data(), n);
+        
+        if (busy.joinable()) busy.join();
+        if (!read) {
+            std::cerr << "Read failed at 0x" << std::hex << addr + done << std::dec << "\n";
+            ok = false;
+            break;
+        }
+        if (!out) break;
+        if (progress) progress(done, len);
+        
+        busy = std::thread([&writer, &out, &buf, a = addr + done, n] {
+            writer.write(out, a, buf.data(), n);
+        });
+    }
+    if (busy.joinable()) busy.join();
+    
+    if (ok) writer.finish(out);
+    out.flush();
+    if (ok && !out) {
+        std::cerr << "Write failed\n";
+        ok = false;
+    }
+    if (ok && progress) progress(len, len);
+    return ok;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+
+class Flash;
+
+enum class DumpFormat { Bin, Ihex, Hexdump };
+
+// "bin", "ihex" or "hex"; false for anything else
+bool dump_format(const std::string& name, DumpFormat* fmt);
+
+// What a file name suggests: .bin raw, .hex/.ihex Intel HEX, else hexdump
+DumpFormat dump_format_for(const std::string& path);
+
+using DumpProgress = std::function<void(uint32_t done, uint32_t total)>;
+
+// len bytes from addr to out, a chunk at a time so memory use doesn't grow
+// with len. A second thread formats and writes each chunk while the next
+// one is read. False on a read or write error, with a message on stderr.
+bool dump_memory(Flash& flash, uint32_t addr, uint32_t len, DumpFormat fmt, std::ostream& out,
+                 const DumpProgress& progress = nullptr);
@@ -1,24 +1,154 @@
 #include "flash.h"
 #include "device.h"
 #include "jtag.h"
+#include "image.h"
+#include "perf.h"
 #include <iostream>
 #include <cstring>
 
-Flash::Flash(Device* d, Jtag* j) : dev(d), jtag(j), driver(nullptr) {}
+Flash::Flash(Device* d, Jtag* j)
+    : dev(d), jtag(j), driver(nullptr), use_loader(true), use_checksum(true) {}
 
 Flash::~Flash() {
     if (driver) delete driver;
 }
 
+void LatencyHistogram::add(uint32_t us) {
+    int b = 0;
+    while (b < BUCKETS - 1 && (us >> (b + 1))) b++;
+    buckets[b]++;
+    n++;
+    total += us;
+    if (us > max) max = us;
+}
+
+void LatencyHistogram::print(std::ostream& os, const char* name) const {
+    if (!n) return;
+    
+    os << name << ": " << n << " ops, avg " << total / n << " us, max " << max << " us\n";
+    for (int b = 0; b < BUCKETS; b++) {
+        if (!buckets[b]) continue;
+        uint32_t lo = b ? 1u << b : 0;
+        uint32_t hi = (1u << (b + 1)) - 1;
+        os << "  " << lo << "-" << hi << " us: " << buckets[b] << "\n";
+    }
+}
+
+// Extra time allowed past the datasheet maximum for the link itself
+static const uint32_t LINK_SLACK_US = 10000;
+
+static uint32_t since(const Jtag* jtag, uint64_t t) {
+    return jtag->now_us() - t;
+}
+
+bool FlashDriver::poll(Jtag* jtag, uint32_t max_us, uint32_t step_us) {
+    uint64_t start = jtag->now_us();
+    uint32_t step = step_us < 10 ? 10 : step_us;
+    
+    for (;;) {
+        uint64_t t = jtag->now_us();
+        FlashStatus st = status();
+        poll_us = since(jtag, t);
+        polls_++;
+        
+        if (!st.busy) return !st.error;
+        if (st.error) return false;  // status couldn't be read
+        
+        if (since(jtag, start) > max_us + LINK_SLACK_US) {
+            std::cerr << "Flash operation timed out after " << since(jtag, start) << " us\n";
+            return false;
+        }
+        
+        jtag->delay(step);
+        if (step < max_us / 8) step *= 2;
+    }
+}
+
+bool FlashDriver::wait_busy(Jtag* jtag, FlashOp op) {
+    FlashTiming t = timing(op);
+    uint64_t start = jtag->now_us();
+    
+    // A poll over a slow link may already outlast the operation
+    if (t.typical_us > poll_us) jtag->delay(t.typical_us - poll_us);
+    
+    bool ok = poll(jtag, t.max_us, t.typical_us / 8);
+    histograms[(int)op].add(since(jtag, start));
+    return ok;
+}
+
+bool FlashDriver::wait_idle(Jtag* jtag) {
+    uint32_t longest = 0;
+    for (int op = 0; op < (int)FlashOp::Count; op++) {
+        uint32_t m = timing((FlashOp)op).max_us;
+        if (m > longest) longest = m;
+    }
+    return poll(jtag, longest, 10);
+}
+
+// CRC-32/MPEG-2 over little-endian words, as the STM32 CRC unit computes
+// it: polynomial 0x04C11DB7, MSB first, initial value all ones
+uint32_t flash_crc32(const uint8_t* data, uint32_t words) {
+    // Built once, safely, even with several boards verifying at a time
+    static const uint32_t* table = [] {
+        static uint32_t t[256];
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i << 24;
+            for (int b = 0; b < 8; b++) c = (c & 0x80000000) ? (c << 1) ^ 0x04C11DB7 : c << 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    
+    uint32_t crc = 0xffffffff;
+    for (uint32_t w = 0; w < words; w++) {
+        for (int b = 3; b >= 0; b--)
+            crc = (crc << 8) ^ table[(crc >> 24) ^ data[4 * w + b]];
+    }
+    return crc;
+}
+
+bool Flash::verify(uint32_t addr, const uint8_t* data, uint32_t len) {
+    if (!driver) return false;
+    PerfTimer t;
+    stats_.bytes_verified += len;
+    
+    bool ok;
+    if (!use_checksum || !driver->has_checksum()) {
+        ok = driver->verify(addr, data, len);
+    } else {
+        uint32_t words = len / 4;
+        uint32_t crc = 0;
+        ok = !words || (driver->checksum(addr, words * 4, 1, &crc) && crc == flash_crc32(data, words));
+        
+        // Odd tail bytes the CRC unit can't take
+        ok = ok && (len % 4 == 0 || driver->verify(addr + words * 4, data + words * 4, len % 4));
+    }
+    
+    stats_.verify_us += t.us();
+    return ok;
+}
+
+Flash::Stats Flash::stats() const {
+    Stats s = stats_;
+    if (driver) s.polls = driver->polls();
+    return s;
+}
+
+void Flash::print_stats(std::ostream& os) const {
+    if (!driver) return;
+    driver->latency(FlashOp::Program).print(os, "Flash program");
+    driver->latency(FlashOp::PageErase).print(os, "Flash page erase");
+    driver->latency(FlashOp::MassErase).print(os, "Flash mass erase");
+}
+
 bool Flash::detect() {
+    // A daemon keeps this object across commands
+    if (driver) return true;
+    
     const DeviceInfo* info = dev->info();
     if (!info) return false;
     
-    if (info->name.find("STM32F103") != std::string::npos ||
-        info->name.find("STM32F101") != std::string::npos ||
-        info->name.find("STM32F102") != std::string::npos ||
-        info->name.find("STM32F105") != std::string::npos ||
-        info->name.find("STM32F107") != std::string::npos) {
+    if (info->flash_driver == "stm32f1") {
         driver = new STM32F1Flash(dev, jtag);
         return true;
     }
@@ -31,13 +161,61 @@ bool Flash::load_driver() {
     return driver->init();
 }
 
-bool Flash::erase(uint32_t addr, uint32_t len) {
+bool Flash::erase(uint32_t addr, uint32_t len, uint32_t* skipped) {
     if (!driver) return false;
     
     uint32_t end = addr + len;
+    std::vector<uint32_t> sectors;
+    for (uint32_t sector = sector_base(addr); sector < end; sector += sector_size(sector))
+        sectors.push_back(sector);
+    
+    // Already erased sectors cost a checksum or a read instead of an erase
+    // cycle. Equal-sized sectors in a row are checked in one request, as
+    // classify() does, so the stub session is paid once.
+    std::vector<bool> is_blank(sectors.size());
+    bool crc = use_checksum && driver->has_checksum();
+    std::vector<uint32_t> crcs;
+    std::vector<uint8_t> erased;
     
-    for (uint32_t sector = addr; sector < end; sector += driver->sector_size(sector)) {
-        if (!driver->erase_sector(sector)) {
+    for (size_t i = 0; i < sectors.size(); ) {
+        uint32_t size = sector_size(sectors[i]);
+        
+        if (!crc || size % 4) {
+            bool b = false;
+            if (!blank(sectors[i], size, &b)) return false;
+            is_blank[i] = b;
+            i++;
+            continue;
+        }
+        
+        size_t j = i + 1;
+        while (j < sectors.size() && sectors[j] == sectors[j - 1] + size && sector_size(sectors[j]) == size) j++;
+        
+        PerfTimer t;
+        crcs.resize(j - i);
+        bool ok = driver->checksum(sectors[i], size, j - i, crcs.data());
+        stats_.verify_us += t.us();
+        if (!ok) return false;
+        
+        erased.assign(size, 0xff);
+        uint32_t blank_crc = flash_crc32(erased.data(), size / 4);
+        for (size_t k = i; k < j; k++) is_blank[k] = crcs[k - i] == blank_crc;
+        i = j;
+    }
+    
+    for (size_t i = 0; i < sectors.size(); i++) {
+        uint32_t sector = sectors[i];
+        if (is_blank[i]) {
+            if (skipped) (*skipped)++;
+            continue;
+        }
+        
+        PerfTimer t;
+        bool ok = driver->erase_sector(sector);
+        stats_.erase_us += t.us();
+        stats_.sectors_erased++;
+        
+        if (!ok) {
             std::cerr << "Erase failed at 0x" << std::hex << sector << std::dec << "\n";
             return false;
         }
@@ -46,33 +224,330 @@ bool Flash::erase(uint32_t addr, uint32_t len) {
     return true;
 }
 
+// The whole array, sized from the detected part
+bool Flash::erase_chip() {
+    const DeviceInfo* info = dev->info();
+    if (!driver || !info) return false;
+    
+    if (driver->has_mass_erase()) {
+        PerfTimer t;
+        bool ok = driver->mass_erase();
+        stats_.erase_us += t.us();
+        return ok;
+    }
+    
+    for (const auto& r : info->flash_regions) {
+        if (!erase(r.addr, r.size)) return false;
+    }
+    return true;
+}
+
+bool Flash::blank(uint32_t addr, uint32_t len, bool* is_blank) {
+    std::vector<uint8_t> buf(len, 0xff);
+    PerfTimer t;
+    
+    if (use_checksum && driver->has_checksum() && len % 4 == 0) {
+        uint32_t crc = 0;
+        bool ok = driver->checksum(addr, len, 1, &crc);
+        stats_.verify_us += t.us();
+        *is_blank = crc == flash_crc32(buf.data(), len / 4);
+        return ok;
+    }
+    
+    bool ok = read(addr, buf.data(), len);
+    stats_.verify_us += t.us();
+    if (!ok) return false;
+    
+    *is_blank = true;
+    for (uint8_t b : buf) {
+        if (b != 0xff) {
+            *is_blank = false;
+            break;
+        }
+    }
+    return true;
+}
+
 bool Flash::program(uint32_t addr, const uint8_t* data, uint32_t len) {
     if (!driver) return false;
+    PerfTimer t;
+    stats_.bytes_programmed += len;
+    
+    if (use_loader && driver->loader_start()) {
+        bool ok = driver->loader_program(addr, data, len);
+        if (!driver->loader_stop()) ok = false;
+        if (!ok) {
+            std::cerr << "Flash loader failed\n";
+            return false;
+        }
+    } else {
+        uint32_t page_size = 1024;  // STM32F1 has 1K pages
+        
+        for (uint32_t offset = 0; offset < len; offset += page_size) {
+            uint32_t chunk = (len - offset) < page_size ? (len - offset) : page_size;
+            
+            if (!driver->program_page(addr + offset, data + offset, chunk)) {
+                std::cerr << "Program failed at 0x" << std::hex << (addr + offset) << std::dec << "\n";
+                return false;
+            }
+        }
+    }
     
-    uint32_t page_size = 1024;  // STM32F1 has 1K pages
+    stats_.program_us += t.us();
     
-    for (uint32_t offset = 0; offset < len; offset += page_size) {
-        uint32_t chunk = (len - offset) < page_size ? (len - offset) : page_size;
+    // One pass over the whole range rather than a round trip per page
+    if (!verify(addr, data, len)) {
+        std::cerr << "Verify failed\n";
+        return false;
+    }
+    return true;
+}
+
+bool Flash::read(uint32_t addr, uint8_t* data, uint32_t len) {
+    return dev->read_mem(addr, data, len);
+}
+
+// Start of the sector holding addr, from the device's flash regions
+uint32_t Flash::sector_base(uint32_t addr) {
+    const DeviceInfo* info = dev->info();
+    if (info) {
+        for (const auto& r : info->flash_regions) {
+            if (addr >= r.addr && addr - r.addr < r.size)
+                return addr - (addr - r.addr) % r.sector_size;
+        }
+    }
+    return addr - addr % driver->sector_size(addr);
+}
+
+// Size of the sector holding addr, from the same geometry as sector_base()
+uint32_t Flash::sector_size(uint32_t addr) {
+    const DeviceInfo* info = dev->info();
+    if (info) {
+        for (const auto& r : info->flash_regions) {
+            if (addr >= r.addr && addr - r.addr < r.size) return r.sector_size;
+        }
+    }
+    return driver->sector_size(addr);
+}
+
+// Sort each span into unchanged, blank or dirty, by on-target checksum
+// where the driver can and by reading it back otherwise
+bool Flash::classify(const std::vector<Span>& spans, const uint8_t* image, uint32_t addr,
+                     std::vector<SpanState>& state) {
+    state.assign(spans.size(), SpanState::Dirty);
+    bool crc = use_checksum && driver->has_checksum();
+    std::vector<uint8_t> buf;
+    std::vector<uint32_t> crcs;
+    
+    for (size_t i = 0; i < spans.size(); ) {
+        const Span& sp = spans[i];
+        const uint8_t* want = image + (sp.pos - addr);
+        
+        if (!crc || sp.len % 4) {
+            buf.resize(sp.len);
+            if (!read(sp.pos, buf.data(), sp.len)) return false;
+            
+            if (memcmp(buf.data(), want, sp.len) == 0) {
+                state[i] = SpanState::Same;
+            } else {
+                bool is_blank = true;
+                for (uint8_t b : buf) {
+                    if (b != 0xff) {
+                        is_blank = false;
+                        break;
+                    }
+                }
+                if (is_blank) state[i] = SpanState::Blank;
+            }
+            i++;
+            continue;
+        }
+        
+        // Equal-sized spans in a row go to the target in one request
+        size_t j = i + 1;
+        while (j < spans.size() && spans[j].len == sp.len) j++;
+        
+        crcs.resize(j - i);
+        if (!driver->checksum(sp.pos, sp.len, j - i, crcs.data())) return false;
         
-        if (!driver->program_page(addr + offset, data + offset, chunk)) {
-            std::cerr << "Program failed at 0x" << std::hex << (addr + offset) << std::dec << "\n";
+        buf.assign(sp.len, 0xff);
+        uint32_t blank_crc = flash_crc32(buf.data(), sp.len / 4);
+        
+        for (size_t k = i; k < j; k++) {
+            if (crcs[k - i] == flash_crc32(image + (spans[k].pos - addr), sp.len / 4))
+                state[k] = SpanState::Same;
+            else if (crcs[k - i] == blank_crc)
+                state[k] = SpanState::Blank;
+        }
+        i = j;
+    }
+    
+    return true;
+}
+
+bool Flash::update(uint32_t addr, const uint8_t* data, uint32_t len, FlashUpdateStats* stats) {
+    if (!driver) return false;
+    
+    // The image cut at sector boundaries
+    std::vector<Span> spans;
+    uint32_t end = addr + len;
+    for (uint32_t pos = addr; pos < end; ) {
+        uint32_t base = sector_base(pos);
+        uint32_t next = base + sector_size(base);
+        if (next <= pos) {
+            std::cerr << "Bad sector geometry at 0x" << std::hex << pos << std::dec << "\n";
             return false;
         }
+        uint32_t n = (next < end ? next : end) - pos;
+        spans.push_back({base, pos, n});
+        pos += n;
+    }
+    
+    std::vector<SpanState> state;
+    PerfTimer t;
+    bool ok = classify(spans, data, addr, state);
+    stats_.verify_us += t.us();
+    if (!ok) return false;
+    
+    // Changed sectors next to each other are programmed in one go
+    uint32_t run_start = addr;
+    uint32_t run_len = 0;
+    
+    for (size_t i = 0; i < spans.size(); i++) {
+        const Span& sp = spans[i];
         
-        if (!driver->verify(addr + offset, data + offset, chunk)) {
-            std::cerr << "Verify failed at 0x" << std::hex << (addr + offset) << std::dec << "\n";
+        if (state[i] == SpanState::Same) {
+            stats->sectors_skipped++;
+            stats->bytes_skipped += sp.len;
+            
+            if (run_len && !program(run_start, data + (run_start - addr), run_len))
+                return false;
+            run_len = 0;
+            continue;
+        }
+        
+        // A blank sector can be programmed as is
+        if (state[i] == SpanState::Dirty) {
+            PerfTimer t;
+            bool ok = driver->erase_sector(sp.base);
+            stats_.erase_us += t.us();
+            stats_.sectors_erased++;
+            
+            if (!ok) {
+                std::cerr << "Erase failed at 0x" << std::hex << sp.base << std::dec << "\n";
+                return false;
+            }
+            stats->sectors_erased++;
+        }
+        
+        stats->sectors_written++;
+        stats->bytes_written += sp.len;
+        
+        if (!run_len) run_start = sp.pos;
+        run_len += sp.len;
+    }
+    
+    if (run_len && !program(run_start, data + (run_start - addr), run_len))
+        return false;
+    
+    return true;
+}
+
+// Group segments so that no two groups share a sector, since erasing one
+// would wipe the other. Groups of more than one segment are copied into a
+// single block with the gaps erased (0xff).
+std::vector<ImageSegment> Flash::sector_blocks(const Image& img, std::vector<std::vector<uint8_t>>& storage) {
+    const auto& segs = img.segments();
+    std::vector<ImageSegment> blocks;
+    
+    for (size_t i = 0; i < segs.size(); ) {
+        size_t j = i + 1;
+        uint32_t end = segs[i].addr + segs[i].len;
+        while (j < segs.size() && sector_base(segs[j].addr) <= sector_base(end - 1)) {
+            end = segs[j].addr + segs[j].len;
+            j++;
+        }
+        
+        if (j == i + 1) {
+            blocks.push_back(segs[i]);
+        } else {
+            storage.emplace_back(end - segs[i].addr, 0xff);
+            std::vector<uint8_t>& buf = storage.back();
+            for (size_t k = i; k < j; k++)
+                memcpy(&buf[segs[k].addr - segs[i].addr], segs[k].data, segs[k].len);
+            blocks.push_back({segs[i].addr, buf.data(), (uint32_t)buf.size()});
+        }
+        i = j;
+    }
+    
+    return blocks;
+}
+
+bool Flash::write_image(const Image& img, bool diff, FlashUpdateStats* stats, bool erased) {
+    if (!driver) return false;
+    
+    std::vector<std::vector<uint8_t>> storage;
+    std::vector<ImageSegment> blocks = sector_blocks(img, storage);
+    
+    uint32_t total = 0;
+    for (const auto& b : blocks) total += b.len;
+    
+    uint32_t done = 0;
+    if (diff) {
+        for (const auto& b : blocks) {
+            if (!update(b.addr, b.data, b.len, stats)) return false;
+            done += b.len;
+            report(FlashPhase::Program, done, total);
+        }
+        return true;
+    }
+    
+    // Everything erased first, so the phases can be reported apart
+    for (const auto& b : blocks) {
+        if (erased) break;    // a mass erase already did it
+        if (!erase(b.addr, b.len)) {
+            std::cerr << "Erase failed\n";
+            return false;
+        }
+        done += b.len;
+        report(FlashPhase::Erase, done, total);
+    }
+    
+    done = 0;
+    for (const auto& b : blocks) {
+        if (!program(b.addr, b.data, b.len)) {
+            std::cerr << "Program failed\n";
             return false;
         }
+        stats->bytes_written += b.len;
+        done += b.len;
+        report(FlashPhase::Program, done, total);
     }
     
     return true;
 }
 
-bool Flash::read(uint32_t addr, uint8_t* data, uint32_t len) {
-    return dev->read_mem(addr, data, len);
+bool Flash::verify_image(const Image& img) {
+    uint32_t total = img.size();
+    uint32_t done = 0;
+    
+    for (const auto& s : img.segments()) {
+        if (!verify(s.addr, s.data, s.len)) {
+            std::cerr << "Mismatch in 0x" << std::hex << s.addr << "+0x" << s.len << std::dec << "\n";
+            return false;
+        }
+        done += s.len;
+        report(FlashPhase::Verify, done, total);
+    }
+    return true;
 }
 
-STM32F1Flash::STM32F1Flash(Device* d, Jtag* j) : dev(d), jtag(j) {}
+void Flash::report(FlashPhase phase, uint32_t done, uint32_t total) {
+    if (progress) progress(phase, done, total);
+}
+
+STM32F1Flash::STM32F1Flash(Device* d, Jtag* j)
+    : dev(d), jtag(j), ram_base(0x20000000), buf_size(0), was_halted(false), saved_regs{} {}
 
 bool STM32F1Flash::init() {
     return unlock();
@@ -91,12 +566,14 @@ FlashStatus STM32F1Flash::status() {
     };
 }
 
-bool STM32F1Flash::wait_ready() {
-    for (int i = 0; i < 10000; i++) {
-        FlashStatus st = status();
-        if (!st.busy) return !st.error;
+// DS5319 tPROG, tERASE and tME
+FlashTiming STM32F1Flash::timing(FlashOp op) const {
+    switch (op) {
+        case FlashOp::Program:   return {53, 70};
+        case FlashOp::PageErase: return {20000, 40000};
+        case FlashOp::MassErase: return {20000, 40000};
+        default:                 return {0, 0};
     }
-    return false;
 }
 
 bool STM32F1Flash::unlock() {
@@ -115,7 +592,7 @@ bool STM32F1Flash::lock() {
 }
 
 bool STM32F1Flash::erase_sector(uint32_t addr) {
-    if (!wait_ready()) return false;
+    if (!wait_idle(jtag)) return false;
     
     // Set PER bit and page address
     uint32_t ar = addr;
@@ -127,15 +604,35 @@ bool STM32F1Flash::erase_sector(uint32_t addr) {
     cr = 0x00000042;  // PER + STRT
     if (!dev->write_mem(0x40022010, (uint8_t*)&cr, 4)) return false;
     
-    if (!wait_ready()) return false;
+    if (!wait_busy(jtag, FlashOp::PageErase)) return false;
     
     // Clear PER
     cr = 0x00000000;
     return dev->write_mem(0x40022010, (uint8_t*)&cr, 4);
 }
 
+bool STM32F1Flash::mass_erase() {
+    if (!wait_idle(jtag)) return false;
+    
+    uint32_t cr = 0x00000004;  // MER
+    if (!dev->write_mem(0x40022010, (uint8_t*)&cr, 4)) return false;
+    
+    cr = 0x00000044;  // MER + STRT
+    if (!dev->write_mem(0x40022010, (uint8_t*)&cr, 4)) return false;
+    
+    if (!wait_busy(jtag, FlashOp::MassErase)) return false;
+    
+    // Clear MER
+    cr = 0x00000000;
+    return dev->write_mem(0x40022010, (uint8_t*)&cr, 4);
+}
+
 bool STM32F1Flash::program_page(uint32_t addr, const uint8_t* data, uint32_t len) {
-    if (!wait_ready()) return false;
+    if (!wait_idle(jtag)) return false;
+    
+    // Errors left from an earlier operation would fail the first halfword
+    uint32_t sr = 0x00000014;  // PGERR | WRPRTERR, write 1 to clear
+    if (!dev->write_mem(0x4002200C, (uint8_t*)&sr, 4)) return false;
     
     // Set PG bit
     uint32_t cr = 0x00000001;  // PG
@@ -146,7 +643,7 @@ bool STM32F1Flash::program_page(uint32_t addr, const uint8_t* data, uint32_t len
         uint16_t val = *(uint16_t*)(data + i);
         if (!dev->write_mem(addr + i, (uint8_t*)&val, 2)) return false;
         
-        if (!wait_ready()) return false;
+        if (!wait_busy(jtag, FlashOp::Program)) return false;
     }
     
     // Clear PG
@@ -161,7 +658,305 @@ bool STM32F1Flash::verify(uint32_t addr, const uint8_t* data, uint32_t len) {
     return memcmp(data, readback.data(), len) == 0;
 }
 
+// 1K pages on low and medium density parts, 2K on high density and
+// connectivity line ones; the device database says which
 uint32_t STM32F1Flash::sector_size(uint32_t addr) {
-    (void)addr;  // All sectors same size on F1
-    return 1024;  // 1K sectors
+    const DeviceInfo* info = dev->info();
+    if (info) {
+        for (const auto& r : info->flash_regions) {
+            if (addr >= r.addr && addr - r.addr < r.size) return r.sector_size;
+        }
+    }
+    return 1024;
+}
+
+// Flash loader. The stub runs from the start of SRAM and programs two
+// alternating buffers described by a pair of descriptors:
+//
+//   +0 dest   flash address
+//   +4 len    bytes; nonzero hands the buffer to the stub, which zeroes it
+//             when done. 0xffffffff ends the session.
+//   +8 src    SRAM buffer
+//   +12 error FLASH_SR if programming failed
+//
+// On entry r0 points at descriptor 0 (32-byte aligned, descriptor 1 follows)
+// and r1 at the flash registers. The stub finishes with BKPT.
+static const uint16_t loader_stub[] = {
+    0x2710,  //        movs r7, #16
+    0x4606,  //        mov  r6, r0
+    0x2014,  //        movs r0, #0x14       ; PGERR | WRPRTERR
+    0x6872,  // next:  ldr  r2, [r6, #4]
+    0x2a00,  //        cmp  r2, #0
+    0xd0fc,  //        beq  next
+    0x1c53,  //        adds r3, r2, #1
+    0xd014,  //        beq  done
+    0x6833,  //        ldr  r3, [r6, #0]
+    0x68b4,  //        ldr  r4, [r6, #8]
+    0x2501,  //        movs r5, #1
+    0x610d,  //        str  r5, [r1, #16]   ; FLASH_CR = PG
+    0x8825,  // copy:  ldrh r5, [r4]
+    0x801d,  //        strh r5, [r3]
+    0x68cd,  // busy:  ldr  r5, [r1, #12]   ; FLASH_SR
+    0x086d,  //        lsrs r5, r5, #1
+    0xd2fc,  //        bcs  busy
+    0x68cd,  //        ldr  r5, [r1, #12]
+    0x4205,  //        tst  r5, r0
+    0xd107,  //        bne  fail
+    0x3302,  //        adds r3, #2
+    0x3402,  //        adds r4, #2
+    0x3a02,  //        subs r2, #2
+    0xd8f3,  //        bhi  copy
+    0x610a,  //        str  r2, [r1, #16]   ; FLASH_CR = 0
+    0x6072,  //        str  r2, [r6, #4]    ; buffer free
+    0x407e,  //        eors r6, r7          ; other descriptor
+    0xe7e6,  //        b    next
+    0x60f5,  // fail:  str  r5, [r6, #12]
+    0x2500,  // done:  movs r5, #0
+    0x610d,  //        str  r5, [r1, #16]
+    0xbe00,  //        bkpt #0
+};
+
+static const uint32_t FLASH_REGS = 0x40022000;
+static const uint32_t LOADER_DESC = 0x80;     // after the stub
+static const uint32_t LOADER_BUFS = 0x100;    // after the descriptors
+static const uint32_t LOADER_MAX_BUF = 8192;
+static const uint32_t LOADER_END = 0xffffffff;
+
+// Park the core and put a stub at the start of SRAM. The core's registers,
+// run state and the first `used` bytes of SRAM are put back by stub_end().
+bool STM32F1Flash::stub_begin(const uint16_t* code, uint32_t bytes, uint32_t used) {
+    if (!dev->is_halted(&was_halted)) return false;
+    if (!was_halted && !dev->halt()) return false;
+    
+    for (int i = 0; i < 17; i++) {
+        if (!dev->read_reg(i, &saved_regs[i])) return false;
+    }
+    
+    saved_ram.resize(used < bytes ? bytes : used);
+    if (!dev->read_mem(ram_base, saved_ram.data(), saved_ram.size())) return false;
+    
+    return dev->write_mem(ram_base, (const uint8_t*)code, bytes);
+}
+
+// Start the stub with r0.. set from regs
+bool STM32F1Flash::stub_run(const uint32_t* regs, int n) {
+    for (int i = 0; i < n; i++) {
+        if (!dev->write_reg(i, regs[i])) return false;
+    }
+    if (!dev->write_reg(15, ram_base)) return false;
+    if (!dev->write_reg(16, 0x01000000)) return false;  // Thumb bit
+    
+    // Run with interrupts masked; C_MASKINTS can only change while halted
+    uint32_t dhcsr = 0xA05F000B;  // DBGKEY | C_MASKINTS | C_HALT | C_DEBUGEN
+    if (!dev->write_mem(0xE000EDF0, (uint8_t*)&dhcsr, 4)) return false;
+    dhcsr = 0xA05F0009;  // DBGKEY | C_MASKINTS | C_DEBUGEN
+    return dev->write_mem(0xE000EDF0, (uint8_t*)&dhcsr, 4);
+}
+
+// Wait for the stub's BKPT
+bool STM32F1Flash::stub_wait(uint32_t max_us) {
+    uint32_t step = 10;
+    uint64_t start = jtag->now_us();
+    
+    for (;;) {
+        bool h = false;
+        if (!dev->is_halted(&h)) return false;
+        if (h) return true;
+        
+        if (since(jtag, start) > max_us) {
+            std::cerr << "Flash stub did not finish\n";
+            return false;
+        }
+        
+        jtag->delay(step);
+        if (step < max_us / 8) step *= 2;
+    }
+}
+
+// Put the core back; a core that was running is left halted when !resume
+bool STM32F1Flash::stub_end(bool resume) {
+    if (!dev->halt()) return false;
+    
+    for (int i = 0; i < 17; i++) {
+        if (!dev->write_reg(i, saved_regs[i])) return false;
+    }
+    if (!dev->write_mem(ram_base, saved_ram.data(), saved_ram.size())) return false;
+    
+    // Drop C_MASKINTS again
+    uint32_t dhcsr = 0xA05F0003;
+    if (!dev->write_mem(0xE000EDF0, (uint8_t*)&dhcsr, 4)) return false;
+    return was_halted || !resume || dev->resume();
+}
+
+bool STM32F1Flash::loader_start() {
+    const DeviceInfo* info = dev->info();
+    if (!info || info->ram_size < LOADER_BUFS + 2 * 1024) return false;
+    
+    // Two buffers in whatever SRAM is left, whole KB each
+    buf_size = (info->ram_size - LOADER_BUFS) / 2 / 1024 * 1024;
+    if (buf_size > LOADER_MAX_BUF) buf_size = LOADER_MAX_BUF;
+    
+    if (!stub_begin(loader_stub, sizeof(loader_stub), LOADER_BUFS + 2 * buf_size)) return false;
+    
+    uint32_t desc[8] = {
+        0, 0, ram_base + LOADER_BUFS, 0,
+        0, 0, ram_base + LOADER_BUFS + buf_size, 0,
+    };
+    if (!dev->write_mem(ram_base + LOADER_DESC, (uint8_t*)desc, sizeof(desc))) return false;
+    
+    // The stub fails on any error bit it finds, stale ones included
+    uint32_t sr = 0x00000014;  // PGERR | WRPRTERR, write 1 to clear
+    if (!dev->write_mem(FLASH_REGS + 0x0c, (uint8_t*)&sr, 4)) return false;
+    
+    uint32_t regs[2] = {ram_base + LOADER_DESC, FLASH_REGS};
+    return stub_run(regs, 2);
+}
+
+// Wait for the stub to hand buffer idx back, which should take about as
+// long as programming its halfwords one by one
+bool STM32F1Flash::wait_buffer(int idx, uint32_t halfwords) {
+    uint32_t desc = ram_base + LOADER_DESC + 16 * idx;
+    FlashTiming t = timing(FlashOp::Program);
+    uint32_t max_us = t.max_us * halfwords + 10000;
+    uint32_t step = 100;
+    uint64_t start = jtag->now_us();
+    
+    for (int i = 0; ; i++) {
+        uint32_t len = 0;
+        if (!dev->read_mem(desc + 4, (uint8_t*)&len, 4)) return false;
+        if (len == 0) return true;
+        
+        // The stub stops on a programming error
+        if (i % 8 == 7) {
+            uint32_t error = 0;
+            if (!dev->read_mem(desc + 12, (uint8_t*)&error, 4)) return false;
+            if (error) {
+                std::cerr << "Flash loader error, SR=0x" << std::hex << error << std::dec << "\n";
+                return false;
+            }
+        }
+        
+        if (since(jtag, start) > max_us) break;
+        
+        jtag->delay(step);
+        if (step < t.typical_us * halfwords / 8) step *= 2;
+    }
+    
+    std::cerr << "Flash loader timed out\n";
+    return false;
+}
+
+// Fill one buffer while the stub programs the other, so the link only
+// carries data and one descriptor write per buffer
+bool STM32F1Flash::loader_program(uint32_t addr, const uint8_t* data, uint32_t len) {
+    std::vector<uint8_t> chunk;
+    uint32_t pending[2] = {0, 0};   // halfwords handed to the stub
+    int idx = 0;
+    
+    for (uint32_t offset = 0; offset < len; offset += buf_size) {
+        uint32_t n = len - offset < buf_size ? len - offset : buf_size;
+        
+        // Halfword programming; pad an odd tail with erased bytes
+        chunk.assign(data + offset, data + offset + n);
+        if (n & 1) chunk.push_back(0xff);
+        
+        uint32_t desc = ram_base + LOADER_DESC + 16 * idx;
+        uint32_t buf = ram_base + LOADER_BUFS + buf_size * idx;
+        
+        if (pending[idx] && !wait_buffer(idx, pending[idx])) return false;
+        if (!dev->write_mem(buf, chunk.data(), chunk.size())) return false;
+        
+        // dest before len: the stub starts as soon as len is nonzero
+        uint32_t hand[2] = {addr + offset, (uint32_t)chunk.size()};
+        if (!dev->write_mem(desc, (uint8_t*)hand, sizeof(hand))) return false;
+        
+        pending[idx] = chunk.size() / 2;
+        idx ^= 1;
+    }
+    
+    // The stub takes buffers in the order they were handed over, and idx
+    // is now the older one; waiting on the newer first would time out
+    // while the stub is still busy with the other
+    return (!pending[idx] || wait_buffer(idx, pending[idx])) &&
+           (!pending[idx ^ 1] || wait_buffer(idx ^ 1, pending[idx ^ 1]));
+}
+
+bool STM32F1Flash::loader_stop() {
+    // Let the stub clear PG and reach its BKPT
+    uint32_t end = LOADER_END;
+    bool ok = dev->write_mem(ram_base + LOADER_DESC + 4, (uint8_t*)&end, 4) &&
+              dev->write_mem(ram_base + LOADER_DESC + 16 + 4, (uint8_t*)&end, 4) &&
+              stub_wait(10000);
+    
+    if (!dev->halt()) return false;
+    
+    uint32_t cr = 0;
+    if (!dev->write_mem(0x40022010, (uint8_t*)&cr, 4)) return false;
+    
+    // The application's code just changed under it, so resuming it where it
+    // stopped could run anything; it's left halted for a reset instead
+    if (!was_halted) std::cerr << "Core left halted after programming; reset it to run the new image\n";
+    return stub_end(false) && ok;
+}
+
+// CRC of count blocks using the CRC unit, fed by the core from a stub so
+// only the results cross the link
+static const uint16_t crc_stub[] = {
+    0x2501,  // block: movs r5, #1
+    0x60a5,  //        str  r5, [r4, #8]    ; CRC_CR = RESET
+    0x1c0e,  //        adds r6, r1, #0      ; words per block
+    0x6805,  // word:  ldr  r5, [r0]
+    0x6025,  //        str  r5, [r4]        ; CRC_DR
+    0x3004,  //        adds r0, #4
+    0x3e01,  //        subs r6, #1
+    0xd1fa,  //        bne  word
+    0x6825,  //        ldr  r5, [r4]
+    0x601d,  //        str  r5, [r3]
+    0x3304,  //        adds r3, #4
+    0x3a01,  //        subs r2, #1
+    0xd1f2,  //        bne  block
+    0xbe00,  //        bkpt #0
+};
+
+static const uint32_t CRC_REGS = 0x40023000;
+static const uint32_t RCC_AHBENR = 0x40021014;
+static const uint32_t CRCEN = 1u << 6;
+static const uint32_t CRC_OUT = 0x40;   // results, after the stub
+
+bool STM32F1Flash::checksum(uint32_t addr, uint32_t block, uint32_t count, uint32_t* crcs) {
+    const DeviceInfo* info = dev->info();
+    if (!info || block % 4 || !block) return false;
+    
+    uint32_t max_count = (info->ram_size - CRC_OUT) / 4;
+    uint32_t results = count < max_count ? count : max_count;
+    
+    // Nothing was saved, so there is nothing to put back
+    if (!stub_begin(crc_stub, sizeof(crc_stub), CRC_OUT + results * 4)) return false;
+    
+    // The CRC unit needs its clock. RCC is changed and put back as found
+    // only while the core is halted, so the application's own writes to it
+    // can't be lost.
+    uint32_t ahbenr = 0;
+    bool saved = dev->read_mem(RCC_AHBENR, (uint8_t*)&ahbenr, 4);
+    uint32_t on = ahbenr | CRCEN;
+    bool ok = saved && dev->write_mem(RCC_AHBENR, (uint8_t*)&on, 4);
+    
+    for (uint32_t done = 0; ok && done < count; ) {
+        uint32_t n = count - done < max_count ? count - done : max_count;
+        uint32_t regs[5] = {addr + done * block, block / 4, n, ram_base + CRC_OUT, CRC_REGS};
+        
+        // A few cycles a word at 8 MHz, with plenty of margin
+        ok = stub_run(regs, 5) &&
+             stub_wait(n * block / 4 + 100000) &&
+             dev->read_mem(ram_base + CRC_OUT, (uint8_t*)(crcs + done), n * 4);
+        done += n;
+    }
+    
+    if (saved && !(ahbenr & CRCEN)) {
+        // A failed run may have left the stub going
+        bool halted = ok || dev->halt();
+        if (!halted || !dev->write_mem(RCC_AHBENR, (uint8_t*)&ahbenr, 4)) ok = false;
+    }
+    if (!stub_end(true)) ok = false;
+    return ok;
 }
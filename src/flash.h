@@ -3,9 +3,13 @@
 #include <cstdint>
 #include <vector>
 #include <string>
+#include <ostream>
+#include <functional>
 
 class Device;
 class Jtag;
+class Image;
+struct ImageSegment;
 
 struct FlashStatus {
     bool busy;
@@ -13,6 +17,34 @@ struct FlashStatus {
     bool eop;
 };
 
+enum class FlashOp {
+    Program,      // one program unit (halfword on STM32F1)
+    PageErase,
+    MassErase,
+    Count
+};
+
+// How long the controller stays busy, from the datasheet
+struct FlashTiming {
+    uint32_t typical_us;
+    uint32_t max_us;
+};
+
+// Operation latencies in power-of-two microsecond buckets
+class LatencyHistogram {
+public:
+    void add(uint32_t us);
+    void print(std::ostream& os, const char* name) const;
+    uint32_t count() const { return n; }
+    
+private:
+    static const int BUCKETS = 32;
+    uint32_t buckets[BUCKETS] = {};
+    uint32_t n = 0;
+    uint64_t total = 0;
+    uint32_t max = 0;
+};
+
 class FlashDriver {
 public:
     virtual ~FlashDriver() = default;
@@ -22,8 +54,69 @@ public:
     virtual bool program_page(uint32_t addr, const uint8_t* data, uint32_t len) = 0;
     virtual bool verify(uint32_t addr, const uint8_t* data, uint32_t len) = 0;
     virtual uint32_t sector_size(uint32_t addr) = 0;
+    virtual FlashTiming timing(FlashOp op) const = 0;
+    
+    const LatencyHistogram& latency(FlashOp op) const { return histograms[(int)op]; }
+    
+    // Status reads spent waiting for the controller
+    uint64_t polls() const { return polls_; }
+    
+    // CRC (see flash_crc32) of count consecutive blocks computed on the
+    // target, where the driver can
+    virtual bool has_checksum() const { return false; }
+    virtual bool checksum(uint32_t addr, uint32_t block, uint32_t count, uint32_t* crcs) {
+        (void)addr; (void)block; (void)count; (void)crcs;
+        return false;
+    }
+    
+    // Whole-array erase in one controller operation, where there is one
+    virtual bool has_mass_erase() const { return false; }
+    virtual bool mass_erase() { return false; }
+    
+    // Optional RAM-resident loader. loader_start() returns false when the
+    // driver has none or it can't be set up, and the caller falls back to
+    // program_page().
+    virtual bool loader_start() { return false; }
+    virtual bool loader_program(uint32_t addr, const uint8_t* data, uint32_t len) {
+        (void)addr; (void)data; (void)len;
+        return false;
+    }
+    virtual bool loader_stop() { return true; }
+    
+protected:
+    // Sleep through the typical busy time of op, then poll status() with
+    // exponential backoff until its maximum has passed
+    bool wait_busy(Jtag* jtag, FlashOp op);
+    
+    // Make sure nothing is still running before starting an operation
+    bool wait_idle(Jtag* jtag);
+    
+private:
+    bool poll(Jtag* jtag, uint32_t max_us, uint32_t step_us);
+    
+    LatencyHistogram histograms[(int)FlashOp::Count];
+    uint32_t poll_us = 0;   // what one status() costs over the link
+    uint64_t polls_ = 0;
 };
 
+// CRC-32/MPEG-2 over whole little-endian words
+uint32_t flash_crc32(const uint8_t* data, uint32_t words);
+
+// What Flash::update() touched
+struct FlashUpdateStats {
+    uint32_t sectors_skipped = 0;
+    uint32_t sectors_written = 0;
+    uint32_t sectors_erased = 0;
+    uint32_t bytes_skipped = 0;
+    uint32_t bytes_written = 0;
+};
+
+enum class FlashPhase { Erase, Program, Verify };
+
+// Bytes of the image handled so far in the current phase. Called from
+// whichever thread runs the Flash.
+using FlashProgress = std::function<void(FlashPhase phase, uint32_t done, uint32_t total)>;
+
 class Flash {
 public:
     Flash(Device* dev, Jtag* jtag);
@@ -31,14 +124,66 @@ public:
     
     bool detect();
     bool load_driver();
-    bool erase(uint32_t addr, uint32_t len);
+    bool erase(uint32_t addr, uint32_t len, uint32_t* skipped = nullptr);
+    bool erase_chip();
+    bool blank(uint32_t addr, uint32_t len, bool* is_blank);
     bool program(uint32_t addr, const uint8_t* data, uint32_t len);
     bool read(uint32_t addr, uint8_t* data, uint32_t len);
     
+    // Compare flash with data, by checksum when the driver has one
+    bool verify(uint32_t addr, const uint8_t* data, uint32_t len);
+    
+    // Erase and program only the sectors whose contents differ from data
+    bool update(uint32_t addr, const uint8_t* data, uint32_t len, FlashUpdateStats* stats);
+    
+    // Whole images: only the sectors the segments cover are touched, with
+    // update() per block when diff is set, erase() and program() otherwise.
+    // erased skips the erase after an erase_chip().
+    bool write_image(const Image& img, bool diff, FlashUpdateStats* stats, bool erased = false);
+    bool verify_image(const Image& img);
+    
+    void set_loader(bool on) { use_loader = on; }
+    void set_checksum(bool on) { use_checksum = on; }
+    void set_progress(FlashProgress fn) { progress = std::move(fn); }
+    void print_stats(std::ostream& os) const;
+    
+    // Time per phase, with perf_timing on. Blank and changed-sector checks
+    // count as verify.
+    struct Stats {
+        uint64_t erase_us = 0;
+        uint64_t program_us = 0;
+        uint64_t verify_us = 0;
+        uint64_t sectors_erased = 0;
+        uint64_t bytes_programmed = 0;
+        uint64_t bytes_verified = 0;
+        uint64_t polls = 0;
+    };
+    Stats stats() const;
+    
 private:
+    // Part of the image within one sector
+    struct Span {
+        uint32_t base;
+        uint32_t pos;
+        uint32_t len;
+    };
+    
+    enum class SpanState { Same, Blank, Dirty };
+    
+    uint32_t sector_base(uint32_t addr);
+    uint32_t sector_size(uint32_t addr);
+    std::vector<ImageSegment> sector_blocks(const Image& img, std::vector<std::vector<uint8_t>>& storage);
+    bool classify(const std::vector<Span>& spans, const uint8_t* image, uint32_t addr,
+                  std::vector<SpanState>& state);
+    void report(FlashPhase phase, uint32_t done, uint32_t total);
+    
     Device* dev;
     Jtag* jtag;
     FlashDriver* driver;
+    bool use_loader;
+    bool use_checksum;
+    FlashProgress progress;
+    Stats stats_;
 };
 
 class STM32F1Flash : public FlashDriver {
@@ -50,12 +195,35 @@ public:
     bool program_page(uint32_t addr, const uint8_t* data, uint32_t len) override;
     bool verify(uint32_t addr, const uint8_t* data, uint32_t len) override;
     uint32_t sector_size(uint32_t addr) override;
+    FlashTiming timing(FlashOp op) const override;
+    
+    bool has_mass_erase() const override { return true; }
+    bool mass_erase() override;
+    
+    bool has_checksum() const override { return true; }
+    bool checksum(uint32_t addr, uint32_t block, uint32_t count, uint32_t* crcs) override;
+    
+    bool loader_start() override;
+    bool loader_program(uint32_t addr, const uint8_t* data, uint32_t len) override;
+    bool loader_stop() override;
     
 private:
-    bool wait_ready();
     bool unlock();
     bool lock();
+    bool wait_buffer(int idx, uint32_t halfwords);
+    
+    bool stub_begin(const uint16_t* code, uint32_t bytes, uint32_t used);
+    bool stub_run(const uint32_t* regs, int n);
+    bool stub_wait(uint32_t max_us);
+    bool stub_end(bool resume);
     
     Device* dev;
     Jtag* jtag;
+    
+    // RAM stub layout and the core state it displaces
+    uint32_t ram_base;
+    uint32_t buf_size;
+    bool was_halted;
+    uint32_t saved_regs[17];
+    std::vector<uint8_t> saved_ram;
 };
@@ -1,12 +1,82 @@
 #include "jtag.h"
+#include "bitbang.h"
+#include "mpsse.h"
+#include "usb.h"
+#include "perf.h"
 #include <ftdi.h>
 #include <iostream>
+#include <string>
+#include <vector>
 #include <unistd.h>
 
+// Bus number and port chain, as in /sys/bus/usb/devices
+inline std::string usb_path(libusb_device* dev) {
+    uint8_t ports[8];
+    int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    std::string path = std::to_string(libusb_get_bus_number(dev));
+    for (int i = 0; i < n; i++) path += (i ? "." : "-") + std::to_string(ports[i]);
+    return path;
+}
+
+// Every attached device with the VID/PID that also fits serial and path
+inline bool usb_list(const UsbMatch& m, std::vector<UsbDevice>& out) {
+    out.clear();
+    ftdi_context* ftdi = ftdi_new();
+    if (!ftdi) return false;
+    
+    ftdi_device_list* list = nullptr;
+    if (ftdi_usb_find_all(ftdi, &list, m.vid, m.pid) < 0) {
+        ftdi_free(ftdi);
+        return false;
+    }
+    
+    for (ftdi_device_list* d = list; d; d = d->next) {
+        // Strings stay empty for devices another process has open
+        char desc[128] = "";
+        char serial[64] = "";
+        ftdi_usb_get_strings(ftdi, d->dev, nullptr, 0, desc, sizeof(desc), serial, sizeof(serial));
+        
+        UsbDevice dev{serial, usb_path(d->dev), desc};
+        if (usb_matches(m, dev)) out.push_back(dev);
+    }
+    
+    ftdi_list_free(&list);
+    ftdi_free(ftdi);
+    return true;
+}
+
+// ftdi_usb_open() for the device m picks out
+inline int usb_open(ftdi_context* ftdi, const UsbMatch& m) {
+    if (m.path.empty()) {
+        return ftdi_usb_open_desc(ftdi, m.vid, m.pid, nullptr,
+                                  m.serial.empty() ? nullptr : m.serial.c_str());
+    }
+    
+    ftdi_device_list* list = nullptr;
+    if (ftdi_usb_find_all(ftdi, &list, m.vid, m.pid) < 0) return -1;
+    
+    int ret = -3;  // device not found, as ftdi_usb_open_desc() has it
+    for (ftdi_device_list* d = list; d; d = d->next) {
+        if (usb_path(d->dev) != m.path) continue;
+        
+        if (!m.serial.empty()) {
+            char serial[64] = "";
+            ftdi_usb_get_strings(ftdi, d->dev, nullptr, 0, nullptr, 0, serial, sizeof(serial));
+            if (m.serial != serial) break;
+        }
+        
+        ret = ftdi_usb_open_dev(ftdi, d->dev);
+        break;
+    }
+    
+    ftdi_list_free(&list);
+    return ret;
+}
+
 class FtdiAdapter : public JtagAdapter {
 public:
-    FtdiAdapter(uint32_t vid = 0x0403, uint32_t pid = 0x6010) 
-        : vid(vid), pid(pid), ftdi(nullptr), state(0) {}
+    FtdiAdapter(const UsbMatch& usb)
+        : ftdi(nullptr), usb(usb) {}
     
     ~FtdiAdapter() {
         if (ftdi) close();
@@ -19,7 +89,7 @@ public:
             return false;
         }
         
-        if (ftdi_usb_open(ftdi, vid, pid) < 0) {
+        if (usb_open(ftdi, usb) < 0) {
             std::cerr << "Failed to open FTDI device\n";
             ftdi_free(ftdi);
             ftdi = nullptr;
@@ -31,10 +101,9 @@ public:
         ftdi_set_baudrate(ftdi, 115200);
         
         // Initial state - all outputs low
-        state = 0;
-        ftdi_write_data(ftdi, &state, 1);
-        
-        return true;
+        q.clear();
+        q.set(0xff, 0);
+        return flush();
     }
     
     void close() override {
@@ -48,33 +117,407 @@ public:
     void set_pin(JtagPin::Type pin, bool value) override {
         uint8_t mask = 0;
         switch (pin) {
-            case JtagPin::TCK: mask = 0x01; break;
-            case JtagPin::TMS: mask = 0x02; break;
-            case JtagPin::TDI: mask = 0x04; break;
-            case JtagPin::TRST: mask = 0x08; break;
+            case JtagPin::TCK: mask = BitbangQueue::TCK; break;
+            case JtagPin::TMS: mask = BitbangQueue::TMS; break;
+            case JtagPin::TDI: mask = BitbangQueue::TDI; break;
+            case JtagPin::TRST: mask = BitbangQueue::TRST; break;
             default: return;
         }
         
-        if (value) state |= mask;
-        else state &= ~mask;
+        q.set(mask, value);
+        flush();
+    }
+    
+    bool get_pin(JtagPin::Type pin) override {
+        if (pin != JtagPin::TDO) return false;
+        
+        flush();
+        uint8_t val;
+        ftdi_read_pins(ftdi, &val);
+        return val & BitbangQueue::TDO;
+    }
+    
+    void delay(unsigned us) override {
+        flush();
+        usleep(us);
+    }
+    
+    void queue_tms(uint32_t tms, int len) override {
+        q.tms(tms, len);
+    }
+    
+    void queue_shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) override {
+        q.shift(tdi, tdo, len, exit);
+    }
+    
+    // Asynchronous bitbang can't sample TDO from the write stream, so the
+    // stream is written in one go up to each capture point and the pins
+    // are read there.
+    bool flush() override {
+        if (q.empty()) return true;
+        PerfTimer t;
+        
+        bool ok = true;
+        size_t pos = 0;
+        for (const auto& c : q.captures()) {
+            for (int i = 0; i < c.len; i++) {
+                size_t sample = c.offset + 2 * i + 1;
+                ok &= write_stream(pos, sample);
+                pos = sample;
+                
+                uint8_t val = 0;
+                if (ftdi_read_pins(ftdi, &val) < 0) ok = false;
+                stats_.transfers++;
+                stats_.bytes_in++;
+                if (val & BitbangQueue::TDO) c.dst[i/8] |= (1 << (i % 8));
+                else c.dst[i/8] &= ~(1 << (i % 8));
+            }
+        }
+        ok &= write_stream(pos, q.stream().size());
         
-        ftdi_write_data(ftdi, &state, 1);
+        q.clear();
+        stats_.usb_us += t.us();
+        return ok;
+    }
+    
+private:
+    bool write_stream(size_t from, size_t to) {
+        if (to <= from) return true;
+        int n = to - from;
+        stats_.transfers++;
+        stats_.bytes_out += n;
+        return ftdi_write_data(ftdi, q.stream().data() + from, n) == n;
+    }
+    
+    ftdi_context* ftdi;
+    UsbMatch usb;
+    BitbangQueue q;
+};
+
+// Synchronous bitbang for parts without MPSSE (FT232R, FT245R). Every
+// byte written is echoed with the pins sampled, so TDO for a whole scan
+// comes back with the write stream instead of one read per bit.
+class SyncBitbangAdapter : public JtagAdapter {
+public:
+    SyncBitbangAdapter(const UsbMatch& usb, uint32_t khz = 1000)
+        : ftdi(nullptr), usb(usb), khz(khz) {}
+    
+    ~SyncBitbangAdapter() {
+        if (ftdi) close();
+    }
+    
+    bool open() override {
+        ftdi = ftdi_new();
+        if (!ftdi) {
+            std::cerr << "Failed to create FTDI context\n";
+            return false;
+        }
+        
+        if (usb_open(ftdi, usb) < 0) {
+            std::cerr << "Failed to open FTDI device\n";
+            ftdi_free(ftdi);
+            ftdi = nullptr;
+            return false;
+        }
+        
+        if (ftdi_set_bitmode(ftdi, 0x0f, BITMODE_SYNCBB) < 0) {
+            std::cerr << "Failed to set synchronous bitbang mode\n";
+            close();
+            return false;
+        }
+        
+        ftdi_set_baudrate(ftdi, baud(khz));
+        ftdi_set_latency_timer(ftdi, 1);
+        
+        q.clear();
+        q.set(0xff, 0);
+        return flush();
+    }
+    
+    void close() override {
+        if (ftdi) {
+            ftdi_usb_close(ftdi);
+            ftdi_free(ftdi);
+            ftdi = nullptr;
+        }
+    }
+    
+    void set_pin(JtagPin::Type pin, bool value) override {
+        uint8_t mask = 0;
+        switch (pin) {
+            case JtagPin::TCK: mask = BitbangQueue::TCK; break;
+            case JtagPin::TMS: mask = BitbangQueue::TMS; break;
+            case JtagPin::TDI: mask = BitbangQueue::TDI; break;
+            case JtagPin::TRST: mask = BitbangQueue::TRST; break;
+            default: return;
+        }
+        
+        q.set(mask, value);
+        flush();
     }
     
     bool get_pin(JtagPin::Type pin) override {
         if (pin != JtagPin::TDO) return false;
         
+        flush();
         uint8_t val;
         ftdi_read_pins(ftdi, &val);
-        return val & 0x10;  // TDO on bit 4
+        return val & BitbangQueue::TDO;
+    }
+    
+    void delay(unsigned us) override {
+        flush();
+        usleep(us);
+    }
+    
+    void queue_tms(uint32_t tms, int len) override {
+        q.tms(tms, len);
+    }
+    
+    void queue_shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) override {
+        q.shift(tdi, tdo, len, exit);
+    }
+    
+    // The baud rate tops out at 3 MBd, 24 MHz of TCK on paper
+    uint32_t set_clock(uint32_t want) override {
+        if (!flush()) return 0;
+        khz = want < 24000 ? want : 24000;
+        ftdi_set_baudrate(ftdi, baud(khz));
+        return khz;
+    }
+    
+    // The echo has to be drained as we go or the chip stalls, so the stream
+    // goes out in FIFO-sized windows, each followed by its read-back
+    bool flush() override {
+        if (q.empty()) return true;
+        
+        const auto& s = q.stream();
+        rx.resize(s.size());
+        PerfTimer t;
+        
+        bool ok = true;
+        for (size_t pos = 0; ok && pos < s.size(); pos += WINDOW) {
+            int n = s.size() - pos < WINDOW ? s.size() - pos : WINDOW;
+            ok = ftdi_write_data(ftdi, s.data() + pos, n) == n &&
+                 read_all(rx.data() + pos, n);
+            stats_.transfers += 2;
+            stats_.bytes_out += n;
+            stats_.bytes_in += n;
+        }
+        stats_.usb_us += t.us();
+        
+        if (ok) q.decode_sync(rx.data());
+        else std::cerr << "Sync bitbang transfer failed\n";
+        
+        q.clear();
+        return ok;
+    }
+    
+private:
+    // Bitbang bytes go out at 16x the chip's baud rate, two bytes per TCK,
+    // and libftdi sets the chip to 4x the rate it is given in bitbang mode
+    static int baud(uint32_t khz) {
+        return khz * 1000 * 2 / 16 / 4;
+    }
+    
+    static constexpr size_t WINDOW = 256;
+    
+    bool read_all(uint8_t* buf, size_t len) {
+        size_t got = 0;
+        int idle = 0;
+        while (got < len) {
+            int n = ftdi_read_data(ftdi, buf + got, len - got);
+            if (n < 0) return false;
+            if (n == 0) {
+                if (++idle > 1000) return false;
+                usleep(100);
+                continue;
+            }
+            idle = 0;
+            got += n;
+        }
+        return true;
+    }
+    
+    ftdi_context* ftdi;
+    UsbMatch usb;
+    uint32_t khz;
+    BitbangQueue q;
+    std::vector<uint8_t> rx;
+};
+
+// FT2232H/FT232H MPSSE engine. Scans are encoded as shift commands and
+// sent in one write, with all captured TDO bytes collected in one read.
+class MpsseAdapter : public JtagAdapter {
+public:
+    MpsseAdapter(const UsbMatch& usb, uint32_t khz = 1000)
+        : ftdi(nullptr), usb(usb), khz(khz) {}
+    
+    ~MpsseAdapter() {
+        if (ftdi) close();
+    }
+    
+    bool open() override {
+        ftdi = ftdi_new();
+        if (!ftdi) {
+            std::cerr << "Failed to create FTDI context\n";
+            return false;
+        }
+        
+        ftdi_set_interface(ftdi, INTERFACE_A);
+        if (usb_open(ftdi, usb) < 0) {
+            std::cerr << "Failed to open FTDI device\n";
+            ftdi_free(ftdi);
+            ftdi = nullptr;
+            return false;
+        }
+        
+        ftdi_usb_reset(ftdi);
+        ftdi_set_latency_timer(ftdi, 1);
+        ftdi_set_bitmode(ftdi, 0, BITMODE_RESET);
+        if (ftdi_set_bitmode(ftdi, MpsseQueue::DIRECTION, BITMODE_MPSSE) < 0) {
+            std::cerr << "Failed to enter MPSSE mode\n";
+            close();
+            return false;
+        }
+        
+        if (!sync()) {
+            std::cerr << "MPSSE not responding\n";
+            close();
+            return false;
+        }
+        
+        q.clear();
+        q.setup(khz);
+        return flush();
+    }
+    
+    void close() override {
+        if (ftdi) {
+            ftdi_set_bitmode(ftdi, 0, BITMODE_RESET);
+            ftdi_usb_close(ftdi);
+            ftdi_free(ftdi);
+            ftdi = nullptr;
+        }
+    }
+    
+    void set_pin(JtagPin::Type pin, bool value) override {
+        uint8_t mask = 0;
+        switch (pin) {
+            case JtagPin::TCK: mask = MpsseQueue::TCK; break;
+            case JtagPin::TMS: mask = MpsseQueue::TMS; break;
+            case JtagPin::TDI: mask = MpsseQueue::TDI; break;
+            case JtagPin::TRST: mask = MpsseQueue::TRST; break;
+            default: return;
+        }
+        
+        q.set_pins(mask, value);
+        flush();
+    }
+    
+    bool get_pin(JtagPin::Type pin) override {
+        if (pin != JtagPin::TDO) return false;
+        
+        bool tdo = false;
+        q.get_pins(&tdo);
+        flush();
+        return tdo;
     }
     
     void delay(unsigned us) override {
+        flush();
         usleep(us);
     }
     
+    void queue_tms(uint32_t tms, int len) override {
+        q.tms(tms, len);
+    }
+    
+    void queue_shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) override {
+        // Keep pending read-back inside the chip's 4 KB buffer
+        while (len > CHUNK_BITS) {
+            q.shift(tdi, tdo, CHUNK_BITS, false);
+            if (tdi) tdi += CHUNK_BITS / 8;
+            if (tdo) tdo += CHUNK_BITS / 8;
+            len -= CHUNK_BITS;
+            flush();
+        }
+        
+        q.shift(tdi, tdo, len, exit);
+        if (q.read_size() >= READ_LIMIT || q.write_size() >= WRITE_LIMIT)
+            flush();
+    }
+    
+    uint32_t set_clock(uint32_t want) override {
+        q.clock(want);
+        if (!flush()) return 0;
+        khz = want;
+        return MpsseQueue::frequency(MpsseQueue::divisor(khz));
+    }
+    
+    bool flush() override {
+        if (q.empty()) return true;
+        
+        const auto& cmd = q.commands();
+        PerfTimer t;
+        bool ok = ftdi_write_data(ftdi, cmd.data(), cmd.size()) == (int)cmd.size();
+        stats_.transfers++;
+        stats_.bytes_out += cmd.size();
+        
+        if (ok && q.read_size()) {
+            rx.resize(q.read_size());
+            ok = read_all(rx.data(), rx.size());
+            stats_.transfers++;
+            stats_.bytes_in += rx.size();
+            if (ok) q.decode(rx.data());
+        }
+        stats_.usb_us += t.us();
+        
+        if (!ok) std::cerr << "MPSSE transfer failed\n";
+        q.clear();
+        return ok;
+    }
+    
 private:
+    static constexpr int CHUNK_BITS = 2048 * 8;
+    static constexpr size_t READ_LIMIT = 2048;
+    static constexpr size_t WRITE_LIMIT = 64 * 1024;
+    
+    bool read_all(uint8_t* buf, size_t len) {
+        size_t got = 0;
+        int idle = 0;
+        while (got < len) {
+            int n = ftdi_read_data(ftdi, buf + got, len - got);
+            if (n < 0) return false;
+            if (n == 0) {
+                if (++idle > 1000) return false;
+                usleep(100);
+                continue;
+            }
+            idle = 0;
+            got += n;
+        }
+        return true;
+    }
+    
+    // An invalid opcode makes the MPSSE answer 0xfa followed by the opcode
+    bool sync() {
+        uint8_t bad = 0xaa;
+        if (ftdi_write_data(ftdi, &bad, 1) != 1) return false;
+        
+        uint8_t resp[2];
+        for (int tries = 0; tries < 16; tries++) {
+            if (!read_all(resp, 1)) return false;
+            if (resp[0] != 0xfa) continue;
+            if (!read_all(resp + 1, 1)) return false;
+            if (resp[1] == bad) return true;
+        }
+        return false;
+    }
+    
     ftdi_context* ftdi;
-    uint32_t vid, pid;
-    uint8_t state;
+    UsbMatch usb;
+    uint32_t khz;
+    MpsseQueue q;
+    std::vector<uint8_t> rx;
 };
@@ -0,0 +1,148 @@
+#include "gang.h"
+#include "device.h"
+#include "flash.h"
+#include "image.h"
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+enum class GangStage { Open, Detect, Erase, Program, Verify, Pass, Fail };
+
+// What a worker publishes for the progress line. The strings are only
+// read once the worker has been joined.
+struct GangSlot {
+    std::atomic<GangStage> stage{GangStage::Open};
+    std::atomic<uint32_t> done{0};
+    std::atomic<uint32_t> total{0};
+    std::string device;
+    std::string error;
+    double seconds = 0;
+};
+
+static void gang_worker(GangBoard& board, GangSlot& slot, const Image& img, const Config& cfg) {
+    auto start = std::chrono::steady_clock::now();
+    auto finish = [&](GangStage stage, const char* error) {
+        std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+        slot.seconds = d.count();
+        if (error) slot.error = error;
+        slot.stage = stage;
+    };
+    
+    Jtag jtag(board.adapter.get());
+    if (!jtag.init()) return finish(GangStage::Fail, "adapter failed to open");
+    
+    slot.stage = GangStage::Detect;
+    if (!jtag.scan_chain()) return finish(GangStage::Fail, "no device found");
+    
+    int tap = cfg.tap < 0 ? Device::default_tap(jtag) : cfg.tap;
+    if (tap >= (int)jtag.taps().size()) return finish(GangStage::Fail, "no such TAP");
+    
+    Device dev(jtag.taps()[tap].idcode, &jtag, {tap});
+    if (!dev.init()) return finish(GangStage::Fail, "unknown device");
+    slot.device = dev.info()->name;
+    
+    Flash flash(&dev, &jtag);
+    flash.set_loader(cfg.use_loader);
+    flash.set_checksum(cfg.verify_crc);
+    if (!flash.detect()) return finish(GangStage::Fail, "flash not supported");
+    if (!flash.load_driver()) return finish(GangStage::Fail, "flash driver failed");
+    
+    flash.set_progress([&](FlashPhase phase, uint32_t done, uint32_t total) {
+        slot.done = done;
+        slot.total = total;
+        slot.stage = phase == FlashPhase::Erase ? GangStage::Erase :
+                     phase == FlashPhase::Program ? GangStage::Program : GangStage::Verify;
+    });
+    
+    // Diff mode erases as it programs, so its first phase is Program
+    slot.done = 0;
+    slot.total = img.size();
+    slot.stage = cfg.diff ? GangStage::Program : GangStage::Erase;
+    
+    FlashUpdateStats st;
+    if (!flash.write_image(img, cfg.diff, &st)) return finish(GangStage::Fail, "program failed");
+    
+    slot.done = 0;
+    slot.stage = GangStage::Verify;
+    if (!flash.verify_image(img)) return finish(GangStage::Fail, "verify failed");
+    
+    finish(GangStage::Pass, nullptr);
+}
+
+// Share of one board's work done: erase, program and verify weigh 20/60/20
+static double gang_fraction(const GangSlot& slot, bool diff) {
+    GangStage stage = slot.stage;
+    uint32_t total = slot.total;
+    double f = total ? (double)slot.done / total : 0;
+    if (f > 1) f = 1;
+    
+    switch (stage) {
+        case GangStage::Open:
+        case GangStage::Detect:  return 0;
+        case GangStage::Erase:   return 0.2 * f;
+        case GangStage::Program: return diff ? 0.8 * f : 0.2 + 0.6 * f;
+        case GangStage::Verify:  return 0.8 + 0.2 * f;
+        default:                 return 1;
+    }
+}
+
+static void gang_print_progress(const std::vector<GangSlot>& slots, bool diff) {
+    double sum = 0;
+    int passed = 0, failed = 0;
+    for (const auto& s : slots) {
+        sum += gang_fraction(s, diff);
+        if (s.stage == GangStage::Pass) passed++;
+        if (s.stage == GangStage::Fail) failed++;
+    }
+    
+    int running = slots.size() - passed - failed;
+    std::cout << "\r" << std::setw(3) << (int)(100 * sum / slots.size()) << "%  " << running << " running, "
+              << passed << " passed, " << failed << " failed " << std::flush;
+}
+
+bool gang_flash(std::vector<GangBoard>& boards, const Image& img, const Config& cfg) {
+    std::vector<GangSlot> slots(boards.size());
+    std::vector<std::thread> workers;
+    
+    for (size_t i = 0; i < boards.size(); i++) {
+        workers.emplace_back(gang_worker, std::ref(boards[i]), std::ref(slots[i]),
+                             std::cref(img), std::cref(cfg));
+    }
+    
+    // Redraw until every worker has reached a verdict
+    for (;;) {
+        gang_print_progress(slots, cfg.diff);
+        
+        bool all_done = true;
+        for (const auto& s : slots) {
+            if (s.stage != GangStage::Pass && s.stage != GangStage::Fail) all_done = false;
+        }
+        if (all_done) break;
+        
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    std::cout << "\n";
+    
+    for (auto& w : workers) w.join();
+    
+    int failed = 0;
+    std::ios::fmtflags flags = std::cout.flags();
+    std::streamsize precision = std::cout.precision();
+    std::cout << "\nBoard report:\n" << std::fixed << std::setprecision(1);
+    for (size_t i = 0; i < boards.size(); i++) {
+        const GangSlot& s = slots[i];
+        bool pass = s.stage == GangStage::Pass;
+        if (!pass) failed++;
+        
+        std::cout << "  " << std::left << std::setw(20) << boards[i].name << " " << std::setw(4)
+                  << (pass ? "PASS" : "FAIL") << "  " << std::setw(14) << (s.device.empty() ? "-" : s.device)
+                  << " " << std::right << std::setw(6) << s.seconds << "s  " << s.error << "\n";
+    }
+    std::cout.flags(flags);
+    std::cout.precision(precision);
+    
+    std::cout << boards.size() - failed << "/" << boards.size() << " boards passed\n";
+    return failed == 0;
+}
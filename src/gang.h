@@ -0,0 +1,22 @@
+#pragma once
+
+#include "jtag.h"
+#include "config.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+class Image;
+
+// One board on a programming panel: its own, not yet opened, adapter and
+// the name it is reported under (USB serial or path)
+struct GangBoard {
+    std::string name;
+    std::unique_ptr<JtagAdapter> adapter;
+};
+
+// Detect, erase, program and verify every board at once, a thread each
+// with its own Jtag/Device/Flash. The image is shared read-only. Prints
+// combined progress while running and a pass/fail line per board after.
+// True when every board passed.
+bool gang_flash(std::vector<GangBoard>& boards, const Image& img, const Config& cfg);
@@ -0,0 +1,643 @@
+#include "gdb.h"
+#include "device.h"
+#include "flash.h"
+#include "memcache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET sock_t;
+static const sock_t NO_SOCKET = INVALID_SOCKET;
+static void close_socket(sock_t s) { closesocket(s); }
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int sock_t;
+static const sock_t NO_SOCKET = -1;
+static void close_socket(sock_t s) { close(s); }
+#endif
+
+// R0-R12, SP, LR, PC, xPSR: DCRSR selectors 0-16 and GDB's numbering
+static const int NUM_REGS = 17;
+
+// How often a running core is checked for a halt while waiting
+static const int POLL_MS = 10;
+
+// Longest m reply, in bytes of target memory (PacketSize is 0x4000 chars)
+static const uint32_t MAX_READ = 0x1f00;
+
+static const uint32_t DEMCR = 0xE000EDFC;
+static const uint32_t VC_CORERESET = 1u << 0;
+static const uint16_t BKPT = 0xbe00;
+
+static const char TARGET_XML[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target><architecture>arm</architecture>"
+    "<feature name=\"org.gnu.gdb.arm.m-profile\">"
+    "<reg name=\"r0\" bitsize=\"32\"/><reg name=\"r1\" bitsize=\"32\"/>"
+    "<reg name=\"r2\" bitsize=\"32\"/><reg name=\"r3\" bitsize=\"32\"/>"
+    "<reg name=\"r4\" bitsize=\"32\"/><reg name=\"r5\" bitsize=\"32\"/>"
+    "<reg name=\"r6\" bitsize=\"32\"/><reg name=\"r7\" bitsize=\"32\"/>"
+    "<reg name=\"r8\" bitsize=\"32\"/><reg name=\"r9\" bitsize=\"32\"/>"
+    "<reg name=\"r10\" bitsize=\"32\"/><reg name=\"r11\" bitsize=\"32\"/>"
+    "<reg name=\"r12\" bitsize=\"32\"/>"
+    "<reg name=\"sp\" bitsize=\"32\" type=\"data_ptr\"/>"
+    "<reg name=\"lr\" bitsize=\"32\"/>"
+    "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+    "<reg name=\"xpsr\" bitsize=\"32\"/>"
+    "</feature></target>";
+
+static int hex_digit(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Hex number at pos, which is left on the first character after it
+static uint32_t parse_hex(const std::string& s, size_t& pos) {
+    uint32_t v = 0;
+    while (pos < s.size() && hex_digit(s[pos]) >= 0) v = (v << 4) | hex_digit(s[pos++]);
+    return v;
+}
+
+static std::string to_hex(const uint8_t* data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(len * 2);
+    for (size_t i = 0; i < len; i++) {
+        out.push_back(digits[data[i] >> 4]);
+        out.push_back(digits[data[i] & 0xf]);
+    }
+    return out;
+}
+
+static std::vector<uint8_t> from_hex(const std::string& s, size_t pos) {
+    std::vector<uint8_t> out;
+    for (; pos + 1 < s.size(); pos += 2) {
+        int h = hex_digit(s[pos]), l = hex_digit(s[pos + 1]);
+        if (h < 0 || l < 0) break;
+        out.push_back(h << 4 | l);
+    }
+    return out;
+}
+
+// Binary packet data: '}' escapes the next byte, XORed with 0x20
+static std::vector<uint8_t> unescape(const std::string& s, size_t pos) {
+    std::vector<uint8_t> out;
+    for (; pos < s.size(); pos++) {
+        if (s[pos] == '}' && pos + 1 < s.size()) out.push_back(s[++pos] ^ 0x20);
+        else out.push_back(s[pos]);
+    }
+    return out;
+}
+
+static std::string escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '$' || c == '#' || c == '}' || c == '*') {
+            out.push_back('}');
+            out.push_back(c ^ 0x20);
+        } else {
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+// qXfer reply for "offset,length" of doc
+static std::string xfer(const std::string& doc, const std::string& range) {
+    size_t pos = 0;
+    uint32_t off = parse_hex(range, pos);
+    pos++;
+    uint32_t len = parse_hex(range, pos);
+    
+    if (off >= doc.size()) return "l";
+    std::string chunk = doc.substr(off, len);
+    return (off + chunk.size() < doc.size() ? "m" : "l") + escape(chunk);
+}
+
+// Flash regions as GDB flash, with ram around them so the rest of the
+// address space stays readable
+static std::string memory_map(const DeviceInfo* info) {
+    std::string map = "<?xml version=\"1.0\"?>"
+        "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" "
+        "\"http://sourceware.org/gdb/gdb-memory-map.dtd\"><memory-map>";
+    char entry[160];
+    uint64_t pos = 0;
+    
+    std::vector<FlashRegion> regions;
+    if (info) regions = info->flash_regions;
+    for (const auto& r : regions) {
+        if (pos < r.addr) {
+            snprintf(entry, sizeof(entry), "<memory type=\"ram\" start=\"0x%llx\" length=\"0x%llx\"/>",
+                     (unsigned long long)pos, (unsigned long long)(r.addr - pos));
+            map += entry;
+        }
+        snprintf(entry, sizeof(entry), "<memory type=\"flash\" start=\"0x%x\" length=\"0x%x\">"
+                 "<property name=\"blocksize\">0x%x</property></memory>", r.addr, r.size, r.sector_size);
+        map += entry;
+        pos = (uint64_t)r.addr + r.size;
+    }
+    if (pos < 0x100000000ull) {
+        snprintf(entry, sizeof(entry), "<memory type=\"ram\" start=\"0x%llx\" length=\"0x%llx\"/>",
+                 (unsigned long long)pos, (unsigned long long)(0x100000000ull - pos));
+        map += entry;
+    }
+    
+    return map + "</memory-map>";
+}
+
+class GdbSession {
+public:
+    GdbSession(sock_t fd, Device& dev, Flash& flash) : fd(fd), dev(dev), flash(flash), cache(&dev) {}
+    
+    // Packets until detach or kill; false if the connection broke
+    bool run();
+    
+    // Take out every breakpoint this session set
+    void finish();
+    
+    const MemCache& memory() const { return cache; }
+
+private:
+    int get_char(int timeout_ms);
+    bool send_all(const std::string& s);
+    bool read_packet(std::string& pkt);
+    bool send_packet(const std::string& data);
+    
+    std::string handle(const std::string& pkt, bool* done);
+    std::string query(const std::string& pkt);
+    std::string monitor(const std::string& cmd);
+    std::string read_regs();
+    std::string write_regs(const std::string& pkt);
+    std::string breakpoint(const std::string& pkt);
+    std::string run_core(bool step);
+    std::string flash_done();
+    bool load_regs();
+    void stale();
+    bool in_ram(uint32_t addr) const;
+    
+    sock_t fd;
+    Device& dev;
+    Flash& flash;
+    MemCache cache;
+    
+    char in[4096];
+    size_t in_pos = 0;
+    size_t in_len = 0;
+    bool no_ack = false;
+    bool broken = false;
+    
+    uint32_t regs[NUM_REGS];
+    bool regs_valid = false;
+    
+    // Software breakpoints in SRAM and the halfword each one replaced
+    std::map<uint32_t, uint16_t> sw_breaks;
+    
+    // vFlashErase ranges and vFlashWrite data, programmed on vFlashDone
+    std::vector<std::pair<uint32_t, uint32_t>> flash_erased;
+    std::map<uint32_t, std::vector<uint8_t>> flash_writes;
+};
+
+// Next byte from GDB; -1 when the connection is gone, -2 after timeout_ms
+// (negative waits for ever)
+int GdbSession::get_char(int timeout_ms) {
+    if (in_pos < in_len) return (uint8_t)in[in_pos++];
+    
+    if (timeout_ms >= 0) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        int r = select(fd + 1, &fds, nullptr, nullptr, &tv);
+        if (r == 0) return -2;
+        if (r < 0) return -1;
+    }
+    
+    int n = recv(fd, in, sizeof(in), 0);
+    if (n <= 0) return -1;
+    in_pos = 1;
+    in_len = n;
+    return (uint8_t)in[0];
+}
+
+bool GdbSession::send_all(const std::string& s) {
+    size_t done = 0;
+    while (done < s.size()) {
+        int n = send(fd, s.data() + done, s.size() - done, 0);
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+bool GdbSession::read_packet(std::string& pkt) {
+    for (;;) {
+        int c = get_char(-1);
+        if (c < 0) return false;
+        if (c != '$') continue;   // acks, and Ctrl-C while already halted
+        
+        std::string data;
+        uint8_t sum = 0;
+        while ((c = get_char(-1)) >= 0 && c != '#') {
+            data.push_back(c);
+            sum += c;
+        }
+        int hi = get_char(-1);
+        int lo = get_char(-1);
+        if (c < 0 || lo < 0) return false;
+        
+        if (no_ack) {
+            pkt = data;
+            return true;
+        }
+        if (hex_digit(hi) * 16 + hex_digit(lo) == sum) {
+            pkt = data;
+            return send_all("+");
+        }
+        if (!send_all("-")) return false;
+    }
+}
+
+bool GdbSession::send_packet(const std::string& data) {
+    uint8_t sum = 0;
+    for (char c : data) sum += c;
+    
+    char tail[4];
+    snprintf(tail, sizeof(tail), "#%02x", sum);
+    std::string frame = "$" + data + tail;
+    
+    for (int tries = 0; tries < 3; tries++) {
+        if (!send_all(frame)) return false;
+        if (no_ack) return true;
+        
+        int c;
+        do {
+            c = get_char(-1);
+        } while (c >= 0 && c != '+' && c != '-');
+        if (c == '+') return true;
+        if (c < 0) return false;
+    }
+    return false;
+}
+
+bool GdbSession::run() {
+    std::string pkt;
+    bool done = false;
+    
+    while (!done) {
+        if (!read_packet(pkt)) return false;
+        if (pkt.empty()) {
+            if (!send_packet("")) return false;
+            continue;
+        }
+        
+        // Acked the old way, then never again
+        if (pkt == "QStartNoAckMode") {
+            if (!send_packet("OK")) return false;
+            no_ack = true;
+            continue;
+        }
+        
+        // Kill has no reply
+        if (pkt[0] == 'k') break;
+        
+        std::string reply = handle(pkt, &done);
+        if (broken || !send_packet(reply)) return false;
+    }
+    
+    return true;
+}
+
+void GdbSession::finish() {
+    for (const auto& b : sw_breaks) {
+        cache.write(b.first, (const uint8_t*)&b.second, 2);
+    }
+    sw_breaks.clear();
+    dev.clear_breakpoints();
+}
+
+// The core ran or was reset: SRAM and registers may have changed
+void GdbSession::stale() {
+    cache.invalidate();
+    regs_valid = false;
+}
+
+bool GdbSession::in_ram(uint32_t addr) const {
+    const DeviceInfo* info = dev.info();
+    return info && addr >= 0x20000000 && addr + 2 <= 0x20000000 + info->ram_size;
+}
+
+std::string GdbSession::handle(const std::string& pkt, bool* done) {
+    size_t pos = 1;
+    
+    switch (pkt[0]) {
+        case '?':
+            return "S05";
+        case 'q':
+            return query(pkt);
+        case 'H':
+            return "OK";
+        case 'g':
+            return read_regs();
+        case 'G':
+            return write_regs(pkt);
+        case 'p': {
+            uint32_t n = parse_hex(pkt, pos);
+            if (n >= NUM_REGS) return "E01";
+            if (!load_regs()) return "E01";
+            return to_hex((const uint8_t*)&regs[n], 4);
+        }
+        case 'P': {
+            uint32_t n = parse_hex(pkt, pos);
+            std::vector<uint8_t> v = from_hex(pkt, pos + 1);
+            if (n >= NUM_REGS || v.size() != 4) return "E01";
+            uint32_t value;
+            memcpy(&value, v.data(), 4);
+            if (!dev.write_reg(n, value)) return "E01";
+            regs[n] = value;
+            return "OK";
+        }
+        case 'm': {
+            uint32_t addr = parse_hex(pkt, pos);
+            pos++;
+            uint32_t len = parse_hex(pkt, pos);
+            if (len > MAX_READ) len = MAX_READ;
+            
+            std::vector<uint8_t> buf(len);
+            if (!cache.read(addr, buf.data(), len)) return "E01";
+            return to_hex(buf.data(), len);
+        }
+        case 'M':
+        case 'X': {
+            uint32_t addr = parse_hex(pkt, pos);
+            pos++;
+            uint32_t len = parse_hex(pkt, pos);
+            std::vector<uint8_t> data = pkt[0] == 'M' ? from_hex(pkt, pos + 1) : unescape(pkt, pos + 1);
+            if (data.size() < len) return "E01";
+            if (len && !cache.write(addr, data.data(), len)) return "E01";
+            return "OK";
+        }
+        case 'c':
+        case 's': {
+            if (pos < pkt.size()) {
+                uint32_t pc = parse_hex(pkt, pos);
+                if (!dev.write_reg(15, pc)) return "E01";
+            }
+            return run_core(pkt[0] == 's');
+        }
+        case 'Z':
+        case 'z':
+            return breakpoint(pkt);
+        case 'D':
+            finish();
+            *done = true;
+            return dev.resume() ? "OK" : "E01";
+        case 'v':
+            if (pkt.rfind("vFlashErase:", 0) == 0) {
+                pos = 12;
+                uint32_t addr = parse_hex(pkt, pos);
+                pos++;
+                uint32_t len = parse_hex(pkt, pos);
+                flash_erased.push_back({addr, len});
+                return "OK";
+            }
+            if (pkt.rfind("vFlashWrite:", 0) == 0) {
+                pos = 12;
+                uint32_t addr = parse_hex(pkt, pos);
+                flash_writes[addr] = unescape(pkt, pos + 1);
+                return "OK";
+            }
+            if (pkt == "vFlashDone") return flash_done();
+            if (pkt == "vKill" || pkt.rfind("vKill;", 0) == 0) {
+                *done = true;
+                return "OK";
+            }
+            return "";
+    }
+    
+    return "";
+}
+
+std::string GdbSession::query(const std::string& pkt) {
+    if (pkt.rfind("qSupported", 0) == 0)
+        return "PacketSize=4000;qXfer:memory-map:read+;qXfer:features:read+;QStartNoAckMode+";
+    if (pkt.rfind("qXfer:features:read:target.xml:", 0) == 0)
+        return xfer(TARGET_XML, pkt.substr(31));
+    if (pkt.rfind("qXfer:memory-map:read::", 0) == 0)
+        return xfer(memory_map(dev.info()), pkt.substr(23));
+    if (pkt.rfind("qRcmd,", 0) == 0) {
+        std::vector<uint8_t> cmd = from_hex(pkt, 6);
+        return monitor(std::string(cmd.begin(), cmd.end()));
+    }
+    if (pkt == "qAttached") return "1";
+    if (pkt.rfind("qSymbol", 0) == 0) return "OK";
+    return "";
+}
+
+// "monitor reset" halts at the reset vector; output goes back hex-encoded
+std::string GdbSession::monitor(const std::string& cmd) {
+    if (cmd == "reset" || cmd == "reset halt") {
+        uint32_t demcr = 0;
+        if (!dev.read_mem(DEMCR, (uint8_t*)&demcr, 4)) return "E01";
+        uint32_t catch_reset = demcr | VC_CORERESET;
+        bool ok = dev.write_mem(DEMCR, (uint8_t*)&catch_reset, 4) && dev.reset() && dev.halt();
+        ok = dev.write_mem(DEMCR, (uint8_t*)&demcr, 4) && ok;
+        stale();
+        return ok ? "OK" : "E01";
+    }
+    if (cmd == "halt") return dev.halt() ? "OK" : "E01";
+    
+    std::string msg = "Monitor commands: reset, halt\n";
+    return to_hex((const uint8_t*)msg.data(), msg.size());
+}
+
+bool GdbSession::load_regs() {
+    if (regs_valid) return true;
+    for (int i = 0; i < NUM_REGS; i++) {
+        if (!dev.read_reg(i, &regs[i])) return false;
+    }
+    regs_valid = true;
+    return true;
+}
+
+std::string GdbSession::read_regs() {
+    if (!load_regs()) return "E01";
+    return to_hex((const uint8_t*)regs, sizeof(regs));
+}
+
+std::string GdbSession::write_regs(const std::string& pkt) {
+    std::vector<uint8_t> v = from_hex(pkt, 1);
+    int n = v.size() / 4 < NUM_REGS ? v.size() / 4 : NUM_REGS;
+    
+    for (int i = 0; i < n; i++) {
+        memcpy(&regs[i], &v[i * 4], 4);
+        if (!dev.write_reg(i, regs[i])) {
+            regs_valid = false;
+            return "E01";
+        }
+    }
+    regs_valid = n == NUM_REGS;
+    return "OK";
+}
+
+// Z0 in SRAM patches in a BKPT; Z0 elsewhere and Z1 take an FPB comparator
+std::string GdbSession::breakpoint(const std::string& pkt) {
+    bool set = pkt[0] == 'Z';
+    int type = pkt[1] - '0';
+    size_t pos = 3;
+    uint32_t addr = parse_hex(pkt, pos);
+    
+    if (type != 0 && type != 1) return "";
+    
+    if (type == 0 && in_ram(addr)) {
+        if (set) {
+            if (sw_breaks.count(addr)) return "OK";
+            uint16_t orig;
+            if (!cache.read(addr, (uint8_t*)&orig, 2)) return "E01";
+            if (!cache.write(addr, (const uint8_t*)&BKPT, 2)) return "E01";
+            sw_breaks[addr] = orig;
+        } else {
+            auto it = sw_breaks.find(addr);
+            if (it == sw_breaks.end()) return "OK";
+            if (!cache.write(addr, (const uint8_t*)&it->second, 2)) return "E01";
+            sw_breaks.erase(it);
+        }
+        return "OK";
+    }
+    
+    if (set) return dev.set_breakpoint(addr) ? "OK" : "E01";
+    return dev.clear_breakpoint(addr) ? "OK" : "E01";
+}
+
+// Step, or run until the core halts or GDB sends Ctrl-C
+std::string GdbSession::run_core(bool step) {
+    stale();
+    
+    if (step) return dev.step() ? "S05" : "E01";
+    if (!dev.resume()) return "E01";
+    
+    for (;;) {
+        int c = get_char(POLL_MS);
+        if (c == -1) {
+            broken = true;
+            dev.halt();
+            return "";
+        }
+        if (c == 0x03) return dev.halt() ? "S02" : "E01";
+        
+        bool halted = false;
+        if (!dev.is_halted(&halted)) return "E01";
+        if (halted) return "S05";
+    }
+}
+
+// Each erased range is programmed whole: written data over 0xff, through
+// update() so sectors that already hold it are left alone
+std::string GdbSession::flash_done() {
+    std::vector<std::pair<uint32_t, uint32_t>> erased;
+    std::map<uint32_t, std::vector<uint8_t>> writes;
+    erased.swap(flash_erased);
+    writes.swap(flash_writes);
+    
+    if (!flash.detect() || !flash.load_driver()) {
+        std::cerr << "Flash not supported\n";
+        return "E01";
+    }
+    
+    FlashUpdateStats st;
+    for (const auto& r : erased) {
+        std::vector<uint8_t> buf(r.second, 0xff);
+        for (const auto& w : writes) {
+            uint64_t lo = w.first > r.first ? w.first : r.first;
+            uint64_t hi = std::min<uint64_t>((uint64_t)w.first + w.second.size(), (uint64_t)r.first + r.second);
+            if (lo < hi) memcpy(&buf[lo - r.first], &w.second[lo - w.first], hi - lo);
+        }
+        
+        // The loader and CRC stub run from SRAM and borrow the registers,
+        // so SRAM lines and registers go as well as the flash range, which
+        // invalidate() alone would keep
+        bool ok = flash.update(r.first, buf.data(), buf.size(), &st);
+        cache.forget(r.first, r.second);
+        stale();
+        if (!ok) return "E01";
+    }
+    
+    std::cout << "Flash: wrote " << st.bytes_written << " bytes in " << st.sectors_written
+              << " sectors, " << st.sectors_skipped << " unchanged" << std::endl;
+    return "OK";
+}
+
+bool gdb_serve(Device& dev, Flash& flash, uint16_t port, bool verbose) {
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        std::cerr << "Winsock failed to start\n";
+        return false;
+    }
+#endif
+
+    sock_t ls = socket(AF_INET, SOCK_STREAM, 0);
+    if (ls == NO_SOCKET) {
+        std::cerr << "Can't create socket\n";
+        return false;
+    }
+    
+    int on = 1;
+    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+    
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    if (bind(ls, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(ls, 1) < 0) {
+        std::cerr << "Can't listen on port " << port << "\n";
+        close_socket(ls);
+        return false;
+    }
+    
+    std::cout << "Waiting for GDB on localhost:" << port << std::endl;
+    sock_t fd = accept(ls, nullptr, nullptr);
+    close_socket(ls);
+    if (fd == NO_SOCKET) {
+        std::cerr << "accept failed\n";
+        return false;
+    }
+    
+    // Packets are small and strictly request/reply
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+    
+    if (!dev.halt()) {
+        close_socket(fd);
+        return false;
+    }
+    std::cout << "GDB connected, core halted" << std::endl;
+    
+    GdbSession session(fd, dev, flash);
+    bool ok = session.run();
+    session.finish();
+    close_socket(fd);
+    
+    std::cout << (ok ? "GDB detached\n" : "GDB connection lost\n");
+    if (verbose) {
+        const MemCache::Stats& st = session.memory().stats();
+        std::cout << "Memory cache: " << st.hits << " line hits, " << st.misses << " lines fetched in "
+                  << st.fetches << " reads, " << st.uncached << " uncached reads\n";
+    }
+    return ok;
+}
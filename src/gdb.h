@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+
+class Device;
+class Flash;
+
+// GDB remote serial protocol server on 127.0.0.1:port. Halts the core when
+// GDB connects and serves that one session (registers, memory through a
+// MemCache, FPB breakpoints, run control and flash programming via GDB's
+// memory map) until GDB detaches or kills. False if the port can't be
+// opened or the connection breaks.
+bool gdb_serve(Device& dev, Flash& flash, uint16_t port, bool verbose);
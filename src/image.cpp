@@ -0,0 +1,428 @@
+#include "image.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+#ifdef _WIN32
+bool MappedFile::open(const std::string& path) {
+    close();
+    
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        file = nullptr;
+        return false;
+    }
+    
+    LARGE_INTEGER sz;
+    if (!GetFileSizeEx(file, &sz)) {
+        close();
+        return false;
+    }
+    len = sz.QuadPart;
+    if (len == 0) return true;
+    
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) {
+        close();
+        return false;
+    }
+    
+    base = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!base) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::close() {
+    if (base) UnmapViewOfFile((void*)base);
+    if (mapping) CloseHandle(mapping);
+    if (file) CloseHandle(file);
+    base = nullptr;
+    mapping = nullptr;
+    file = nullptr;
+    len = 0;
+}
+#else
+bool MappedFile::open(const std::string& path) {
+    close();
+    
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        ::close(fd);
+        return false;
+    }
+    
+    len = st.st_size;
+    if (len) {
+        void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            len = 0;
+            return false;
+        }
+        base = (const uint8_t*)p;
+    }
+    
+    // The mapping keeps the file alive
+    ::close(fd);
+    return true;
+}
+
+void MappedFile::close() {
+    if (base) munmap((void*)base, len);
+    base = nullptr;
+    len = 0;
+}
+#endif
+
+static uint16_t rd16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t rd32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int hex_digit(uint8_t c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// n bytes of ASCII hex at p into out
+static bool hex_bytes(const uint8_t* p, const uint8_t* end, int n, uint8_t* out) {
+    if (end - p < 2 * n) return false;
+    for (int i = 0; i < n; i++) {
+        int hi = hex_digit(p[2 * i]);
+        int lo = hex_digit(p[2 * i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out[i] = (hi << 4) | lo;
+    }
+    return true;
+}
+
+bool Image::load(const std::string& path, uint32_t bin_base) {
+    segs.clear();
+    decoded.clear();
+    
+    if (!file.open(path)) {
+        std::cerr << "Can't open " << path << "\n";
+        return false;
+    }
+    
+    const uint8_t* p = file.data();
+    size_t n = file.size();
+    
+    if (n >= 4 && memcmp(p, "\x7f" "ELF", 4) == 0) {
+        fmt = "elf";
+        if (!load_elf()) return false;
+    } else if (n && p[0] == ':') {
+        fmt = "ihex";
+        if (!load_hex()) return false;
+    } else if (n >= 2 && p[0] == 'S' && p[1] >= '0' && p[1] <= '9') {
+        fmt = "srec";
+        if (!load_srec()) return false;
+    } else {
+        fmt = "bin";
+        if (n && !add(bin_base, p, n)) return false;
+    }
+    
+    return finish();
+}
+
+uint32_t Image::size() const {
+    uint32_t total = 0;
+    for (const auto& s : segs) total += s.len;
+    return total;
+}
+
+// Appends to the previous segment when both address and data follow on
+bool Image::add(uint32_t addr, const uint8_t* data, uint32_t len) {
+    if (!len) return true;
+    
+    if (!segs.empty()) {
+        ImageSegment& last = segs.back();
+        if (last.addr + last.len == addr && last.data + last.len == data) {
+            last.len += len;
+            return true;
+        }
+    }
+    
+    segs.push_back({addr, data, len});
+    return true;
+}
+
+// Sort, reject overlaps and join what touches
+bool Image::finish() {
+    std::sort(segs.begin(), segs.end(),
+              [](const ImageSegment& a, const ImageSegment& b) { return a.addr < b.addr; });
+    
+    std::vector<ImageSegment> out;
+    for (const auto& s : segs) {
+        if (!out.empty()) {
+            ImageSegment& last = out.back();
+            if ((uint64_t)last.addr + last.len > s.addr) {
+                std::cerr << "Image: overlapping data at 0x" << std::hex << s.addr << std::dec << "\n";
+                return false;
+            }
+            if (last.addr + last.len == s.addr && last.data + last.len == s.data) {
+                last.len += s.len;
+                continue;
+            }
+        }
+        out.push_back(s);
+    }
+    
+    segs.swap(out);
+    return true;
+}
+
+// ELF32 little-endian: every PT_LOAD with file contents, at its load
+// (physical) address so initialised data lands in flash
+bool Image::load_elf() {
+    const uint8_t* p = file.data();
+    size_t n = file.size();
+    
+    if (n < 52 || p[4] != 1 || p[5] != 1) {
+        std::cerr << "ELF: only 32-bit little-endian files are supported\n";
+        return false;
+    }
+    
+    uint32_t phoff = rd32(p + 28);
+    uint16_t phentsize = rd16(p + 42);
+    uint16_t phnum = rd16(p + 44);
+    
+    if (phentsize < 32 || phoff + (uint64_t)phentsize * phnum > n) {
+        std::cerr << "ELF: bad program header table\n";
+        return false;
+    }
+    
+    for (int i = 0; i < phnum; i++) {
+        const uint8_t* ph = p + phoff + i * phentsize;
+        uint32_t type = rd32(ph);
+        uint32_t offset = rd32(ph + 4);
+        uint32_t paddr = rd32(ph + 12);
+        uint32_t filesz = rd32(ph + 16);
+        
+        if (type != 1 || !filesz) continue;  // PT_LOAD
+        
+        if ((uint64_t)offset + filesz > n) {
+            std::cerr << "ELF: segment " << i << " runs past the end of the file\n";
+            return false;
+        }
+        segs.push_back({paddr, p + offset, filesz});
+    }
+    
+    return true;
+}
+
+// Intel HEX: data (00), EOF (01), extended segment (02) and linear (04)
+// address records. Start address records are ignored.
+bool Image::load_hex() {
+    const uint8_t* p = file.data();
+    const uint8_t* end = p + file.size();
+    
+    // Decoded data never outgrows half the text, so pointers stay put
+    decoded.reserve(file.size() / 2);
+    
+    uint32_t upper = 0;
+    int line = 0;
+    
+    while (p < end) {
+        if (*p == '\r' || *p == '\n' || *p == ' ' || *p == '\t') {
+            if (*p == '\n') line++;
+            p++;
+            continue;
+        }
+        
+        uint8_t head[4];
+        if (*p++ != ':' || !hex_bytes(p, end, 4, head)) {
+            std::cerr << "HEX: bad record on line " << line + 1 << "\n";
+            return false;
+        }
+        
+        int count = head[0];
+        uint32_t offset = (head[1] << 8) | head[2];
+        int type = head[3];
+        
+        uint8_t rec[256 + 5];
+        if (!hex_bytes(p, end, 5 + count, rec)) {
+            std::cerr << "HEX: short record on line " << line + 1 << "\n";
+            return false;
+        }
+        p += 2 * (5 + count);
+        
+        uint8_t sum = 0;
+        for (int i = 0; i < 5 + count; i++) sum += rec[i];
+        if (sum) {
+            std::cerr << "HEX: checksum error on line " << line + 1 << "\n";
+            return false;
+        }
+        
+        const uint8_t* payload = rec + 4;
+        switch (type) {
+            case 0x00: {
+                const uint8_t* at = decoded.data() + decoded.size();
+                decoded.insert(decoded.end(), payload, payload + count);
+                if (!add(upper + offset, at, count)) return false;
+                break;
+            }
+            case 0x01:
+                return true;
+            case 0x02:
+                upper = ((payload[0] << 8) | payload[1]) << 4;
+                break;
+            case 0x04:
+                upper = ((payload[0] << 8) | payload[1]) << 16;
+                break;
+            default:
+                break;
+        }
+    }
+    
+    return true;
+}
+
+// Motorola S-records: S1/S2/S3 data with 16/24/32-bit addresses
+bool Image::load_srec() {
+    const uint8_t* p = file.data();
+    const uint8_t* end = p + file.size();
+    
+    decoded.reserve(file.size() / 2);
+    int line = 0;
+    
+    while (p < end) {
+        if (*p == '\r' || *p == '\n' || *p == ' ' || *p == '\t') {
+            if (*p == '\n') line++;
+            p++;
+            continue;
+        }
+        
+        if (end - p < 4 || p[0] != 'S' || p[1] < '0' || p[1] > '9') {
+            std::cerr << "SREC: bad record on line " << line + 1 << "\n";
+            return false;
+        }
+        int type = p[1] - '0';
+        p += 2;
+        
+        uint8_t rec[256];
+        if (!hex_bytes(p, end, 1, rec) || rec[0] < 3 || !hex_bytes(p, end, 1 + rec[0], rec)) {
+            std::cerr << "SREC: short record on line " << line + 1 << "\n";
+            return false;
+        }
+        int count = rec[0];
+        p += 2 * (1 + count);
+        
+        uint8_t sum = 0;
+        for (int i = 0; i <= count; i++) sum += rec[i];
+        if (sum != 0xff) {
+            std::cerr << "SREC: checksum error on line " << line + 1 << "\n";
+            return false;
+        }
+        
+        if (type < 1 || type > 3) continue;  // header, count, start address
+        
+        int alen = type + 1;
+        uint32_t addr = 0;
+        for (int i = 0; i < alen; i++) addr = (addr << 8) | rec[1 + i];
+        
+        int dlen = count - alen - 1;
+        if (dlen < 0) {
+            std::cerr << "SREC: bad length on line " << line + 1 << "\n";
+            return false;
+        }
+        
+        const uint8_t* at = decoded.data() + decoded.size();
+        decoded.insert(decoded.end(), rec + 1 + alen, rec + 1 + alen + dlen);
+        if (!add(addr, at, dlen)) return false;
+    }
+    
+    return true;
+}
+
+// The SHT_SYMTAB section's STT_FUNC entries, named from its linked string
+// table. Stripped files have none.
+bool ElfSymbols::load(const std::string& path) {
+    syms.clear();
+    
+    MappedFile file;
+    if (!file.open(path)) {
+        std::cerr << "Can't open " << path << "\n";
+        return false;
+    }
+    
+    const uint8_t* p = file.data();
+    size_t n = file.size();
+    if (n < 52 || memcmp(p, "\x7f" "ELF", 4) != 0 || p[4] != 1 || p[5] != 1) {
+        std::cerr << path << ": not a 32-bit little-endian ELF file\n";
+        return false;
+    }
+    
+    uint32_t shoff = rd32(p + 32);
+    uint16_t shentsize = rd16(p + 46);
+    uint16_t shnum = rd16(p + 48);
+    if (shentsize < 40 || shoff + (uint64_t)shentsize * shnum > n) {
+        std::cerr << path << ": bad section header table\n";
+        return false;
+    }
+    
+    for (int i = 0; i < shnum; i++) {
+        const uint8_t* sh = p + shoff + i * shentsize;
+        if (rd32(sh + 4) != 2) continue;  // SHT_SYMTAB
+        
+        uint32_t offset = rd32(sh + 16);
+        uint32_t size = rd32(sh + 20);
+        uint32_t link = rd32(sh + 24);
+        if ((uint64_t)offset + size > n || link >= shnum) break;
+        
+        const uint8_t* str = p + shoff + link * shentsize;
+        uint32_t str_off = rd32(str + 16);
+        uint32_t str_size = rd32(str + 20);
+        if ((uint64_t)str_off + str_size > n) break;
+        
+        for (uint32_t s = 0; s + 16 <= size; s += 16) {
+            const uint8_t* sym = p + offset + s;
+            uint32_t name = rd32(sym);
+            uint16_t shndx = rd16(sym + 14);
+            if ((sym[12] & 0xf) != 2 || shndx == 0 || name >= str_size) continue;  // STT_FUNC
+            
+            const char* str_base = (const char*)p + str_off;
+            syms.push_back({rd32(sym + 4) & ~1u, rd32(sym + 8),
+                            std::string(str_base + name, strnlen(str_base + name, str_size - name))});
+        }
+    }
+    
+    std::sort(syms.begin(), syms.end(),
+              [](const ElfSymbol& a, const ElfSymbol& b) { return a.addr < b.addr; });
+    return true;
+}
+
+const ElfSymbol* ElfSymbols::find(uint32_t addr) const {
+    auto it = std::upper_bound(syms.begin(), syms.end(), addr,
+                               [](uint32_t a, const ElfSymbol& s) { return a < s.addr; });
+    if (it == syms.begin()) return nullptr;
+    
+    const ElfSymbol& s = *(it - 1);
+    uint32_t end = s.size ? s.addr + s.size : it != syms.end() ? it->addr : s.addr + 1;
+    return addr < end ? &s : nullptr;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file, mapped rather than read
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    bool open(const std::string& path);
+    void close();
+    
+    const uint8_t* data() const { return base; }
+    size_t size() const { return len; }
+
+private:
+    const uint8_t* base = nullptr;
+    size_t len = 0;
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#endif
+};
+
+// Bytes to place at addr. Binary and ELF payloads point into the mapped
+// file; HEX and S-record data into the image's decode buffer.
+struct ImageSegment {
+    uint32_t addr;
+    const uint8_t* data;
+    uint32_t len;
+};
+
+// A firmware image as a sorted list of non-overlapping address ranges.
+// Gaps between ELF segments or HEX/S-record blocks stay gaps.
+class Image {
+public:
+    // Format is picked from the contents; raw binaries load at bin_base
+    bool load(const std::string& path, uint32_t bin_base);
+    
+    const std::vector<ImageSegment>& segments() const { return segs; }
+    const char* format() const { return fmt; }
+    uint32_t size() const;
+
+private:
+    bool load_elf();
+    bool load_hex();
+    bool load_srec();
+    bool add(uint32_t addr, const uint8_t* data, uint32_t len);
+    bool finish();
+    
+    MappedFile file;
+    const char* fmt = "bin";
+    std::vector<ImageSegment> segs;
+    std::vector<uint8_t> decoded;
+};
+
+struct ElfSymbol {
+    uint32_t addr;         // Thumb bit cleared
+    uint32_t size;         // 0 when the ELF doesn't say
+    std::string name;
+};
+
+// Function symbols of an ELF file, for naming code addresses
+class ElfSymbols {
+public:
+    bool load(const std::string& path);
+    
+    // The function holding addr; one without a size runs up to the next.
+    // nullptr outside all of them.
+    const ElfSymbol* find(uint32_t addr) const;
+    
+    size_t size() const { return syms.size(); }
+
+private:
+    std::vector<ElfSymbol> syms;   // by address
+};
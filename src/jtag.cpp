@@ -1,7 +1,49 @@
 #include "jtag.h"
 #include <cstring>
+#include <array>
+#include <algorithm>
+#include <iostream>
+#include <chrono>
 
-Jtag::Jtag(JtagAdapter* a) : adapter(a), state(0) {}
+void JtagAdapter::queue_tms(uint32_t tms, int len) {
+    for (int i = 0; i < len; i++) {
+        set_pin(JtagPin::TMS, (tms >> i) & 1);
+        set_pin(JtagPin::TCK, 0);
+        set_pin(JtagPin::TCK, 1);
+    }
+}
+
+void JtagAdapter::queue_shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) {
+    set_pin(JtagPin::TMS, 0);
+    
+    for (int i = 0; i < len; i++) {
+        bool bit = tdi ? (tdi[i/8] >> (i % 8)) & 1 : 0;
+        
+        set_pin(JtagPin::TDI, bit);
+        if (exit && i == len - 1)
+            set_pin(JtagPin::TMS, 1);
+        set_pin(JtagPin::TCK, 0);
+        
+        if (tdo) {
+            if (get_pin(JtagPin::TDO)) tdo[i/8] |= (1 << (i % 8));
+            else tdo[i/8] &= ~(1 << (i % 8));
+        }
+        
+        set_pin(JtagPin::TCK, 1);
+    }
+}
+
+bool JtagAdapter::flush() {
+    return true;
+}
+
+uint64_t JtagAdapter::now_us() const {
+    auto t = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::microseconds>(t).count();
+}
+
+Jtag::Jtag(JtagAdapter* a)
+    : adapter(a), state(TapState::Reset), idle_cycles(0), resets(0), ir_scans(0) {}
 
 Jtag::~Jtag() {
     if (adapter)
@@ -21,114 +63,211 @@ void Jtag::reset() {
 }
 
 void Jtag::reset_tap() {
-    // 5 TMS highs to get to Test-Logic-Reset
-    for (int i = 0; i < 5; i++) {
-        adapter->set_pin(JtagPin::TMS, 1);
-        adapter->set_pin(JtagPin::TCK, 0);
-        adapter->set_pin(JtagPin::TCK, 1);
-    }
-    
-    // Idle
-    adapter->set_pin(JtagPin::TMS, 0);
-    adapter->set_pin(JtagPin::TCK, 0);
-    adapter->set_pin(JtagPin::TCK, 1);
+    // 5 TMS highs get to Test-Logic-Reset from anywhere
+    clock_tms(0x1f, 5);
+    state = TapState::Reset;
+    resets++;
+    goto_state(TapState::Idle);
+    flush();
 }
 
-void Jtag::pulse_clock(int n) {
-    for (int i = 0; i < n; i++) {
-        adapter->set_pin(JtagPin::TCK, 0);
-        adapter->set_pin(JtagPin::TCK, 1);
+TapState Jtag::next_state(TapState from, bool tms) {
+    using S = TapState;
+    switch (from) {
+        case S::Reset:     return tms ? S::Reset : S::Idle;
+        case S::Idle:      return tms ? S::SelectDR : S::Idle;
+        case S::SelectDR:  return tms ? S::SelectIR : S::CaptureDR;
+        case S::CaptureDR: return tms ? S::Exit1DR : S::ShiftDR;
+        case S::ShiftDR:   return tms ? S::Exit1DR : S::ShiftDR;
+        case S::Exit1DR:   return tms ? S::UpdateDR : S::PauseDR;
+        case S::PauseDR:   return tms ? S::Exit2DR : S::PauseDR;
+        case S::Exit2DR:   return tms ? S::UpdateDR : S::ShiftDR;
+        case S::UpdateDR:  return tms ? S::SelectDR : S::Idle;
+        case S::SelectIR:  return tms ? S::Reset : S::CaptureIR;
+        case S::CaptureIR: return tms ? S::Exit1IR : S::ShiftIR;
+        case S::ShiftIR:   return tms ? S::Exit1IR : S::ShiftIR;
+        case S::Exit1IR:   return tms ? S::UpdateIR : S::PauseIR;
+        case S::PauseIR:   return tms ? S::Exit2IR : S::PauseIR;
+        case S::Exit2IR:   return tms ? S::UpdateIR : S::ShiftIR;
+        case S::UpdateIR:  return tms ? S::SelectDR : S::Idle;
     }
+    return TapState::Reset;
 }
 
-void Jtag::shift_ir(const uint8_t* data, int len) {
-    // Select-DR-Scan
-    adapter->set_pin(JtagPin::TMS, 1);
-    pulse_clock();
-    
-    // Select-IR-Scan
-    adapter->set_pin(JtagPin::TMS, 1);
-    pulse_clock();
+int Jtag::tms_path(TapState from, TapState to, uint32_t* tms) {
+    struct Path { uint8_t bits, len; };
     
-    // Capture-IR
-    adapter->set_pin(JtagPin::TMS, 0);
-    pulse_clock();
+    // Breadth-first search from every state, done once
+    static const auto table = [] {
+        std::array<std::array<Path, 16>, 16> t{};
+        for (int src = 0; src < 16; src++) {
+            bool seen[16] = {};
+            int queue[16], head = 0, tail = 0;
+            
+            seen[src] = true;
+            t[src][src] = {0, 0};
+            queue[tail++] = src;
+            
+            while (head < tail) {
+                int cur = queue[head++];
+                for (int bit = 0; bit < 2; bit++) {
+                    int nxt = (int)next_state((TapState)cur, bit);
+                    if (seen[nxt]) continue;
+                    seen[nxt] = true;
+                    Path p = t[src][cur];
+                    t[src][nxt] = {(uint8_t)(p.bits | (bit << p.len)), (uint8_t)(p.len + 1)};
+                    queue[tail++] = nxt;
+                }
+            }
+        }
+        return t;
+    }();
     
-    // Shift-IR
-    adapter->set_pin(JtagPin::TMS, 0);
-    pulse_clock();
+    Path p = table[(int)from][(int)to];
+    *tms = p.bits;
+    return p.len;
+}
+
+void Jtag::clock_tms(uint32_t tms, int len) {
+    if (len <= 0) return;
     
-    // Shift bits
-    for (int i = 0; i < len; i++) {
-        bool bit = (data[i/8] >> (i % 8)) & 1;
-        adapter->set_pin(JtagPin::TDI, bit);
-        
-        if (i == len - 1)
-            adapter->set_pin(JtagPin::TMS, 1);  // Exit1-IR
-        
-        pulse_clock();
+    adapter->queue_tms(tms, len);
+    stats_.tck += len;
+    stats_.tms_clocks += len;
+    for (int i = 0; i < len; i++)
+        state = next_state(state, (tms >> i) & 1);
+}
+
+void Jtag::goto_state(TapState to) {
+    uint32_t tms;
+    int len = tms_path(state, to, &tms);
+    clock_tms(tms, len);
+}
+
+void Jtag::idle(int cycles) {
+    goto_state(TapState::Idle);
+    while (cycles > 0) {
+        int n = cycles > 32 ? 32 : cycles;
+        clock_tms(0, n);
+        cycles -= n;
     }
+}
+
+void Jtag::queue_scan(bool ir, const uint8_t* data, int len, uint8_t* out, TapState end) {
+    if (len <= 0) return;
+    
+    // From Pause this resumes via Exit2, otherwise it goes through Capture
+    goto_state(ir ? TapState::ShiftIR : TapState::ShiftDR);
     
-    // Update-IR
-    adapter->set_pin(JtagPin::TMS, 1);
-    pulse_clock();
+    if (out) memset(out, 0, (len + 7) / 8);
     
-    // Run-Test/Idle
-    adapter->set_pin(JtagPin::TMS, 0);
-    pulse_clock();
+    // Shift bits, last one moves to Exit1
+    shift(data, out, len, true);
+    finish_scan(ir, end);
 }
 
-void Jtag::shift_dr(const uint8_t* data, int len, uint8_t* out) {
-    // Select-DR-Scan
-    adapter->set_pin(JtagPin::TMS, 1);
-    pulse_clock();
-    
-    // Capture-DR
-    adapter->set_pin(JtagPin::TMS, 0);
-    pulse_clock();
+// Bits go in chain order: the TAP nearest TDO first, each LSB first.
+// Runs of bypassed TAPs are shifted as one.
+void Jtag::queue_scan(bool ir, const std::vector<int>& taps, const uint8_t* data, int len,
+                      uint8_t* out, TapState end) {
+    if (chain.empty()) {
+        queue_scan(ir, data, len, out, end);
+        return;
+    }
+    if (len <= 0) return;
     
-    // Shift-DR
-    adapter->set_pin(JtagPin::TMS, 0);
-    pulse_clock();
+    goto_state(ir ? TapState::ShiftIR : TapState::ShiftDR);
     
-    int bytes = (len + 7) / 8;
-    std::vector<uint8_t> outbuf;
-    if (out) outbuf.resize(bytes, 0);
+    int stride = (len + 7) / 8;
+    int last = chain.size() - 1;
+    int bypass = 0;
     
-    // Shift bits
-    for (int i = 0; i < len; i++) {
-        bool bit = 0;
-        if (data) bit = (data[i/8] >> (i % 8)) & 1;
-        
-        adapter->set_pin(JtagPin::TDI, bit);
-        adapter->set_pin(JtagPin::TCK, 0);
-        
-        bool tdo = adapter->get_pin(JtagPin::TDO);
-        if (out) {
-            if (tdo) outbuf[i/8] |= (1 << (i % 8));
+    for (int t = 0; t <= last; t++) {
+        if (std::find(taps.begin(), taps.end(), t) == taps.end()) {
+            bypass += ir ? chain[t].ir_len : 1;
+            if (t == last) shift(ones.data(), nullptr, bypass, true);
+            continue;
         }
         
-        if (i == len - 1)
-            adapter->set_pin(JtagPin::TMS, 1);  // Exit1-DR
+        if (bypass) shift(ones.data(), nullptr, bypass, false);
+        bypass = 0;
         
-        adapter->set_pin(JtagPin::TCK, 1);
+        if (out) memset(out, 0, stride);
+        shift(data, out, len, t == last);
+        if (out) out += stride;
     }
     
-    // Update-DR
-    adapter->set_pin(JtagPin::TMS, 1);
-    pulse_clock();
+    finish_scan(ir, end);
+}
+
+void Jtag::shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) {
+    adapter->queue_shift(tdi, tdo, len, exit);
+    stats_.tck += len;
+}
+
+void Jtag::finish_scan(bool ir, TapState end) {
+    state = ir ? TapState::Exit1IR : TapState::Exit1DR;
+    if (ir) {
+        ir_scans++;
+        stats_.ir_scans++;
+    } else {
+        stats_.dr_scans++;
+    }
     
-    // Run-Test/Idle
-    adapter->set_pin(JtagPin::TMS, 0);
-    pulse_clock();
+    // Anything but Pause has to latch the register in Update first
+    TapState pause = ir ? TapState::PauseIR : TapState::PauseDR;
+    if (end != pause)
+        clock_tms(0x01, 1);
+    goto_state(end);
     
-    if (out) memcpy(out, outbuf.data(), bytes);
+    if (end == TapState::Idle && idle_cycles)
+        idle(idle_cycles);
+}
+
+void Jtag::queue_ir(const uint8_t* data, int len, TapState end) {
+    queue_scan(true, data, len, nullptr, end);
+}
+
+void Jtag::queue_dr(const uint8_t* data, int len, uint8_t* out, TapState end) {
+    queue_scan(false, data, len, out, end);
+}
+
+void Jtag::queue_ir(const std::vector<int>& taps, const uint8_t* data, int len, TapState end) {
+    queue_scan(true, taps, data, len, nullptr, end);
+}
+
+void Jtag::queue_dr(const std::vector<int>& taps, const uint8_t* data, int len, uint8_t* out,
+                    TapState end) {
+    queue_scan(false, taps, data, len, out, end);
+}
+
+bool Jtag::flush() {
+    stats_.flushes++;
+    return adapter->flush();
+}
+
+uint32_t Jtag::set_clock(uint32_t khz) {
+    flush();
+    return adapter->set_clock(khz);
+}
+
+void Jtag::delay(unsigned us) {
+    adapter->delay(us);
+}
+
+void Jtag::shift_ir(const uint8_t* data, int len, TapState end) {
+    queue_ir(data, len, end);
+    flush();
+}
+
+void Jtag::shift_dr(const uint8_t* data, int len, uint8_t* out, TapState end) {
+    queue_dr(data, len, out, end);
+    flush();
 }
 
 uint32_t Jtag::idcode() {
-    // BYPASS instruction is all 1s
-    uint8_t bypass = 0xff;
-    shift_ir(&bypass, 8);
+    // Test-Logic-Reset loads IDCODE (or BYPASS) into every IR
+    reset_tap();
     
     // Shift out IDCODE
     uint32_t id = 0;
@@ -136,3 +275,115 @@ uint32_t Jtag::idcode() {
     
     return id;
 }
+
+static const int MAX_TAPS = 32;
+static const int MAX_IR_BITS = 512;
+
+static bool bit(const std::vector<uint8_t>& v, int i) {
+    return (v[i / 8] >> (i % 8)) & 1;
+}
+
+// Offset of the first 1 at or after from, -1 if none
+static int first_one(const std::vector<uint8_t>& v, int from, int bits) {
+    for (int i = from; i < bits; i++)
+        if (bit(v, i)) return i;
+    return -1;
+}
+
+// IR lengths for TAPs whose Capture-IR pattern can't be split on its own,
+// by JEP106 manufacturer
+static int ir_length_hint(uint32_t idcode) {
+    uint32_t mfr = (idcode >> 1) & 0x7ff;
+    if (mfr == 0x23b) return 4;   // ARM JTAG-DP
+    if (mfr == 0x020) return 5;   // ST boundary scan
+    return 0;
+}
+
+bool Jtag::scan_chain() {
+    chain.clear();
+    reset_tap();
+    
+    // Total IR length: the captured bits come out first, then the zeros
+    // shifted in behind them, then the ones. Updating with all ones puts
+    // every TAP in BYPASS.
+    std::vector<uint8_t> ir_in(2 * MAX_IR_BITS / 8, 0);
+    std::vector<uint8_t> ir_out(ir_in.size());
+    memset(ir_in.data() + MAX_IR_BITS / 8, 0xff, MAX_IR_BITS / 8);
+    queue_scan(true, ir_in.data(), 2 * MAX_IR_BITS, ir_out.data(), TapState::Idle);
+    if (!flush()) return false;
+    
+    int ir_total = first_one(ir_out, MAX_IR_BITS, 2 * MAX_IR_BITS) - MAX_IR_BITS;
+    if (ir_total <= 0) {
+        std::cerr << "JTAG: no scan chain (TDO stuck " << (ir_total ? "low" : "high") << ")\n";
+        return false;
+    }
+    
+    // One BYPASS bit per TAP, each capturing 0
+    std::vector<uint8_t> dr_in(2 * MAX_TAPS / 8, 0);
+    std::vector<uint8_t> dr_out(dr_in.size());
+    memset(dr_in.data() + MAX_TAPS / 8, 0xff, MAX_TAPS / 8);
+    queue_scan(false, dr_in.data(), 2 * MAX_TAPS, dr_out.data(), TapState::Idle);
+    if (!flush()) return false;
+    
+    int count = first_one(dr_out, MAX_TAPS, 2 * MAX_TAPS) - MAX_TAPS;
+    if (count <= 0 || 2 * count > ir_total) {
+        std::cerr << "JTAG: can't count TAPs (" << count << " for " << ir_total << " IR bits)\n";
+        return false;
+    }
+    
+    // Test-Logic-Reset selects IDCODE, or BYPASS where there is none. An
+    // IDCODE always starts with a 1, BYPASS captures a 0.
+    reset_tap();
+    int id_bits = 32 * count;
+    std::vector<uint8_t> id_in((id_bits + 7) / 8, 0xff);
+    std::vector<uint8_t> id_out(id_in.size());
+    queue_scan(false, id_in.data(), id_bits, id_out.data(), TapState::Idle);
+    if (!flush()) return false;
+    
+    std::vector<uint32_t> ids;
+    for (int pos = 0, t = 0; t < count; t++) {
+        if (!bit(id_out, pos)) {
+            ids.push_back(0);
+            pos++;
+            continue;
+        }
+        uint32_t id = 0;
+        for (int i = 0; i < 32; i++) id |= (uint32_t)bit(id_out, pos + i) << i;
+        ids.push_back(id);
+        pos += 32;
+    }
+    
+    // Every IR captures 1 then 0 from its LSB. Known parts take their
+    // length from the IDCODE; others run up to the next 1,0 that still
+    // leaves two bits for each TAP after them.
+    int pos = 0;
+    for (int t = 0; t < count; t++) {
+        if (pos + 2 > ir_total || !bit(ir_out, pos) || bit(ir_out, pos + 1)) {
+            std::cerr << "JTAG: bad IR capture at TAP " << t << "\n";
+            chain.clear();
+            return false;
+        }
+        
+        int left = count - t - 1;
+        int len = ir_length_hint(ids[t]);
+        if (!len && !left) len = ir_total - pos;
+        if (!len) {
+            len = 2;
+            while (pos + len + 2 * left < ir_total &&
+                   !(bit(ir_out, pos + len) && !bit(ir_out, pos + len + 1)))
+                len++;
+        }
+        
+        chain.push_back({ids[t], len});
+        pos += len;
+    }
+    
+    if (pos != ir_total) {
+        std::cerr << "JTAG: IR lengths add up to " << pos << ", chain has " << ir_total << "\n";
+        chain.clear();
+        return false;
+    }
+    
+    ones.assign(ir_total / 8 + 1, 0xff);
+    return true;
+}
@@ -14,6 +14,33 @@ struct JtagPin {
     };
 };
 
+// IEEE 1149.1 TAP controller states
+enum class TapState {
+    Reset,
+    Idle,
+    SelectDR,
+    CaptureDR,
+    ShiftDR,
+    Exit1DR,
+    PauseDR,
+    Exit2DR,
+    UpdateDR,
+    SelectIR,
+    CaptureIR,
+    ShiftIR,
+    Exit1IR,
+    PauseIR,
+    Exit2IR,
+    UpdateIR
+};
+
+// One TAP on the scan chain. Index 0 is the one nearest TDO, whose bits
+// come out first.
+struct JtagTap {
+    uint32_t idcode;   // 0 if the TAP came up in BYPASS
+    int ir_len;
+};
+
 class JtagAdapter {
 public:
     virtual ~JtagAdapter() = default;
@@ -22,6 +49,36 @@ public:
     virtual void set_pin(JtagPin::Type pin, bool value) = 0;
     virtual bool get_pin(JtagPin::Type pin) = 0;
     virtual void delay(unsigned us) = 0;
+    
+    // Microseconds on the adapter's clock, for timeouts and flash timing.
+    // Real adapters use the host clock; the simulator its own.
+    virtual uint64_t now_us() const;
+    
+    // TCK as near khz as the adapter can get without going over; returns
+    // the frequency it now runs at, 0 when the adapter has no TCK setting
+    virtual uint32_t set_clock(uint32_t khz) { (void)khz; return 0; }
+    
+    // Scan queue. Bit vectors are LSB first. queue_tms clocks len bits of
+    // TMS with TDI held; queue_shift clocks len bits of TDI with TMS low,
+    // raising TMS on the last bit if exit is set. Captured TDO bits are only
+    // valid in tdo once flush() has returned. The defaults bit-bang through
+    // set_pin/get_pin immediately.
+    virtual void queue_tms(uint32_t tms, int len);
+    virtual void queue_shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit);
+    virtual bool flush();
+    
+    // USB traffic, kept by the adapters that have a bus. Every write or
+    // read is one transfer; usb_us only counts with perf_timing on.
+    struct Stats {
+        uint64_t transfers = 0;
+        uint64_t bytes_out = 0;
+        uint64_t bytes_in = 0;
+        uint64_t usb_us = 0;
+    };
+    const Stats& stats() const { return stats_; }
+    
+protected:
+    Stats stats_;
 };
 
 class Jtag {
@@ -31,14 +88,79 @@ public:
     
     bool init();
     void reset();
-    void shift_ir(const uint8_t* data, int len);
-    void shift_dr(const uint8_t* data, int len, uint8_t* out = nullptr);
+    void shift_ir(const uint8_t* data, int len, TapState end = TapState::Idle);
+    void shift_dr(const uint8_t* data, int len, uint8_t* out = nullptr,
+                  TapState end = TapState::Idle);
     uint32_t idcode();
     
+    // Chain discovery: the TAP count through BYPASS, IR lengths from the
+    // Capture-IR pattern and every IDCODE. Ends with the TAPs reset.
+    bool scan_chain();
+    const std::vector<JtagTap>& taps() const { return chain; }
+    
+    // Batched scans: out is filled in by the next flush(). A scan ending in
+    // Pause-IR/DR skips Update, so the next scan to the same register
+    // continues shifting where this one stopped.
+    void queue_ir(const uint8_t* data, int len, TapState end = TapState::Idle);
+    void queue_dr(const uint8_t* data, int len, uint8_t* out = nullptr,
+                  TapState end = TapState::Idle);
+    
+    // The same to some TAPs of a scanned chain, the rest held in BYPASS
+    // (all-ones IR, one DR bit each). Every TAP listed gets the same bits,
+    // and out receives each one's captured bits in chain order,
+    // (len + 7) / 8 bytes apart. With no chain scanned the list is ignored.
+    void queue_ir(const std::vector<int>& taps, const uint8_t* data, int len,
+                  TapState end = TapState::Idle);
+    void queue_dr(const std::vector<int>& taps, const uint8_t* data, int len,
+                  uint8_t* out = nullptr, TapState end = TapState::Idle);
+    bool flush();
+    void delay(unsigned us);
+    uint64_t now_us() const { return adapter->now_us(); }
+    
+    // Flushes first, so queued scans go out at the old speed
+    uint32_t set_clock(uint32_t khz);
+    
+    // Shortest TMS walk to a state, and extra TCKs spent in Run-Test/Idle
+    void goto_state(TapState to);
+    void idle(int cycles);
+    void set_idle_cycles(int cycles) { idle_cycles = cycles; }
+    TapState tap_state() const { return state; }
+    
+    // Bumped on every TAP reset so cached TAP/DP state can be dropped
+    uint32_t reset_count() const { return resets; }
+    
+    // Bumped on every IR scan, which may have moved other TAPs to BYPASS
+    uint32_t ir_count() const { return ir_scans; }
+    
+    struct Stats {
+        uint64_t tck = 0;          // every clock queued
+        uint64_t tms_clocks = 0;   // those walking the TAP between states
+        uint64_t ir_scans = 0;
+        uint64_t dr_scans = 0;
+        uint64_t flushes = 0;
+    };
+    const Stats& stats() const { return stats_; }
+    const JtagAdapter* link() const { return adapter; }
+    
+    static TapState next_state(TapState from, bool tms);
+    static int tms_path(TapState from, TapState to, uint32_t* tms);
+    
 private:
-    void pulse_clock(int n = 1);
     void reset_tap();
+    void clock_tms(uint32_t tms, int len);
+    void queue_scan(bool ir, const uint8_t* data, int len, uint8_t* out, TapState end);
+    void queue_scan(bool ir, const std::vector<int>& taps, const uint8_t* data, int len,
+                    uint8_t* out, TapState end);
+    void finish_scan(bool ir, TapState end);
+    void shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit);
     
     JtagAdapter* adapter;
-    int state;
+    TapState state;
+    int idle_cycles;
+    uint32_t resets;
+    uint32_t ir_scans;
+    
+    std::vector<JtagTap> chain;
+    std::vector<uint8_t> ones;   // TDI for bypassed TAPs
+    Stats stats_;
 };
@@ -1,19 +1,72 @@
 #include <iostream>
+#include <iomanip>
 #include <string>
-#include <fstream>
+#include <memory>
+#include <vector>
 #include "jtag.h"
 #include "device.h"
 #include "flash.h"
+#include "image.h"
 #include "config.h"
+#include "sim.h"
+#include "gang.h"
+#include "daemon.h"
+#include "gdb.h"
+#include "perf.h"
+#include "dump.h"
+#include "profile.h"
+#include "autotune.h"
+#include <fstream>
+#include <chrono>
 
 #ifdef _WIN32
 #include "winftdi.cpp"
-using JtagAdapterType = WinFtdiAdapter;
+
+static JtagAdapter* make_adapter(const Config& cfg, const UsbMatch& usb) {
+    if (cfg.adapter_type == "ftdi") return new WinFtdiAdapter(usb);
+    if (cfg.adapter_type == "syncbb") return new WinSyncBitbangAdapter(usb, cfg.clock_speed);
+    if (cfg.adapter_type == "mpsse") return new WinMpsseAdapter(usb, cfg.clock_speed);
+    if (cfg.adapter_type == "sim") return new SimAdapter();
+    if (cfg.adapter_type.rfind("sim:", 0) == 0) return new SimChain(atoi(cfg.adapter_type.c_str() + 4));
+    return nullptr;
+}
 #else
 #include "ftdi.cpp"
-using JtagAdapterType = FtdiAdapter;
+
+static JtagAdapter* make_adapter(const Config& cfg, const UsbMatch& usb) {
+    if (cfg.adapter_type == "ftdi") return new FtdiAdapter(usb);
+    if (cfg.adapter_type == "syncbb") return new SyncBitbangAdapter(usb, cfg.clock_speed);
+    if (cfg.adapter_type == "mpsse") return new MpsseAdapter(usb, cfg.clock_speed);
+    if (cfg.adapter_type == "sim") return new SimAdapter();
+    if (cfg.adapter_type.rfind("sim:", 0) == 0) return new SimChain(atoi(cfg.adapter_type.c_str() + 4));
+    return nullptr;
+}
 #endif
 
+static UsbMatch usb_match(const Config& cfg) {
+    UsbMatch m;
+    m.vid = cfg.vid;
+    m.pid = cfg.pid;
+    m.serial = cfg.serial;
+    m.path = cfg.usb_path;
+    return m;
+}
+
+// Where raw binaries go: the start of the part's first flash region
+static uint32_t flash_base(const Device& dev) {
+    const DeviceInfo* info = dev.info();
+    if (info && !info->flash_regions.empty()) return info->flash_regions[0].addr;
+    return 0x08000000;
+}
+
+// Options whose next argument is a value, not the command
+static bool takes_value(const std::string& arg) {
+    return arg == "--vid" || arg == "--pid" || arg == "--config" ||
+           arg == "--adapter" || arg == "--clock" || arg == "--serial" ||
+           arg == "--usb-path" || arg == "--tap" || arg == "--socket" ||
+           arg == "--stats-json" || arg == "--devdb" || arg == "--format";
+}
+
 void usage(const char* name, const Config& cfg) {
     std::cout << "JTAG-IIE v0.1 - Open source JTAG debugger\n\n";
     std::cout << "Usage: " << name << " [options] <command> [args...]\n\n";
@@ -23,72 +76,153 @@ void usage(const char* name, const Config& cfg) {
     std::cout << "  reset                - Reset device\n";
     std::cout << "  halt                 - Halt device\n";
     std::cout << "  resume               - Resume device\n";
-    std::cout << "  flash <file.bin>     - Program binary file\n";
-    std::cout << "  erase                - Erase entire flash\n";
-    std::cout << "  dump <addr> <len>    - Dump memory to stdout\n\n";
+    std::cout << "  flash <file>         - Program a .bin, .elf, .hex or .srec file\n";
+    std::cout << "  verify <file>        - Compare flash with a file\n";
+    std::cout << "  erase [addr len]     - Erase entire flash, or just a range\n";
+    std::cout << "  dump <addr> <len> [file] - Dump memory to a file or stdout\n";
+    std::cout << "  profile [secs] [elf] - Sample the PC while the core runs (default 5 s)\n";
+    std::cout << "  autotune [max_khz]   - Find the fastest reliable TCK and save it to jtag.cfg\n";
+    std::cout << "  gdbserver [port]     - Serve one GDB session on localhost (default 3333)\n";
+    std::cout << "  adapters             - List attached adapters\n";
+    std::cout << "  gang <file>          - Program every attached adapter's board at once\n";
+    std::cout << "  daemon [stop]        - Keep the target attached and serve commands, or stop\n";
+    std::cout << "  devdb <src> <out>    - Compile a device database source file\n\n";
     std::cout << "Options:\n";
     std::cout << "  -v, --verbose        - Verbose output\n";
     std::cout << "  -f, --force          - Force operations\n";
     std::cout << "  --vid VID            - USB vendor ID (default 0x" << std::hex << cfg.vid << ")\n";
     std::cout << "  --pid PID            - USB product ID (default 0x" << cfg.pid << ")\n";
+    std::cout << "  --adapter TYPE       - ftdi, syncbb, mpsse, sim or sim:N for N chained (default " << cfg.adapter_type << ")\n";
+    std::cout << "  --serial SN          - Use the adapter with this USB serial number\n";
+    std::cout << "  --usb-path PATH      - Use the adapter at this USB path (see adapters)\n";
+    std::cout << "  --tap N              - Debug the Nth TAP on the chain (0 is nearest TDO)\n";
+    std::cout << "  --broadcast          - Drive every TAP with the same IDCODE at once\n";
+    std::cout << "  --clock KHZ          - TCK frequency for syncbb/mpsse (default " << std::dec << cfg.clock_speed << ")\n";
+    std::cout << "  --no-loader          - Program flash over the debug port only\n";
+    std::cout << "  --full               - Erase and program every sector, changed or not\n";
+    std::cout << "  --readback           - Verify by reading flash back instead of CRC\n";
+    std::cout << "  --socket PATH        - Daemon socket (default " << daemon_socket_path() << ")\n";
+    std::cout << "  --no-daemon          - Open the adapter even if a daemon is running\n";
+    std::cout << "  --devdb FILE         - Use a compiled device database (see devdb)\n";
+    std::cout << "  --format FMT         - dump as bin, ihex or hex (default by file name, hex on stdout)\n";
+    std::cout << "  --rediscover         - Walk the ROM tables even if the topology is cached\n";
+    std::cout << "  --stats              - Print per-layer counters and throughput afterwards\n";
+    std::cout << "  --stats-json FILE    - Write them to FILE as JSON (- for stdout)\n";
     std::cout << "  --config file.cfg    - Load config file\n";
     std::cout << "\nExample:\n";
     std::cout << "  " << name << " --vid 0x1234 flash firmware.bin\n";
 }
 
-int main(int argc, char* argv[])
-{
-    Config cfg = Config::from_args(argc, argv);
-    
-    if (argc < 2) {
-        usage(argv[0], cfg);
-        return 1;
-    }
+// Everything attached to one target. The daemon keeps it open between
+// commands.
+struct Target {
+    std::unique_ptr<JtagAdapter> adapter;
+    std::unique_ptr<Jtag> jtag;
+    std::unique_ptr<Device> dev;
+    std::unique_ptr<Flash> flash;
+    std::vector<int> group;
+};
 
-    // Find command position
-    int cmd_pos = 1;
-    for (int i = 1; i < argc; i++) {
-        std::string arg = argv[i];
-        if (!arg.empty() && arg[0] != '-') {
-            cmd_pos = i;
-            break;
-        }
-    }
-    
-    if (cmd_pos >= argc) {
-        usage(argv[0], cfg);
-        return 1;
-    }
+// Innermost first, since each layer talks through the one below
+static void close_target(Target& t) {
+    t.flash.reset();
+    t.dev.reset();
+    t.jtag.reset();
+    t.adapter.reset();
+    t.group.clear();
+}
 
-    std::string cmd = argv[cmd_pos];
-    
-    if (cfg.verbose) {
-        std::cout << "JTAG-IIE - verbose mode\n";
-        std::cout << "VID: 0x" << std::hex << cfg.vid << " PID: 0x" << cfg.pid << "\n";
+// Open the adapter and walk the scan chain
+static bool open_chain(Target& t, const Config& cfg) {
+    t.adapter.reset(make_adapter(cfg, usb_match(cfg)));
+    if (!t.adapter) {
+        std::cerr << "Unknown adapter type: " << cfg.adapter_type << "\n";
+        return false;
     }
     
-    JtagAdapterType adapter(cfg.vid, cfg.pid);
-    Jtag jtag(&adapter);
+    t.jtag.reset(new Jtag(t.adapter.get()));
     
-    if (!jtag.init()) {
+    if (!t.jtag->init()) {
         std::cerr << "Failed to initialize JTAG adapter\n";
-        return 1;
+        return false;
     }
     
-    uint32_t id = jtag.idcode();
-    if (id == 0 || id == 0xffffffff) {
+    // The USB adapters are built with it; this reaches the others
+    t.jtag->set_clock(cfg.clock_speed);
+    
+    if (!t.jtag->scan_chain()) {
         std::cerr << "No device found\n";
-        return 1;
+        return false;
     }
     
-    Device dev(id, &jtag);
-    if (!dev.init()) {
-        return 1;
+    return true;
+}
+
+// Pick the TAP (and its identical twins when broadcasting) and attach
+static bool open_device(Target& t, const Config& cfg) {
+    const std::vector<JtagTap>& taps = t.jtag->taps();
+    int tap = cfg.tap < 0 ? Device::default_tap(*t.jtag) : cfg.tap;
+    if (tap >= (int)taps.size()) {
+        std::cerr << "No TAP " << tap << ", the chain has " << taps.size() << "\n";
+        return false;
+    }
+    uint32_t id = taps[tap].idcode;
+    
+    // Identical parts further along the chain follow the chosen one
+    t.group = {tap};
+    if (cfg.broadcast) {
+        t.group.clear();
+        for (size_t i = 0; i < taps.size(); i++) {
+            if (taps[i].idcode == id) t.group.push_back(i);
+        }
+        std::cout << "Broadcasting to " << t.group.size() << " TAPs\n";
     }
     
-    Flash flash(&dev, &jtag);
+    t.dev.reset(new Device(id, t.jtag.get(), t.group));
+    t.dev->set_rediscover(cfg.rediscover);
+    if (!t.dev->init()) return false;
+    
+    t.flash.reset(new Flash(t.dev.get(), t.jtag.get()));
+    return true;
+}
+
+static void print_chain(const Jtag& jtag) {
+    const std::vector<JtagTap>& taps = jtag.taps();
+    for (size_t i = 0; i < taps.size(); i++) {
+        const DeviceInfo* info = DeviceDB::instance().find(taps[i].idcode);
+        std::cout << "TAP " << i << ": IDCODE 0x" << std::hex << std::setw(8) << std::setfill('0')
+                  << taps[i].idcode << std::dec << std::setfill(' ') << ", IR " << taps[i].ir_len
+                  << " bits  " << (taps[i].idcode ? (info ? info->name : "unknown") : "(BYPASS only)")
+                  << "\n";
+    }
+}
+
+// Find the command: the first argument that isn't an option or its value
+static int find_command(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (takes_value(arg)) {
+            i++;
+            continue;
+        }
+        if (!arg.empty() && arg[0] != '-') return i;
+    }
+    return argc;
+}
+
+// One command against an attached target, from the command line or a
+// daemon client
+static int run_command(Target& t, const Config& cfg, int argc, char* argv[], int cmd_pos) {
+    std::string cmd = argv[cmd_pos];
+    Device& dev = *t.dev;
+    Flash& flash = *t.flash;
+    
+    flash.set_loader(cfg.use_loader);
+    flash.set_checksum(cfg.verify_crc);
     
     if (cmd == "scan" || cmd == "info") {
+        if (cmd == "scan") print_chain(*t.jtag);
+        
         const DeviceInfo* info = dev.info();
         if (info) {
             std::cout << "Device: " << info->vendor << " " << info->name << "\n";
@@ -96,6 +230,13 @@ int main(int argc, char* argv[])
             std::cout << "RAM: " << info->ram_size/1024 << "KB\n";
             std::cout << "FPU: " << (info->has_fpu ? "Yes" : "No") << "\n";
         }
+        
+        const CsTopology& topo = dev.topology();
+        std::cout << "APs: " << topo.aps.size() << ", cores: " << topo.cores() << "\n";
+        for (const auto& c : topo.components) {
+            std::cout << "  AP " << (int)c.ap << " 0x" << std::hex << std::setw(8) << std::setfill('0')
+                      << c.base << std::dec << std::setfill(' ') << "  " << cs_kind_name(c.kind) << "\n";
+        }
     } else if (cmd == "reset") {
         if (dev.reset()) {
             std::cout << "Device reset\n";
@@ -120,16 +261,6 @@ int main(int argc, char* argv[])
             return 1;
         }
         
-        std::string filename = argv[cmd_pos + 1];
-        std::ifstream file(filename, std::ios::binary);
-        if (!file) {
-            std::cerr << "Can't open " << filename << "\n";
-            return 1;
-        }
-        
-        std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
-                                  std::istreambuf_iterator<char>());
-        
         if (!flash.detect()) {
             std::cerr << "Flash not supported\n";
             return 1;
@@ -140,12 +271,21 @@ int main(int argc, char* argv[])
             return 1;
         }
         
+        std::string filename = argv[cmd_pos + 1];
+        Image img;
+        if (!img.load(filename, flash_base(dev))) return 1;
+        
         if (cfg.verbose) {
-            std::cout << "File size: " << data.size() << " bytes\n";
+            std::cout << "Image: " << img.format() << ", " << img.size() << " bytes\n";
+            for (const auto& s : img.segments()) {
+                std::cout << "  0x" << std::hex << s.addr << "-0x" << s.addr + s.len
+                          << std::dec << " (" << s.len << " bytes)\n";
+            }
         }
         
         if (!cfg.force) {
-            std::cout << "About to erase and program " << data.size() << " bytes. Continue? [y/N] ";
+            std::cout << "About to erase and program " << img.size() << " bytes in "
+                      << img.segments().size() << " segments. Continue? [y/N] ";
             std::string response;
             std::getline(std::cin, response);
             if (response != "y" && response != "Y") {
@@ -154,19 +294,52 @@ int main(int argc, char* argv[])
             }
         }
         
-        std::cout << "Erasing flash...\n";
-        if (!flash.erase(0x08000000, data.size())) {
-            std::cerr << "Erase failed\n";
+        FlashUpdateStats st;
+        if (t.group.size() > 1) {
+            // Parts may differ before the erase, and reads must agree
+            std::cout << "Erasing and programming " << t.group.size() << " parts...\n";
+            if (!flash.erase_chip()) {
+                std::cerr << "Erase failed\n";
+                return 1;
+            }
+            if (!flash.write_image(img, false, &st, true)) return 1;
+        } else if (cfg.diff) {
+            std::cout << "Programming changed sectors...\n";
+            if (!flash.write_image(img, true, &st)) {
+                std::cerr << "Program failed\n";
+                return 1;
+            }
+            
+            std::cout << "Wrote " << st.bytes_written << " bytes in " << st.sectors_written
+                      << " sectors (" << st.sectors_erased << " erased), skipped "
+                      << st.bytes_skipped << " bytes in " << st.sectors_skipped << " unchanged sectors\n";
+        } else {
+            std::cout << "Erasing and programming...\n";
+            if (!flash.write_image(img, false, &st)) return 1;   // reported by write_image
+        }
+        
+        std::cout << "Programming complete\n";
+    } else if (cmd == "verify") {
+        if (cmd_pos + 1 >= argc) {
+            std::cerr << "Need filename\n";
             return 1;
         }
         
-        std::cout << "Programming...\n";
-        if (!flash.program(0x08000000, data.data(), data.size())) {
-            std::cerr << "Program failed\n";
+        if (!flash.detect()) {
+            std::cerr << "Flash not supported\n";
             return 1;
         }
         
-        std::cout << "Programming complete\n";
+        std::string filename = argv[cmd_pos + 1];
+        Image img;
+        if (!img.load(filename, flash_base(dev))) return 1;
+        
+        if (flash.verify_image(img)) {
+            std::cout << "Verify OK (" << img.size() << " bytes)\n";
+        } else {
+            std::cerr << "Verify failed\n";
+            return 1;
+        }
     } else if (cmd == "erase") {
         if (!flash.detect()) {
             std::cerr << "Flash not supported\n";
@@ -178,11 +351,25 @@ int main(int argc, char* argv[])
             return 1;
         }
         
-        std::cout << "Erasing flash...\n";
-        if (flash.erase(0x08000000, 64*1024)) {
-            std::cout << "Erase complete\n";
+        if (cmd_pos + 2 < argc) {
+            // Partial range: sector by sector, skipping blank ones
+            uint32_t addr = strtoul(argv[cmd_pos + 1], nullptr, 0);
+            uint32_t len = strtoul(argv[cmd_pos + 2], nullptr, 0);
+            uint32_t skipped = 0;
+            
+            std::cout << "Erasing 0x" << std::hex << addr << "+0x" << len << std::dec << "...\n";
+            if (flash.erase(addr, len, &skipped)) {
+                std::cout << "Erase complete (" << skipped << " blank sectors skipped)\n";
+            } else {
+                std::cerr << "Erase failed\n";
+            }
         } else {
-            std::cerr << "Erase failed\n";
+            std::cout << "Erasing " << dev.info()->flash_size / 1024 << "KB flash...\n";
+            if (flash.erase_chip()) {
+                std::cout << "Erase complete\n";
+            } else {
+                std::cerr << "Erase failed\n";
+            }
         }
     } else if (cmd == "dump") {
         if (cmd_pos + 2 >= argc) {
@@ -192,19 +379,201 @@ int main(int argc, char* argv[])
         
         uint32_t addr = strtoul(argv[cmd_pos + 1], nullptr, 0);
         uint32_t len = strtoul(argv[cmd_pos + 2], nullptr, 0);
+        std::string path = cmd_pos + 3 < argc ? argv[cmd_pos + 3] : "";
         
-        std::vector<uint8_t> buf(len);
-        if (flash.read(addr, buf.data(), len)) {
-            for (uint32_t i = 0; i < len; i++) {
-                if (i % 16 == 0) printf("%08x: ", addr + i);
-                printf("%02x ", buf[i]);
-                if (i % 16 == 15) printf("\n");
-            }
-            if (len % 16) printf("\n");
+        DumpFormat fmt = path.empty() ? DumpFormat::Hexdump : dump_format_for(path);
+        if (!cfg.format.empty() && !dump_format(cfg.format, &fmt)) {
+            std::cerr << "Unknown dump format: " << cfg.format << "\n";
+            return 1;
+        }
+        
+        if (path.empty()) {
+            if (!dump_memory(flash, addr, len, fmt, std::cout)) return 1;
         } else {
-            std::cerr << "Read failed\n";
+            std::ofstream f(path, std::ios::binary);
+            if (!f) {
+                std::cerr << "Can't write " << path << "\n";
+                return 1;
+            }
+            
+            // Progress on stderr, redrawn at most every 100 ms
+            auto start = std::chrono::steady_clock::now();
+            auto last = start - std::chrono::seconds(1);
+            auto progress = [&](uint32_t done, uint32_t total) {
+                auto now = std::chrono::steady_clock::now();
+                if (done < total && now - last < std::chrono::milliseconds(100)) return;
+                last = now;
+                double s = std::chrono::duration<double>(now - start).count();
+                char line[64];
+                snprintf(line, sizeof(line), "\rDumping: %u/%u KB, %.1f KB/s ", done / 1024,
+                         total / 1024, s > 0 ? done / 1024.0 / s : 0.0);
+                std::cerr << line << std::flush;
+            };
+            bool ok = dump_memory(flash, addr, len, fmt, f, progress);
+            std::cerr << "\n";
+            if (!ok) return 1;
+            std::cout << "Wrote " << len << " bytes to " << path << "\n";
         }
-    } else if (cmd == "config") {
+    } else if (cmd == "profile") {
+        // profile [seconds] [file.elf], either one optional
+        double seconds = 5;
+        std::string elf;
+        for (int i = cmd_pos + 1; i < argc && i <= cmd_pos + 2; i++) {
+            char* end;
+            double v = strtod(argv[i], &end);
+            if (*argv[i] && !*end) seconds = v;
+            else elf = argv[i];
+        }
+        
+        ElfSymbols syms;
+        if (!elf.empty() && !syms.load(elf)) return 1;
+        if (!elf.empty() && !syms.size()) std::cerr << elf << " has no function symbols\n";
+        
+        Profile prof;
+        if (!profile_sample(dev, *t.jtag, seconds, &prof)) return 1;
+        profile_report(prof, &syms, cfg.verbose ? 1000 : 20, std::cout);
+    } else if (cmd == "autotune") {
+        uint32_t max_khz = cmd_pos + 1 < argc ? strtoul(argv[cmd_pos + 1], nullptr, 0) : 30000;
+        int ap = dev.topology().mem_ap;
+        uint32_t khz = autotune(*t.jtag, &dev.debug_port(), ap < 0 ? 0 : ap, 100, max_khz, 20);
+        if (!khz) return 1;
+        
+        // Only the clock changes in an existing file; a new one gets just
+        // the clock and the adapter it was measured on, not one-off flags
+        std::string file = cfg.config_file.empty() ? "jtag.cfg" : cfg.config_file;
+        std::ifstream exists(file);
+        Config saved = exists ? Config::load(file) : Config();
+        if (!exists) {
+            saved.adapter_type = cfg.adapter_type;
+            saved.vid = cfg.vid;
+            saved.pid = cfg.pid;
+            saved.serial = cfg.serial;
+            saved.usb_path = cfg.usb_path;
+        }
+        saved.clock_speed = khz;
+        saved.save(file);
+        std::cout << "Saved clock=" << khz << " to " << file << "\n";
+    } else if (cmd == "gdbserver") {
+        uint16_t port = cmd_pos + 1 < argc ? strtoul(argv[cmd_pos + 1], nullptr, 0) : 3333;
+        if (!gdb_serve(dev, flash, port, cfg.verbose)) return 1;
+    } else {
+        std::cout << "Unknown command: " << cmd << "\n";
+        usage(argv[0], cfg);
+    }
+    
+    if (cfg.verbose) {
+        const Dap::Stats& st = dev.debug_port().stats();
+        std::cout << "DAP: " << st.dr_scans << " DR scans (" << st.dr_elided << " elided), "
+                  << st.ir_scans << " IR scans (" << st.ir_elided << " elided), "
+                  << st.waits << " WAITs";
+        if (t.group.size() > 1) std::cout << ", " << st.disagree << " reads retried for agreement";
+        std::cout << "\n";
+        flash.print_stats(std::cout);
+    }
+
+    return 0;
+}
+
+static PerfSnapshot snapshot(const Target& t) {
+    return PerfSnapshot::take(t.adapter.get(), t.jtag.get(), t.dev.get(), t.flash.get());
+}
+
+// What a command cost, per --stats and --stats-json
+static void report_stats(const Config& cfg, const std::string& command, const PerfSnapshot& before,
+                         const PerfSnapshot& after) {
+    if (cfg.stats) perf_report(std::cout, command, before, after, false);
+    if (cfg.stats_json.empty()) return;
+    
+    if (cfg.stats_json == "-") {
+        perf_report(std::cout, command, before, after, true);
+        return;
+    }
+    std::ofstream f(cfg.stats_json);
+    if (!f) {
+        std::cerr << "Can't write " << cfg.stats_json << "\n";
+        return;
+    }
+    perf_report(f, command, before, after, true);
+}
+
+// Serve commands from clients until "daemon stop". The target is attached
+// with the daemon's own adapter and chain options; a client's options only
+// change how its command runs.
+static int run_daemon(Target& t, const Config& cfg, const std::string& path) {
+    if (!open_chain(t, cfg) || !open_device(t, cfg)) return 1;
+    std::cout << "Attached to " << t.dev->info()->name << "\n";
+    
+    auto handler = [&](const std::vector<std::string>& args, bool* stop) {
+        std::vector<std::string> words{"jtag"};
+        words.insert(words.end(), args.begin(), args.end());
+        std::vector<char*> av;
+        for (auto& w : words) av.push_back(w.data());
+        av.push_back(nullptr);
+        int ac = words.size();
+        
+        Config req = Config::from_args(ac, av.data());
+        int pos = find_command(ac, av.data());
+        if (pos >= ac) {
+            usage(av[0], req);
+            return 1;
+        }
+        
+        std::string cmd = av[pos];
+        if (cmd == "daemon") {
+            if (pos + 1 < ac && words[pos + 1] == "stop") {
+                *stop = true;
+                std::cout << "Daemon stopped\n";
+            } else {
+                std::cout << "Daemon already running on " << path << "\n";
+            }
+            return 0;
+        }
+        if (cmd == "adapters" || cmd == "gang" || cmd == "config") {
+            std::cerr << cmd << " isn't run by the daemon\n";
+            return 1;
+        }
+        
+        // Re-attach after a failure or a target that went away
+        if (!t.dev && !(open_chain(t, cfg) && open_device(t, cfg))) {
+            close_target(t);
+            return 1;
+        }
+        
+        perf_timing = req.stats || !req.stats_json.empty();
+        PerfSnapshot before = snapshot(t);
+        int rc = run_command(t, req, ac, av.data(), pos);
+        if (perf_timing) report_stats(req, cmd, before, snapshot(t));
+        if (rc != 0) close_target(t);
+        return rc;
+    };
+    
+    return daemon_serve(path, handler) ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    Config cfg = Config::from_args(argc, argv);
+    
+    if (argc < 2) {
+        usage(argv[0], cfg);
+        return 1;
+    }
+
+    int cmd_pos = find_command(argc, argv);
+    if (cmd_pos >= argc) {
+        usage(argv[0], cfg);
+        return 1;
+    }
+
+    std::string cmd = argv[cmd_pos];
+    
+    if (cfg.verbose) {
+        std::cout << "JTAG-IIE - verbose mode\n";
+        std::cout << "VID: 0x" << std::hex << cfg.vid << " PID: 0x" << cfg.pid << std::dec << "\n";
+        std::cout << "Adapter: " << cfg.adapter_type << " @ " << cfg.clock_speed << " kHz\n";
+    }
+    
+    if (cmd == "config") {
         if (cmd_pos + 1 >= argc) {
             cfg.save("jtag.cfg");
             std::cout << "Saved default config to jtag.cfg\n";
@@ -213,10 +582,117 @@ int main(int argc, char* argv[])
             cfg.save(filename);
             std::cout << "Saved config to " << filename << "\n";
         }
-    } else {
-        std::cout << "Unknown command: " << cmd << "\n";
-        usage(argv[0], cfg);
+        return 0;
     }
-
-    return 0;
+    
+    if (cmd == "devdb") {
+        if (cmd_pos + 2 >= argc) {
+            std::cerr << "Need a source file and an output file\n";
+            return 1;
+        }
+        uint32_t parts = 0;
+        if (!DeviceDB::compile(argv[cmd_pos + 1], argv[cmd_pos + 2], &parts)) return 1;
+        std::cout << "Compiled " << parts << " parts into " << argv[cmd_pos + 2] << "\n";
+        return 0;
+    }
+    
+    // A running daemon owns the adapter, so target commands go through it
+    std::string path = cfg.socket.empty() ? daemon_socket_path() : cfg.socket;
+    bool local = cmd == "adapters" || cmd == "gang" || (cfg.no_daemon && cmd != "daemon");
+    if (!local && !path.empty()) {
+        int status;
+        if (daemon_call(path, std::vector<std::string>(argv + 1, argv + argc), &status)) return status;
+    }
+    
+    // A daemon loads it once for every client
+    if (!cfg.devdb.empty() && !DeviceDB::instance().load(cfg.devdb)) return 1;
+    
+    // These work on every matching adapter rather than one
+    if ((cmd == "adapters" || cmd == "gang") && cfg.adapter_type.rfind("sim", 0) == 0) {
+        std::cerr << cmd << " needs USB adapters\n";
+        return 1;
+    }
+    
+    if (cmd == "adapters") {
+        std::vector<UsbDevice> devs;
+        if (!usb_list(usb_match(cfg), devs)) {
+            std::cerr << "USB enumeration failed\n";
+            return 1;
+        }
+        for (const auto& d : devs) {
+            std::cout << d.path << "  " << (d.serial.empty() ? "-" : d.serial)
+                      << "  " << d.description << "\n";
+        }
+        std::cout << devs.size() << " adapter(s)\n";
+        return 0;
+    }
+    
+    if (cmd == "gang") {
+        if (cmd_pos + 1 >= argc) {
+            std::cerr << "Need filename\n";
+            return 1;
+        }
+        
+        std::vector<UsbDevice> devs;
+        if (!usb_list(usb_match(cfg), devs) || devs.empty()) {
+            std::cerr << "No adapters found\n";
+            return 1;
+        }
+        
+        // Nothing is detected yet, so raw binaries go at the STM32 flash base
+        Image img;
+        if (!img.load(argv[cmd_pos + 1], 0x08000000)) return 1;
+        
+        // Opened by path, which stays unique even for blank serials
+        std::vector<GangBoard> boards;
+        for (const auto& d : devs) {
+            UsbMatch m = usb_match(cfg);
+            m.path = d.path;
+            boards.push_back({d.serial.empty() ? d.path : d.serial,
+                              std::unique_ptr<JtagAdapter>(make_adapter(cfg, m))});
+            if (!boards.back().adapter) {
+                std::cerr << "Unknown adapter type: " << cfg.adapter_type << "\n";
+                return 1;
+            }
+        }
+        
+        if (!cfg.force) {
+            std::cout << "About to program " << img.size() << " bytes on " << boards.size()
+                      << " boards. Continue? [y/N] ";
+            std::string response;
+            std::getline(std::cin, response);
+            if (response != "y" && response != "Y") {
+                std::cout << "Aborted\n";
+                return 0;
+            }
+        }
+        
+        return gang_flash(boards, img, cfg) ? 0 : 1;
+    }
+    
+    Target t;
+    
+    // Counted from before the adapter opens, so attach time is included
+    perf_timing = cfg.stats || !cfg.stats_json.empty();
+    PerfSnapshot before = snapshot(t);
+    
+    if (cmd == "daemon") {
+        if (cmd_pos + 1 < argc && std::string(argv[cmd_pos + 1]) == "stop") {
+            std::cerr << "No daemon running\n";
+            return 1;
+        }
+        return run_daemon(t, cfg, path);
+    }
+    
+    if (!open_chain(t, cfg)) return 1;
+    
+    if (!open_device(t, cfg)) {
+        // The chain is still worth showing when no part is known
+        if (cmd == "scan") print_chain(*t.jtag);
+        return 1;
+    }
+    
+    int rc = run_command(t, cfg, argc, argv, cmd_pos);
+    if (perf_timing) report_stats(cfg, cmd, before, snapshot(t));
+    return rc;
 }
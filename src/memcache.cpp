@@ -0,0 +1,116 @@
+#include "memcache.h"
+#include "device.h"
+#include <cstring>
+#include <vector>
+
+// Longest run of missing lines fetched in one read
+static const uint32_t MAX_RUN = 4096 / MemCache::LINE;
+
+MemCache::MemCache(Device* d) : dev(d) {}
+
+bool MemCache::in_flash(uint32_t line) const {
+    const DeviceInfo* info = dev->info();
+    if (!info) return false;
+    for (const auto& r : info->flash_regions) {
+        if (line >= r.addr && line + LINE <= r.addr + r.size) return true;
+    }
+    return false;
+}
+
+// SRAM starts at the Cortex-M SRAM region base on every part in the database
+bool MemCache::cacheable(uint32_t line) const {
+    const DeviceInfo* info = dev->info();
+    if (!info) return false;
+    if (line >= 0x20000000 && line + LINE <= 0x20000000 + info->ram_size) return true;
+    return in_flash(line);
+}
+
+bool MemCache::fetch(uint32_t line, uint32_t count) {
+    std::vector<uint8_t> buf(count * LINE);
+    if (!dev->read_mem(line, buf.data(), buf.size())) return false;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(lines[line + i * LINE].data, &buf[i * LINE], LINE);
+    }
+    stats_.misses += count;
+    stats_.fetches++;
+    return true;
+}
+
+// Cached lines are copied out; each run of missing ones costs one target
+// read, so overlapping reads around a stack frame become one fetch
+bool MemCache::read(uint32_t addr, uint8_t* buf, uint32_t len) {
+    uint64_t end = (uint64_t)addr + len;
+    uint64_t a = addr;
+    
+    while (a < end) {
+        uint32_t line = a & ~(uint64_t)(LINE - 1);
+        
+        if (!cacheable(line)) {
+            uint64_t stop = (uint64_t)line + LINE;
+            while (stop < end && !cacheable(stop)) stop += LINE;
+            if (stop > end) stop = end;
+            
+            if (!dev->read_mem(a, buf + (a - addr), stop - a)) return false;
+            stats_.uncached++;
+            a = stop;
+            continue;
+        }
+        
+        auto it = lines.find(line);
+        if (it == lines.end()) {
+            uint32_t count = 1;
+            uint64_t next = (uint64_t)line + LINE;
+            while (next < end && count < MAX_RUN && cacheable(next) && !lines.count(next)) {
+                next += LINE;
+                count++;
+            }
+            if (!fetch(line, count)) return false;
+            it = lines.find(line);
+        } else {
+            stats_.hits++;
+        }
+        
+        uint64_t stop = (uint64_t)line + LINE < end ? (uint64_t)line + LINE : end;
+        memcpy(buf + (a - addr), it->second.data + (a - line), stop - a);
+        a = stop;
+    }
+    
+    return true;
+}
+
+bool MemCache::write(uint32_t addr, const uint8_t* buf, uint32_t len) {
+    if (!dev->write_mem(addr, buf, len)) {
+        forget(addr, len);
+        return false;
+    }
+    
+    uint64_t end = (uint64_t)addr + len;
+    uint32_t first = addr & ~(LINE - 1);
+    for (auto it = lines.lower_bound(first); it != lines.end() && it->first < end; ) {
+        if (in_flash(it->first)) {
+            it = lines.erase(it);
+            continue;
+        }
+        
+        uint64_t lo = it->first > addr ? it->first : addr;
+        uint64_t hi = (uint64_t)it->first + LINE < end ? (uint64_t)it->first + LINE : end;
+        memcpy(it->second.data + (lo - it->first), buf + (lo - addr), hi - lo);
+        ++it;
+    }
+    
+    return true;
+}
+
+void MemCache::invalidate() {
+    for (auto it = lines.begin(); it != lines.end(); ) {
+        if (in_flash(it->first)) ++it;
+        else it = lines.erase(it);
+    }
+}
+
+void MemCache::forget(uint32_t addr, uint32_t len) {
+    uint64_t end = (uint64_t)addr + len;
+    auto it = lines.lower_bound(addr & ~(LINE - 1));
+    while (it != lines.end() && it->first < end) it = lines.erase(it);
+}
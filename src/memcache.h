@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+
+class Device;
+
+// Target memory cached in 64-byte lines, for debugger front ends that read
+// the same few words over and over. Only flash and SRAM are cached;
+// peripherals and the system space always go to the target.
+//
+// SRAM lines are only good while the core stays halted: invalidate() drops
+// them before it runs. Flash lines survive until forget() is called for a
+// range that has been programmed.
+class MemCache {
+public:
+    static const uint32_t LINE = 64;
+    
+    struct Stats {
+        uint32_t hits = 0;        // lines served from the cache
+        uint32_t misses = 0;      // lines fetched
+        uint32_t fetches = 0;     // target reads, each a run of missing lines
+        uint32_t uncached = 0;    // reads outside flash and SRAM
+    };
+    
+    explicit MemCache(Device* dev);
+    
+    bool read(uint32_t addr, uint8_t* buf, uint32_t len);
+    
+    // Written through to the target; cached SRAM is updated, cached flash
+    // dropped
+    bool write(uint32_t addr, const uint8_t* buf, uint32_t len);
+    
+    void invalidate();
+    void forget(uint32_t addr, uint32_t len);
+    
+    const Stats& stats() const { return stats_; }
+
+private:
+    struct Line {
+        uint8_t data[LINE];
+    };
+    
+    bool cacheable(uint32_t line) const;
+    bool in_flash(uint32_t line) const;
+    bool fetch(uint32_t line, uint32_t count);
+    
+    Device* dev;
+    std::map<uint32_t, Line> lines;
+    Stats stats_;
+};
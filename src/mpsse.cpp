@@ -0,0 +1,186 @@
+#include "mpsse.h"
+#include <cstring>
+
+// MPSSE opcodes (AN_108)
+enum : uint8_t {
+    OP_WRITE_NEG = 0x01,
+    OP_BITMODE = 0x02,
+    OP_LSB = 0x08,
+    OP_DO_WRITE = 0x10,
+    OP_DO_READ = 0x20,
+    OP_WRITE_TMS = 0x40,
+    OP_SET_BITS_LOW = 0x80,
+    OP_GET_BITS_LOW = 0x81,
+    OP_LOOPBACK_END = 0x85,
+    OP_TCK_DIVISOR = 0x86,
+    OP_SEND_IMMEDIATE = 0x87,
+    OP_DIS_DIV_5 = 0x8a,
+    OP_DIS_3_PHASE = 0x8d,
+    OP_DIS_ADAPTIVE = 0x97
+};
+
+// JTAG: TDI changes on the falling edge, TDO is sampled on the rising edge
+static constexpr uint8_t SHIFT_BYTES = OP_DO_WRITE | OP_LSB | OP_WRITE_NEG;
+static constexpr uint8_t SHIFT_BITS = SHIFT_BYTES | OP_BITMODE;
+static constexpr uint8_t CLOCK_TMS = OP_WRITE_TMS | OP_LSB | OP_BITMODE | OP_WRITE_NEG;
+
+uint16_t MpsseQueue::divisor(uint32_t khz) {
+    if (khz == 0) khz = 1;
+    if (khz >= MAX_KHZ) return 0;
+    
+    // TCK = 60 MHz / ((1 + div) * 2), rounded so we never exceed khz
+    uint32_t div = (MAX_KHZ + khz - 1) / khz - 1;
+    return div > 0xffff ? 0xffff : div;
+}
+
+uint32_t MpsseQueue::frequency(uint16_t div) {
+    return MAX_KHZ / (1 + div);
+}
+
+void MpsseQueue::put16(uint16_t v) {
+    cmd.push_back(v & 0xff);
+    cmd.push_back(v >> 8);
+}
+
+void MpsseQueue::setup(uint32_t khz) {
+    cmd.push_back(OP_LOOPBACK_END);
+    cmd.push_back(OP_DIS_DIV_5);
+    cmd.push_back(OP_DIS_ADAPTIVE);
+    cmd.push_back(OP_DIS_3_PHASE);
+    clock(khz);
+    cmd.push_back(OP_SET_BITS_LOW);
+    cmd.push_back(pins);
+    cmd.push_back(DIRECTION);
+}
+
+void MpsseQueue::clock(uint32_t khz) {
+    cmd.push_back(OP_TCK_DIVISOR);
+    put16(divisor(khz));
+}
+
+void MpsseQueue::set_pins(uint8_t mask, bool value) {
+    if (value) pins |= mask;
+    else pins &= ~mask;
+    
+    cmd.push_back(OP_SET_BITS_LOW);
+    cmd.push_back(pins);
+    cmd.push_back(DIRECTION);
+}
+
+void MpsseQueue::get_pins(bool* tdo) {
+    cmd.push_back(OP_GET_BITS_LOW);
+    reads.push_back({ReadKind::Pin, nullptr, 0, 0, tdo});
+    rx_len += 1;
+    finished = false;
+}
+
+void MpsseQueue::tms(uint32_t bits, int len) {
+    // Up to 7 TMS bits per command, bit 7 holds TDI steady
+    while (len > 0) {
+        int n = len > 7 ? 7 : len;
+        cmd.push_back(CLOCK_TMS);
+        cmd.push_back(n - 1);
+        cmd.push_back((bits & ((1u << n) - 1)) | (last_tdi ? 0x80 : 0));
+        bits >>= n;
+        len -= n;
+    }
+    
+    // TMS is left at the level of the last bit
+    finished = false;
+}
+
+void MpsseQueue::shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) {
+    if (len <= 0) return;
+    
+    // The exit bit has to go out with the TMS command
+    int body = exit ? len - 1 : len;
+    int nbytes = body / 8;
+    int nbits = body % 8;
+    uint8_t rd = tdo ? OP_DO_READ : 0;
+    
+    for (int off = 0; off < nbytes; ) {
+        int n = nbytes - off > 65536 ? 65536 : nbytes - off;
+        cmd.push_back(SHIFT_BYTES | rd);
+        put16(n - 1);
+        if (tdi) cmd.insert(cmd.end(), tdi + off, tdi + off + n);
+        else cmd.insert(cmd.end(), n, 0);
+        
+        if (tdo) {
+            reads.push_back({ReadKind::Bytes, tdo + off, n, 0, nullptr});
+            rx_len += n;
+        }
+        off += n;
+    }
+    
+    if (nbits) {
+        uint8_t v = tdi ? tdi[nbytes] & ((1 << nbits) - 1) : 0;
+        cmd.push_back(SHIFT_BITS | rd);
+        cmd.push_back(nbits - 1);
+        cmd.push_back(v);
+        last_tdi = (v >> (nbits - 1)) & 1;
+        
+        if (tdo) {
+            reads.push_back({ReadKind::Bits, tdo + nbytes, nbits, 0, nullptr});
+            rx_len += 1;
+        }
+    } else if (nbytes) {
+        last_tdi = tdi ? (tdi[nbytes - 1] >> 7) & 1 : false;
+    }
+    
+    if (exit) {
+        int i = len - 1;
+        bool bit = tdi ? (tdi[i/8] >> (i % 8)) & 1 : false;
+        cmd.push_back(CLOCK_TMS | rd);
+        cmd.push_back(0);
+        cmd.push_back(0x01 | (bit ? 0x80 : 0));
+        last_tdi = bit;
+        
+        if (tdo) {
+            reads.push_back({ReadKind::TmsBit, tdo + i/8, 1, i % 8, nullptr});
+            rx_len += 1;
+        }
+    }
+    
+    finished = false;
+}
+
+const std::vector<uint8_t>& MpsseQueue::commands() {
+    if (rx_len && !finished) {
+        cmd.push_back(OP_SEND_IMMEDIATE);
+        finished = true;
+    }
+    return cmd;
+}
+
+void MpsseQueue::decode(const uint8_t* rx) {
+    for (const auto& r : reads) {
+        switch (r.kind) {
+            case ReadKind::Bytes:
+                memcpy(r.dst, rx, r.len);
+                rx += r.len;
+                break;
+            case ReadKind::Bits: {
+                // Bits are shifted in from the top of the byte
+                uint8_t mask = (1 << r.len) - 1;
+                uint8_t v = (*rx++ >> (8 - r.len)) & mask;
+                *r.dst = (*r.dst & ~mask) | v;
+                break;
+            }
+            case ReadKind::TmsBit: {
+                uint8_t v = (*rx++ >> 7) & 1;
+                *r.dst = (*r.dst & ~(1 << r.bit)) | (v << r.bit);
+                break;
+            }
+            case ReadKind::Pin:
+                *r.flag = (*rx++ & TDO) != 0;
+                break;
+        }
+    }
+}
+
+void MpsseQueue::clear() {
+    cmd.clear();
+    reads.clear();
+    rx_len = 0;
+    finished = false;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Encodes JTAG scans as FTDI MPSSE commands and decodes the read-back.
+// Shared by the libftdi and D2XX adapters. Pinout on ADBUS:
+// D0 TCK, D1 TDI, D2 TDO, D3 TMS, D4 TRST.
+class MpsseQueue {
+public:
+    static constexpr uint8_t TCK = 0x01;
+    static constexpr uint8_t TDI = 0x02;
+    static constexpr uint8_t TDO = 0x04;
+    static constexpr uint8_t TMS = 0x08;
+    static constexpr uint8_t TRST = 0x10;
+    static constexpr uint8_t DIRECTION = TCK | TDI | TMS | TRST;
+    
+    static constexpr uint32_t MAX_KHZ = 30000;  // 60 MHz base, div-by-5 off
+    
+    MpsseQueue() : pins(TMS | TRST), last_tdi(false) {}
+    
+    // Commands to put a freshly reset MPSSE into JTAG mode at khz
+    void setup(uint32_t khz);
+    void clock(uint32_t khz);
+    void set_pins(uint8_t mask, bool value);
+    void get_pins(bool* tdo);
+    
+    void tms(uint32_t bits, int len);
+    void shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit);
+    
+    bool empty() const { return cmd.empty(); }
+    size_t write_size() const { return cmd.size(); }
+    size_t read_size() const { return rx_len; }
+    
+    // Command stream, terminated with SEND_IMMEDIATE when a read is pending
+    const std::vector<uint8_t>& commands();
+    void decode(const uint8_t* rx);
+    void clear();
+    
+    static uint16_t divisor(uint32_t khz);
+    static uint32_t frequency(uint16_t div);
+    
+private:
+    enum class ReadKind { Bytes, Bits, TmsBit, Pin };
+    
+    struct Read {
+        ReadKind kind;
+        uint8_t* dst;
+        int len;   // bytes for Bytes, bits for Bits
+        int bit;   // destination bit for Bits/TmsBit
+        bool* flag;
+    };
+    
+    void put16(uint16_t v);
+    
+    uint8_t pins;
+    bool last_tdi;
+    std::vector<uint8_t> cmd;
+    std::vector<Read> reads;
+    size_t rx_len = 0;
+    bool finished = false;
+};
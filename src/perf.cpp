@@ -0,0 +1,144 @@
+#include "perf.h"
+#include "jtag.h"
+#include "device.h"
+#include "flash.h"
+#include <cstring>
+#include <iomanip>
+
+bool perf_timing = false;
+
+// Always the same counters in the same order, so two snapshots can be
+// diffed by index
+PerfSnapshot PerfSnapshot::take(const JtagAdapter* adapter, const Jtag* jtag, const Device* dev,
+                                const Flash* flash) {
+    PerfSnapshot s;
+    s.us = PerfTimer::now();
+    auto add = [&](const char* layer, const char* name, uint64_t value) {
+        s.counters.push_back({layer, name, value});
+    };
+    
+    JtagAdapter::Stats usb = adapter ? adapter->stats() : JtagAdapter::Stats();
+    add("usb", "transfers", usb.transfers);
+    add("usb", "bytes_out", usb.bytes_out);
+    add("usb", "bytes_in", usb.bytes_in);
+    add("usb", "usb_us", usb.usb_us);
+    
+    Jtag::Stats j = jtag ? jtag->stats() : Jtag::Stats();
+    add("jtag", "tck", j.tck);
+    add("jtag", "tms_clocks", j.tms_clocks);
+    add("jtag", "ir_scans", j.ir_scans);
+    add("jtag", "dr_scans", j.dr_scans);
+    add("jtag", "flushes", j.flushes);
+    
+    Dap::Stats d = dev ? dev->debug_port().stats() : Dap::Stats();
+    add("dap", "dr_scans", d.dr_scans);
+    add("dap", "ir_scans", d.ir_scans);
+    add("dap", "dr_elided", d.dr_elided);
+    add("dap", "ir_elided", d.ir_elided);
+    add("dap", "waits", d.waits);
+    add("dap", "disagree", d.disagree);
+    
+    Device::Stats m = dev ? dev->stats() : Device::Stats();
+    add("mem", "reads", m.reads);
+    add("mem", "writes", m.writes);
+    add("mem", "bytes_read", m.bytes_read);
+    add("mem", "bytes_written", m.bytes_written);
+    add("mem", "mem_us", m.mem_us);
+    
+    Flash::Stats f = flash ? flash->stats() : Flash::Stats();
+    add("flash", "erase_us", f.erase_us);
+    add("flash", "program_us", f.program_us);
+    add("flash", "verify_us", f.verify_us);
+    add("flash", "sectors_erased", f.sectors_erased);
+    add("flash", "bytes_programmed", f.bytes_programmed);
+    add("flash", "bytes_verified", f.bytes_verified);
+    add("flash", "polls", f.polls);
+    
+    return s;
+}
+
+uint64_t PerfSnapshot::get(const char* layer, const char* name) const {
+    for (const auto& c : counters) {
+        if (!strcmp(c.layer, layer) && !strcmp(c.name, name)) return c.value;
+    }
+    return 0;
+}
+
+static double ratio(double num, double den) {
+    return den > 0 ? num / den : 0;
+}
+
+void perf_report(std::ostream& os, const std::string& command, const PerfSnapshot& before,
+                 const PerfSnapshot& after, bool json) {
+    PerfSnapshot delta = after;
+    delta.us = after.us - before.us;
+    for (size_t i = 0; i < delta.counters.size() && i < before.counters.size(); i++) {
+        delta.counters[i].value -= before.counters[i].value;
+    }
+    
+    double secs = delta.us / 1e6;
+    uint64_t bytes = delta.get("mem", "bytes_read") + delta.get("mem", "bytes_written");
+    double kbps = ratio(bytes / 1024.0, secs);
+    double per_word = ratio(delta.get("dap", "dr_scans"), bytes / 4.0);
+    double prog_kbps = ratio(delta.get("flash", "bytes_programmed") / 1024.0,
+                             delta.get("flash", "program_us") / 1e6);
+    double us_per_xfer = ratio(delta.get("usb", "usb_us"), delta.get("usb", "transfers"));
+    
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize prec = os.precision();
+    os << std::fixed << std::setprecision(3);
+    
+    if (json) {
+        os << "{\"command\":\"";
+        for (char c : command) {
+            if (c == '"' || c == '\\') os << '\\';
+            os << c;
+        }
+        os << "\",\"total_s\":" << secs;
+        
+        const char* layer = nullptr;
+        for (const auto& c : delta.counters) {
+            if (!layer || strcmp(layer, c.layer)) {
+                os << (layer ? "}," : ",") << "\"" << c.layer << "\":{";
+                layer = c.layer;
+            } else {
+                os << ",";
+            }
+            os << "\"" << c.name << "\":" << c.value;
+        }
+        if (layer) os << "}";
+        
+        os << ",\"derived\":{\"kb_per_s\":" << kbps << ",\"scans_per_word\":" << per_word
+           << ",\"program_kb_per_s\":" << prog_kbps << ",\"usb_us_per_transfer\":" << us_per_xfer
+           << ",\"erase_s\":" << delta.get("flash", "erase_us") / 1e6
+           << ",\"program_s\":" << delta.get("flash", "program_us") / 1e6
+           << ",\"verify_s\":" << delta.get("flash", "verify_us") / 1e6 << "}}\n";
+    } else {
+        os << "Stats for " << command << ": " << secs << " s\n";
+        
+        const char* layer = nullptr;
+        for (const auto& c : delta.counters) {
+            if (!layer || strcmp(layer, c.layer)) {
+                os << (layer ? "\n" : "") << "  " << std::left << std::setw(6) << c.layer
+                   << std::right;
+                layer = c.layer;
+            }
+            os << " " << c.name << "=" << c.value;
+        }
+        if (layer) os << "\n";
+        
+        os << "  memory " << kbps << " KB/s, " << per_word << " DR scans per word\n";
+        if (delta.get("usb", "transfers")) {
+            os << "  usb    " << us_per_xfer << " us per transfer\n";
+        }
+        if (delta.get("flash", "erase_us") || delta.get("flash", "program_us") ||
+            delta.get("flash", "verify_us")) {
+            os << "  flash  erase " << delta.get("flash", "erase_us") / 1e6 << " s, program "
+               << delta.get("flash", "program_us") / 1e6 << " s (" << prog_kbps
+               << " KB/s), verify " << delta.get("flash", "verify_us") / 1e6 << " s\n";
+        }
+    }
+    
+    os.flags(flags);
+    os.precision(prec);
+}
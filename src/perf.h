@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class JtagAdapter;
+class Jtag;
+class Device;
+class Flash;
+
+// Each layer keeps its own counters as plain adds. Wall-clock time is
+// only read while perf_timing is on (--stats), so otherwise a PerfTimer
+// costs one well-predicted branch.
+extern bool perf_timing;
+
+class PerfTimer {
+public:
+    PerfTimer() : start(perf_timing ? now() : 0) {}
+    uint64_t us() const { return perf_timing ? now() - start : 0; }
+    
+    static uint64_t now() {
+        auto t = std::chrono::steady_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::microseconds>(t).count();
+    }
+    
+private:
+    uint64_t start;
+};
+
+// Every layer's counters at one moment. A command's share is the
+// difference between a snapshot before and one after it.
+struct PerfCounter {
+    const char* layer;
+    const char* name;
+    uint64_t value;
+};
+
+struct PerfSnapshot {
+    uint64_t us = 0;
+    std::vector<PerfCounter> counters;
+    
+    // Layers that aren't there yet count as zero
+    static PerfSnapshot take(const JtagAdapter* adapter, const Jtag* jtag, const Device* dev,
+                             const Flash* flash);
+    uint64_t get(const char* layer, const char* name) const;
+};
+
+// Counters per layer plus effective throughput, scans per word and time
+// per flash phase, as text or as one JSON object
+void perf_report(std::ostream& os, const std::string& command, const PerfSnapshot& before,
+                 const PerfSnapshot& after, bool json);
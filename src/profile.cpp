@@ -0,0 +1,88 @@
+#include "profile.h"
+#include "device.h"
+#include "image.h"
+#include "jtag.h"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// PC Sample Register at DWT + 0x1C; DEMCR.TRCENA powers the DWT
+static const uint32_t DWT = 0xE0001000;
+static const uint32_t DWT_PCSR = 0x1C;
+static const uint32_t DEMCR = 0xE000EDFC;
+static const uint32_t TRCENA = 1u << 24;
+
+// Samples per flush: enough that USB latency is noise, few enough that
+// the time limit isn't overshot by much at low TCK
+static const uint32_t BATCH = 1024;
+
+bool profile_sample(Device& dev, Jtag& jtag, double seconds, Profile* prof) {
+    uint32_t demcr = 0;
+    if (!dev.read_mem(DEMCR, (uint8_t*)&demcr, 4)) return false;
+    uint32_t on = demcr | TRCENA;
+    if (on != demcr && !dev.write_mem(DEMCR, (uint8_t*)&on, 4)) return false;
+    
+    uint32_t pcsr = dev.component(CsKind::Dwt, DWT) + DWT_PCSR;
+    std::vector<uint32_t> batch(BATCH);
+    uint64_t start = jtag.now_us();
+    uint64_t limit = seconds * 1e6;
+    bool ok = true;
+    
+    while (jtag.now_us() - start < limit) {
+        if (!dev.read_repeat(pcsr, batch.data(), BATCH)) {
+            std::cerr << "Reading DWT_PCSR failed\n";
+            ok = false;
+            break;
+        }
+        for (uint32_t pc : batch) {
+            if (pc == 0xffffffff) prof->halted++;
+            else prof->pcs[pc]++;
+        }
+        prof->samples += BATCH;
+    }
+    prof->seconds = (jtag.now_us() - start) / 1e6;
+    
+    if (on != demcr) dev.write_mem(DEMCR, (uint8_t*)&demcr, 4);
+    return ok;
+}
+
+void profile_report(const Profile& prof, const ElfSymbols* syms, int top, std::ostream& out) {
+    char line[160];
+    snprintf(line, sizeof(line), "%llu samples in %.2f s (%.0f samples/s), %llu with the core halted\n",
+             (unsigned long long)prof.samples, prof.seconds,
+             prof.seconds > 0 ? prof.samples / prof.seconds : 0.0, (unsigned long long)prof.halted);
+    out << line;
+    
+    uint64_t running = prof.samples - prof.halted;
+    if (!running) return;
+    
+    // Fold addresses into functions when there are symbols to go by
+    std::map<std::string, uint64_t> by_name;
+    std::vector<std::pair<std::string, uint64_t>> rows;
+    if (syms && syms->size()) {
+        for (const auto& e : prof.pcs) {
+            const ElfSymbol* s = syms->find(e.first);
+            by_name[s ? s->name : "??"] += e.second;
+        }
+        rows.assign(by_name.begin(), by_name.end());
+    } else {
+        for (const auto& e : prof.pcs) {
+            snprintf(line, sizeof(line), "0x%08x", e.first);
+            rows.push_back({line, e.second});
+        }
+    }
+    
+    std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    if ((int)rows.size() > top) rows.resize(top);
+    
+    for (const auto& r : rows) {
+        snprintf(line, sizeof(line), "%6.2f%% %10llu  ", 100.0 * r.second / running,
+                 (unsigned long long)r.second);
+        out << line << r.first << "\n";
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+
+class Device;
+class Jtag;
+class ElfSymbols;
+
+struct Profile {
+    uint64_t samples = 0;
+    uint64_t halted = 0;       // PCSR read all ones: core halted or not sampling
+    double seconds = 0;
+    std::unordered_map<uint32_t, uint64_t> pcs;
+};
+
+// Read DWT_PCSR for the given time without stopping the core, a batch of
+// pipelined reads per link round trip. DEMCR.TRCENA is set for the DWT
+// and put back afterwards.
+bool profile_sample(Device& dev, Jtag& jtag, double seconds, Profile* prof);
+
+// Samples per second, then the top entries: per function when syms has
+// any, else per address
+void profile_report(const Profile& prof, const ElfSymbols* syms, int top, std::ostream& out);
@@ -0,0 +1,729 @@
+#include "sim.h"
+#include <iostream>
+#include <cstring>
+
+// Target: STM32F103C8, 64 KB flash in 1 KB pages (or cfg.page_size), 20 KB SRAM
+static const uint32_t FLASH_BASE = 0x08000000;
+static const uint32_t FLASH_SIZE = 64 * 1024;
+static const uint32_t SRAM_BASE = 0x20000000;
+static const uint32_t SRAM_SIZE = 20 * 1024;
+static const uint32_t FLASH_REGS = 0x40022000;
+static const uint32_t CRC_REGS = 0x40023000;
+static const uint32_t RCC_AHBENR = 0x40021014;
+static const uint32_t SCS_BASE = 0xE000E000;
+static const uint32_t FPB_BASE = 0xE0002000;
+static const uint32_t ROM_BASE = 0xE00FF000;
+static const uint32_t DWT_PCSR = 0xE000101C;
+
+// CoreSight components as a Cortex-M3 behind ST's ROM table has them: base,
+// PIDR0-2, PIDR4 and the CIDR1 class. The ROM table lists the rest in order.
+struct SimComponent {
+    uint32_t base;
+    uint8_t pidr[4];
+    uint8_t cls;
+};
+
+static const SimComponent COMPONENTS[] = {
+    {ROM_BASE, {0x10, 0x04, 0x0a, 0x00}, 0x1},     // ST
+    {SCS_BASE, {0x00, 0xb0, 0x0b, 0x04}, 0xe},     // ARM SCS-M3
+    {0xE0001000, {0x02, 0xb0, 0x0b, 0x04}, 0xe},   // DWT
+    {FPB_BASE, {0x03, 0xb0, 0x0b, 0x04}, 0xe},     // FPB
+    {0xE0000000, {0x01, 0xb0, 0x0b, 0x04}, 0xe},   // ITM
+};
+static const int NUM_COMPONENTS = sizeof(COMPONENTS) / sizeof(COMPONENTS[0]);
+
+// Timing in TCK periods, taking TCK as 1 MHz and the core at 8 MHz
+static const int CORE_STEPS = 8;
+static const int PROGRAM_TICKS = 50;
+static const int PAGE_ERASE_TICKS = 20000;
+static const int MASS_ERASE_TICKS = 40000;
+
+// MPSSE: a 3-byte header per command, TMS commands carrying up to 7 clocks
+static const int MPSSE_HEADER = 3;
+static const int MPSSE_TMS_CLOCKS = 7;
+
+// JTAG-DP instructions
+static const uint8_t IR_ABORT = 0x8;
+static const uint8_t IR_DPACC = 0xA;
+static const uint8_t IR_APACC = 0xB;
+static const uint8_t IR_IDCODE = 0xE;
+
+// FLASH_SR / FLASH_CR
+static const uint32_t SR_BSY = 1u << 0;
+static const uint32_t SR_PGERR = 1u << 2;
+static const uint32_t SR_WRPRTERR = 1u << 4;
+static const uint32_t SR_EOP = 1u << 5;
+static const uint32_t CR_PG = 1u << 0;
+static const uint32_t CR_PER = 1u << 1;
+static const uint32_t CR_MER = 1u << 2;
+static const uint32_t CR_STRT = 1u << 6;
+static const uint32_t CR_LOCK = 1u << 7;
+
+// DP CTRL/STAT
+static const uint32_t ORUNDETECT = 1u << 0;
+static const uint32_t STICKYORUN = 1u << 1;
+
+// DHCSR
+static const uint32_t C_DEBUGEN = 1u << 0;
+static const uint32_t C_HALT = 1u << 1;
+static const uint32_t C_STEP = 1u << 2;
+static const uint32_t S_REGRDY = 1u << 16;
+static const uint32_t S_HALT = 1u << 17;
+static const uint32_t S_LOCKUP = 1u << 19;
+
+// xPSR condition flags
+static const uint32_t PSR_N = 1u << 31;
+static const uint32_t PSR_Z = 1u << 30;
+static const uint32_t PSR_C = 1u << 29;
+static const uint32_t PSR_V = 1u << 28;
+
+SimAdapter::SimAdapter(const SimConfig& c)
+    : cfg(c), tck(0), pending_out(0), pending_in(0), khz(1000), noise(0x2545F491),
+      state(TapState::Reset), ir(IR_IDCODE), sr(0), sr_len(1),
+      ctrl(0), select(0), rdbuff(0), csw(0x03000042), tar(0), ap_busy_until(0), waited(false),
+      flash(FLASH_SIZE, 0xff), sram(SRAM_SIZE, 0),
+      flash_locked(true), key_step(0), flash_cr(0), flash_sr(0), flash_ar(0), flash_busy_until(0),
+      crc(0xffffffff), r{}, halted(false), lockup(false), dhcsr(0), dcrdr(0), fp_ctrl(0), fp_comp{} {
+    other[RCC_AHBENR] = 0x14;
+}
+
+bool SimAdapter::open() {
+    state = TapState::Reset;
+    ir = IR_IDCODE;
+    core_reset();
+    return true;
+}
+
+// As MPSSE: 30 MHz at most
+uint32_t SimAdapter::set_clock(uint32_t want) {
+    khz = want < 30000 ? want : 30000;
+    return khz;
+}
+
+// The share of bits that come out wrong grows with how far over max_khz
+bool SimAdapter::sample(bool tdo) {
+    if (!cfg.max_khz || khz <= cfg.max_khz) return tdo;
+    
+    noise ^= noise << 13;
+    noise ^= noise >> 17;
+    noise ^= noise << 5;
+    return (noise % khz) < khz - cfg.max_khz ? !tdo : tdo;
+}
+
+void SimAdapter::delay(unsigned us) {
+    for (unsigned i = 0; i < us; i++) tick();
+}
+
+void SimAdapter::queue_tms(uint32_t tms, int len) {
+    usb_bytes(MPSSE_HEADER * ((len + MPSSE_TMS_CLOCKS - 1) / MPSSE_TMS_CLOCKS), 0);
+    for (int i = 0; i < len; i++) clock((tms >> i) & 1, false);
+}
+
+void SimAdapter::queue_shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) {
+    // The last bit goes out with the TMS command that leaves Shift-xR
+    usb_bytes(MPSSE_HEADER + (len + 7) / 8 + (exit ? MPSSE_HEADER : 0), tdo ? (len + 7) / 8 : 0);
+    for (int i = 0; i < len; i++) {
+        bool in = tdi ? (tdi[i / 8] >> (i % 8)) & 1 : false;
+        bool out = sample(clock(exit && i == len - 1, in));
+        if (tdo) {
+            if (out) tdo[i / 8] |= 1 << (i % 8);
+            else tdo[i / 8] &= ~(1 << (i % 8));
+        }
+    }
+}
+
+void SimAdapter::usb_bytes(uint64_t out, uint64_t in) {
+    pending_out += out;
+    pending_in += in;
+}
+
+// The target keeps running while the host waits on the bus
+bool SimAdapter::flush() {
+    if (!pending_out) return true;
+    
+    stats_.transfers += pending_in ? 2 : 1;
+    stats_.bytes_out += pending_out;
+    stats_.bytes_in += pending_in;
+    
+    uint64_t us = cfg.usb_latency_us + (pending_out + pending_in) * cfg.usb_ns_per_byte / 1000;
+    stats_.usb_us += us;
+    for (uint64_t i = 0; i < us; i++) tick();
+    
+    pending_out = pending_in = 0;
+    return true;
+}
+
+// One TCK: shift on the way through Shift-xR, act on Capture/Update
+bool SimAdapter::clock(bool tms, bool tdi) {
+    tick();
+    
+    bool out = false;
+    if (state == TapState::ShiftDR || state == TapState::ShiftIR) {
+        out = sr & 1;
+        sr = (sr >> 1) | ((uint64_t)tdi << (sr_len - 1));
+    }
+    
+    state = Jtag::next_state(state, tms);
+    switch (state) {
+        case TapState::Reset:     ir = IR_IDCODE; break;
+        case TapState::CaptureIR: sr = 0x1; sr_len = cfg.ir_len; break;
+        case TapState::UpdateIR:  ir = sr & ((1u << cfg.ir_len) - 1); break;
+        case TapState::CaptureDR: capture_dr(); break;
+        case TapState::UpdateDR:  update_dr(); break;
+        default: break;
+    }
+    return out;
+}
+
+void SimAdapter::tick() {
+    tck++;
+    
+    if ((flash_sr & SR_BSY) && tck >= flash_busy_until) {
+        flash_sr &= ~SR_BSY;
+        flash_sr |= SR_EOP;
+    }
+    
+    for (int i = 0; i < CORE_STEPS && !halted && !lockup; i++) {
+        if (fpb_hit(r[15])) {
+            halted = true;
+            break;
+        }
+        step();
+    }
+}
+
+bool SimAdapter::fpb_hit(uint32_t pc) const {
+    if (!(fp_ctrl & 1)) return false;
+    for (uint32_t comp : fp_comp) {
+        if (!(comp & 1) || (comp & 0x1FFFFFFC) != (pc & 0x1FFFFFFC)) continue;
+        if ((comp >> 30) == (pc & 2 ? 2u : 1u) || (comp >> 30) == 3) return true;
+    }
+    return false;
+}
+
+void SimAdapter::capture_dr() {
+    switch (ir) {
+        case IR_IDCODE:
+            sr = cfg.idcode;
+            sr_len = 32;
+            break;
+        case IR_ABORT:
+            sr = ((uint64_t)rdbuff << 3) | 0x2;
+            sr_len = 35;
+            break;
+        case IR_DPACC:
+        case IR_APACC:
+            // Previous result with ACK OK/FAULT, or WAIT while the AP is
+            // still on the bus; a WAIT with ORUNDETECT sets STICKYORUN
+            waited = tck < ap_busy_until;
+            if (waited && (ctrl & ORUNDETECT)) ctrl |= STICKYORUN;
+            sr = ((uint64_t)rdbuff << 3) | (waited ? 0x1 : 0x2);
+            sr_len = 35;
+            break;
+        default:
+            sr = 0;
+            sr_len = 1;
+            break;
+    }
+}
+
+void SimAdapter::update_dr() {
+    // DAPABORT cancels the bus access in flight
+    if (ir == IR_ABORT && (sr >> 3) & 1) ap_busy_until = 0;
+    if (ir != IR_DPACC && ir != IR_APACC) return;
+    
+    bool read = sr & 1;
+    uint8_t a = ((sr >> 1) & 3) << 2;
+    uint32_t data = sr >> 3;
+    
+    // Overrun: nothing but CTRL/STAT takes effect until STICKYORUN is cleared
+    if (waited || ((ctrl & STICKYORUN) && !(ir == IR_DPACC && a == 0x4))) return;
+    
+    if (ir == IR_APACC) {
+        uint32_t v = ap_access(read, (select & 0xf0) | a, data);
+        if (read) rdbuff = v;
+        return;
+    }
+    
+    switch (a) {
+        case 0x4:
+            if (read) {
+                // Power-up requests are acknowledged immediately
+                rdbuff = ctrl | ((ctrl & (1u << 28)) << 1) | ((ctrl & (1u << 30)) << 1);
+            } else {
+                uint32_t sticky = ctrl & 0x32 & ~data;  // write 1 to clear
+                ctrl = (data & 0x50000f01) | sticky;
+            }
+            break;
+        case 0x8:
+            if (read) rdbuff = select;
+            else select = data;
+            break;
+        case 0xc:
+            // RDBUFF: the last AP read again
+            break;
+    }
+}
+
+uint32_t SimAdapter::ap_access(bool read, uint8_t reg, uint32_t data) {
+    // A single AHB-AP
+    if (select >> 24) return 0;
+    
+    int size = 1 << (csw & 3);
+    
+    switch (reg) {
+        case 0x00:
+            if (!read) csw = (data & 0xff000037) | 0x40;  // DeviceEn
+            return csw;
+        case 0x04:
+            if (!read) tar = data;
+            return tar;
+        case 0x0c: {
+            bus_busy(tar);
+            uint32_t v = 0;
+            if (read) v = bus_read(tar, size);
+            else bus_write(tar, size, data);
+            if (((csw >> 4) & 3) == 1)
+                tar = (tar & ~0x3ffu) | ((tar + size) & 0x3ff);
+            return v;
+        }
+        case 0x10: case 0x14: case 0x18: case 0x1c: {
+            uint32_t addr = (tar & ~0xfu) | (reg & 0xc);
+            bus_busy(addr);
+            if (read) return bus_read(addr, 4);
+            bus_write(addr, 4, data);
+            return 0;
+        }
+        case 0xf8: return 0xE00FF003;
+        case 0xfc: return 0x24770011;
+    }
+    return 0;
+}
+
+// ROM table entries and the identification registers at 0xFD0-0xFFC of
+// each component
+bool SimAdapter::cs_read(uint32_t addr, uint32_t* v) {
+    for (int i = 0; i < NUM_COMPONENTS; i++) {
+        const SimComponent& c = COMPONENTS[i];
+        uint32_t offset = addr - c.base;
+        if (addr < c.base || offset >= 0x1000) continue;
+        
+        if (c.base == ROM_BASE && offset < 4 * (NUM_COMPONENTS - 1)) {
+            *v = (COMPONENTS[offset / 4 + 1].base - ROM_BASE) | 3;
+            return true;
+        }
+        if (offset < 0xFD0) return false;
+        
+        static const uint8_t cidr[4] = {0x0d, 0x00, 0x05, 0xb1};
+        int reg = (offset - 0xFD0) / 4;
+        if (reg == 0) *v = c.pidr[3];
+        else if (reg < 4) *v = 0;
+        else if (reg < 7) *v = c.pidr[reg - 4];
+        else if (reg == 7) *v = 0;
+        else *v = reg == 9 ? c.cls << 4 : cidr[reg - 8];
+        return true;
+    }
+    return false;
+}
+
+// The flash array stalls the bus until the controller is done
+void SimAdapter::bus_busy(uint32_t addr) {
+    uint32_t word = addr & ~3u;
+    if (word < FLASH_SIZE) word += FLASH_BASE;
+    
+    uint64_t start = tck;
+    if ((flash_sr & SR_BSY) && word >= FLASH_BASE && word < FLASH_BASE + FLASH_SIZE)
+        start = flash_busy_until;
+    ap_busy_until = start + cfg.ap_wait;
+}
+
+// Bus accesses carry data on the byte lanes of the address, as DRW does
+uint32_t SimAdapter::bus_read(uint32_t addr, int size) {
+    (void)size;
+    uint32_t word = addr & ~3u;
+    uint32_t v = 0;
+    
+    if (word < FLASH_SIZE) word += FLASH_BASE;  // boot alias
+    if (cs_read(word, &v)) return v;
+    
+    if (word >= FLASH_BASE && word < FLASH_BASE + FLASH_SIZE) {
+        memcpy(&v, &flash[word - FLASH_BASE], 4);
+    } else if (word >= SRAM_BASE && word < SRAM_BASE + SRAM_SIZE) {
+        memcpy(&v, &sram[word - SRAM_BASE], 4);
+    } else if (word >= FLASH_REGS && word < FLASH_REGS + 0x400) {
+        v = flash_reg_read(word);
+    } else if (word == CRC_REGS) {
+        v = crc;
+    } else if (word >= SCS_BASE && word < SCS_BASE + 0x1000) {
+        v = scs_read(word);
+    } else if (word >= FPB_BASE && word < FPB_BASE + 8 + 4 * FP_CODE) {
+        // FP_CTRL reads back with the code comparator count, FPB revision 1
+        v = word == FPB_BASE ? (fp_ctrl & 1) | (FP_CODE << 4) : fp_comp[(word - FPB_BASE - 8) / 4];
+    } else if (word == DWT_PCSR) {
+        v = halted || lockup ? 0xffffffff : r[15];
+    } else if (word == 0xE0042000) {
+        v = cfg.page_size > 1024 ? 0x20036414 : 0x20036410;  // DBGMCU_IDCODE, rev Y
+    } else if (word == 0x1FFFF7E0) {
+        v = 0xffff0000 | FLASH_SIZE / 1024;  // flash size in KB
+    } else {
+        auto it = other.find(word);
+        if (it != other.end()) v = it->second;
+    }
+    return v;
+}
+
+void SimAdapter::bus_write(uint32_t addr, int size, uint32_t value) {
+    uint32_t word = addr & ~3u;
+    uint32_t mask = size == 4 ? 0xffffffff : ((1u << (8 * size)) - 1) << (8 * (addr & 3));
+    
+    if (word >= FLASH_BASE && word < FLASH_BASE + FLASH_SIZE) {
+        flash_program(addr, size, value);
+    } else if (word >= SRAM_BASE && word < SRAM_BASE + SRAM_SIZE) {
+        uint32_t v;
+        memcpy(&v, &sram[word - SRAM_BASE], 4);
+        v = (v & ~mask) | (value & mask);
+        memcpy(&sram[word - SRAM_BASE], &v, 4);
+    } else if (word >= FLASH_REGS && word < FLASH_REGS + 0x400) {
+        flash_reg_write(word, value);
+    } else if (word >= CRC_REGS && word < CRC_REGS + 0x400) {
+        crc_write(word, value);
+    } else if (word >= SCS_BASE && word < SCS_BASE + 0x1000) {
+        scs_write(word, value);
+    } else if (word == FPB_BASE) {
+        if (value & 2) fp_ctrl = value & 1;  // KEY
+    } else if (word >= FPB_BASE + 8 && word < FPB_BASE + 8 + 4 * FP_CODE) {
+        fp_comp[(word - FPB_BASE - 8) / 4] = value;
+    } else {
+        uint32_t& v = other[word];
+        v = (v & ~mask) | (value & mask);
+    }
+}
+
+uint32_t SimAdapter::scs_read(uint32_t addr) {
+    switch (addr) {
+        case 0xE000ED00: return 0x411FC231;  // CPUID: Cortex-M3 r1p1
+        case 0xE000ED0C: return 0xFA050000;  // AIRCR
+        case 0xE000EDF0:
+            return (dhcsr & 0xf) | S_REGRDY | (halted ? S_HALT : 0) | (lockup ? S_LOCKUP : 0);
+        case 0xE000EDF8: return dcrdr;
+    }
+    return 0;
+}
+
+void SimAdapter::scs_write(uint32_t addr, uint32_t value) {
+    switch (addr) {
+        case 0xE000ED0C:
+            if ((value >> 16) == 0x05FA && (value & 0x5)) {
+                core_reset();
+                flash_locked = true;
+                key_step = 0;
+                flash_cr = 0;
+            }
+            break;
+        case 0xE000EDF0:
+            if ((value >> 16) != 0xA05F) break;
+            dhcsr = value & 0xf;
+            if ((dhcsr & C_DEBUGEN) && (dhcsr & C_HALT)) {
+                halted = true;
+                lockup = false;
+            } else if ((dhcsr & C_DEBUGEN) && (dhcsr & C_STEP) && halted) {
+                step();
+            } else {
+                halted = false;
+            }
+            break;
+        case 0xE000EDF4: {
+            if (!halted) break;
+            int sel = value & 0x7f;
+            if (sel == 17 || sel == 18) sel = 13;  // MSP, PSP
+            if (sel > 16) break;
+            if (value & (1u << 16)) r[sel] = dcrdr;
+            else dcrdr = r[sel];
+            break;
+        }
+        case 0xE000EDF8:
+            dcrdr = value;
+            break;
+    }
+}
+
+uint32_t SimAdapter::flash_reg_read(uint32_t addr) {
+    switch (addr - FLASH_REGS) {
+        case 0x00: return 0x30;
+        case 0x0c: return flash_sr;
+        case 0x10: return flash_cr | (flash_locked ? CR_LOCK : 0);
+        case 0x14: return flash_ar;
+        case 0x1c: return 0x03fffffc;
+        case 0x20: return 0xffffffff;
+    }
+    return 0;
+}
+
+void SimAdapter::flash_reg_write(uint32_t addr, uint32_t value) {
+    switch (addr - FLASH_REGS) {
+        case 0x04:
+            // KEY1 then KEY2; anything else starts over
+            if (key_step == 0 && value == 0x45670123) {
+                key_step = 1;
+            } else if (key_step == 1 && value == 0xCDEF89AB) {
+                flash_locked = false;
+                key_step = 0;
+            } else {
+                key_step = 0;
+            }
+            break;
+        case 0x0c:
+            flash_sr &= ~(value & (SR_PGERR | SR_WRPRTERR | SR_EOP));
+            break;
+        case 0x10:
+            if (flash_locked) break;
+            if (value & CR_LOCK) {
+                flash_locked = true;
+                flash_cr = 0;
+                break;
+            }
+            flash_cr = value & ~CR_STRT & 0x1277;
+            if ((value & CR_STRT) && !(flash_sr & SR_BSY)) {
+                if (value & CR_MER) {
+                    memset(flash.data(), 0xff, FLASH_SIZE);
+                    flash_busy_until = tck + MASS_ERASE_TICKS;
+                    flash_sr |= SR_BSY;
+                } else if (value & CR_PER) {
+                    uint32_t off = (flash_ar - FLASH_BASE) & ~(cfg.page_size - 1);
+                    if (off < FLASH_SIZE) memset(&flash[off], 0xff, cfg.page_size);
+                    flash_busy_until = tck + PAGE_ERASE_TICKS;
+                    flash_sr |= SR_BSY;
+                }
+            }
+            break;
+        case 0x14:
+            flash_ar = value;
+            break;
+    }
+}
+
+// Halfword programming only, and only over erased cells (or to zero)
+void SimAdapter::flash_program(uint32_t addr, int size, uint32_t value) {
+    if (!(flash_cr & CR_PG) || flash_locked) return;
+    
+    if (size != 2) {
+        flash_sr |= SR_PGERR;
+        return;
+    }
+    
+    uint32_t off = addr - FLASH_BASE;
+    uint16_t half = value >> (8 * (addr & 2));
+    uint16_t old = flash[off] | (flash[off + 1] << 8);
+    if (old != 0xffff && half != 0) {
+        flash_sr |= SR_PGERR;
+        return;
+    }
+    
+    flash[off] = half & 0xff;
+    flash[off + 1] = half >> 8;
+    flash_busy_until = ((flash_sr & SR_BSY) ? flash_busy_until : tck) + PROGRAM_TICKS;
+    flash_sr |= SR_BSY;
+}
+
+// CRC unit: CRC-32/MPEG-2 a word at a time, only while RCC clocks it
+void SimAdapter::crc_write(uint32_t addr, uint32_t value) {
+    if (!(bus_read(RCC_AHBENR, 4) & (1u << 6))) return;
+    
+    if (addr == CRC_REGS) {
+        crc ^= value;
+        for (int i = 0; i < 32; i++) crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    } else if (addr == CRC_REGS + 8 && (value & 1)) {
+        crc = 0xffffffff;
+    }
+}
+
+bool SimAdapter::executable(uint32_t addr) const {
+    return addr < FLASH_SIZE ||
+           (addr >= FLASH_BASE && addr < FLASH_BASE + FLASH_SIZE) ||
+           (addr >= SRAM_BASE && addr < SRAM_BASE + SRAM_SIZE);
+}
+
+void SimAdapter::core_reset() {
+    memset(r, 0, sizeof(r));
+    memcpy(&r[13], &flash[0], 4);
+    memcpy(&r[15], &flash[4], 4);
+    r[15] &= ~1u;
+    r[16] = 0x01000000;
+    lockup = false;
+}
+
+uint32_t SimAdapter::add_flags(uint32_t a, uint32_t b, bool carry) {
+    uint64_t sum = (uint64_t)a + b + carry;
+    uint32_t res = (uint32_t)sum;
+    
+    nz_flags(res);
+    r[16] &= ~(PSR_C | PSR_V);
+    if (sum >> 32) r[16] |= PSR_C;
+    if (((a ^ res) & (b ^ res)) >> 31) r[16] |= PSR_V;
+    return res;
+}
+
+void SimAdapter::nz_flags(uint32_t v) {
+    r[16] &= ~(PSR_N | PSR_Z);
+    if (v >> 31) r[16] |= PSR_N;
+    if (v == 0) r[16] |= PSR_Z;
+}
+
+bool SimAdapter::condition(int cond) const {
+    bool n = r[16] & PSR_N, z = r[16] & PSR_Z, c = r[16] & PSR_C, v = r[16] & PSR_V;
+    switch (cond) {
+        case 0x0: return z;
+        case 0x1: return !z;
+        case 0x2: return c;
+        case 0x3: return !c;
+        case 0x4: return n;
+        case 0x5: return !n;
+        case 0x6: return v;
+        case 0x7: return !v;
+        case 0x8: return c && !z;
+        case 0x9: return !c || z;
+        case 0xa: return n == v;
+        case 0xb: return n != v;
+        case 0xc: return !z && n == v;
+        case 0xd: return z || n != v;
+    }
+    return true;
+}
+
+// One instruction from the 16-bit Thumb subset the loader stubs use.
+// Anything else locks the core up, as an undefined instruction would.
+void SimAdapter::step() {
+    uint32_t pc = r[15];
+    if (!executable(pc)) {
+        lockup = true;
+        return;
+    }
+    
+    uint16_t op = bus_read(pc, 2) >> (8 * (pc & 2));
+    uint32_t next = pc + 2;
+    int rd = op & 7;
+    int rn = (op >> 3) & 7;
+    int imm5 = (op >> 6) & 0x1f;
+    
+    auto load = [&](uint32_t addr, int size) {
+        uint32_t v = bus_read(addr, size) >> (8 * (addr & 3));
+        return size == 4 ? v : v & ((1u << (8 * size)) - 1);
+    };
+    auto store = [&](uint32_t addr, int size, uint32_t v) {
+        bus_write(addr, size, v << (8 * (addr & 3)));
+    };
+    
+    if ((op & 0xf800) == 0x0000) {                      // LSLS imm
+        uint32_t v = r[rn];
+        if (imm5) {
+            r[16] = (r[16] & ~PSR_C) | (((v >> (32 - imm5)) & 1) ? PSR_C : 0);
+            v <<= imm5;
+        }
+        r[rd] = v;
+        nz_flags(v);
+    } else if ((op & 0xf800) == 0x0800) {               // LSRS imm
+        int n = imm5 ? imm5 : 32;
+        uint32_t v = r[rn];
+        r[16] = (r[16] & ~PSR_C) | (((uint64_t)v >> (n - 1)) & 1 ? PSR_C : 0);
+        v = n == 32 ? 0 : v >> n;
+        r[rd] = v;
+        nz_flags(v);
+    } else if ((op & 0xf800) == 0x1800) {               // ADDS/SUBS reg, imm3
+        uint32_t b = (op & 0x0400) ? (uint32_t)((op >> 6) & 7) : r[(op >> 6) & 7];
+        if (op & 0x0200) r[rd] = add_flags(r[rn], ~b, true);
+        else r[rd] = add_flags(r[rn], b, false);
+    } else if ((op & 0xe000) == 0x2000) {               // MOVS/CMP/ADDS/SUBS imm8
+        int rdn = (op >> 8) & 7;
+        uint32_t imm = op & 0xff;
+        switch ((op >> 11) & 3) {
+            case 0: r[rdn] = imm; nz_flags(imm); break;
+            case 1: add_flags(r[rdn], ~imm, true); break;
+            case 2: r[rdn] = add_flags(r[rdn], imm, false); break;
+            case 3: r[rdn] = add_flags(r[rdn], ~imm, true); break;
+        }
+    } else if ((op & 0xfc00) == 0x4000) {               // data processing
+        uint32_t a = r[rd], b = r[rn];
+        switch ((op >> 6) & 0xf) {
+            case 0x0: r[rd] = a & b; nz_flags(r[rd]); break;
+            case 0x1: r[rd] = a ^ b; nz_flags(r[rd]); break;
+            case 0x8: nz_flags(a & b); break;
+            case 0xa: add_flags(a, ~b, true); break;
+            case 0xc: r[rd] = a | b; nz_flags(r[rd]); break;
+            case 0xe: r[rd] = a & ~b; nz_flags(r[rd]); break;
+            case 0xf: r[rd] = ~b; nz_flags(r[rd]); break;
+            default: lockup = true; return;
+        }
+    } else if ((op & 0xff00) == 0x4600) {               // MOV high registers
+        int d = (op & 7) | ((op >> 4) & 8);
+        uint32_t v = r[(op >> 3) & 0xf];
+        if (((op >> 3) & 0xf) == 15) v = pc + 4;
+        if (d == 15) next = v & ~1u;
+        else r[d] = v;
+    } else if ((op & 0xf800) == 0x4800) {               // LDR literal
+        r[(op >> 8) & 7] = load(((pc + 4) & ~3u) + (op & 0xff) * 4, 4);
+    } else if ((op & 0xf800) == 0x6000) {               // STR imm
+        store(r[rn] + imm5 * 4, 4, r[rd]);
+    } else if ((op & 0xf800) == 0x6800) {               // LDR imm
+        r[rd] = load(r[rn] + imm5 * 4, 4);
+    } else if ((op & 0xf800) == 0x7000) {               // STRB imm
+        store(r[rn] + imm5, 1, r[rd]);
+    } else if ((op & 0xf800) == 0x7800) {               // LDRB imm
+        r[rd] = load(r[rn] + imm5, 1);
+    } else if ((op & 0xf800) == 0x8000) {               // STRH imm
+        store(r[rn] + imm5 * 2, 2, r[rd]);
+    } else if ((op & 0xf800) == 0x8800) {               // LDRH imm
+        r[rd] = load(r[rn] + imm5 * 2, 2);
+    } else if ((op & 0xff00) == 0xbe00) {               // BKPT
+        halted = true;
+        return;
+    } else if (op == 0xbf00) {                          // NOP
+    } else if ((op & 0xf000) == 0xd000 && ((op >> 8) & 0xf) < 0xe) {
+        if (condition((op >> 8) & 0xf))                 // B<cond>
+            next = pc + 4 + ((int32_t)(int8_t)(op & 0xff) << 1);
+    } else if ((op & 0xf800) == 0xe000) {               // B
+        next = pc + 4 + (((int32_t)(op << 21)) >> 20);
+    } else {
+        lockup = true;
+        return;
+    }
+    
+    r[15] = next;
+}
+
+SimChain::SimChain(int count) : parts(count) {}
+
+bool SimChain::open() {
+    for (auto& p : parts) p.open();
+    return true;
+}
+
+uint32_t SimChain::set_clock(uint32_t khz) {
+    uint32_t got = 0;
+    for (auto& p : parts) got = p.set_clock(khz);
+    return got;
+}
+
+void SimChain::delay(unsigned us) {
+    for (auto& p : parts) p.delay(us);
+}
+
+// Every part sees the same edge; each one's old TDO feeds the next
+bool SimChain::clock(bool tms, bool tdi) {
+    for (int i = parts.size() - 1; i >= 0; i--) tdi = parts[i].clock(tms, tdi);
+    return tdi;
+}
+
+void SimChain::queue_tms(uint32_t tms, int len) {
+    for (int i = 0; i < len; i++) clock((tms >> i) & 1, false);
+}
+
+void SimChain::queue_shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) {
+    for (int i = 0; i < len; i++) {
+        bool in = tdi ? (tdi[i / 8] >> (i % 8)) & 1 : false;
+        bool out = parts[0].sample(clock(exit && i == len - 1, in));
+        if (tdo) {
+            if (out) tdo[i / 8] |= 1 << (i % 8);
+            else tdo[i / 8] &= ~(1 << (i % 8));
+        }
+    }
+}
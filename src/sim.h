@@ -0,0 +1,157 @@
+#pragma once
+
+#include "jtag.h"
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// What the simulated link and target cost. The defaults are an ideal link
+// and a DP that only WAITs while the flash controller stalls the bus.
+struct SimConfig {
+    uint32_t idcode = 0x1BA01477;
+    int ir_len = 4;                 // the DP instructions are the low four bits
+    int ap_wait = 0;                // TCKs a MEM-AP bus access keeps the AP busy
+    unsigned usb_latency_us = 0;    // round trip per flush that moved data
+    unsigned usb_ns_per_byte = 0;   // wire time, bytes counted as MPSSE commands
+    uint32_t max_khz = 12000;       // fastest TCK whose TDO the host samples cleanly, 0 for any
+    uint32_t page_size = 1024;      // 2048 makes it high density, DEV_ID 0x414
+};
+
+// Software stand-in for an STM32F103C8 behind an ARM JTAG-DP, for running
+// the host side without hardware. Models the TAP, the DP and a MEM-AP, SRAM,
+// the flash controller and enough of a Cortex-M3 core (halt, step, FPB
+// breakpoints, core registers and a subset of Thumb) to execute the flash
+// loader stub.
+//
+// Bus accesses that find the AP busy get ACK WAIT and, with ORUNDETECT set,
+// STICKYORUN until the host clears it. USB round trips and wire time pass
+// as simulated time and show up in stats(). Above max_khz, TDO arrives too
+// late for the host and captured bits go wrong at random; simulated time
+// still runs at 1 MHz whatever the TCK setting.
+class SimAdapter : public JtagAdapter {
+public:
+    explicit SimAdapter(const SimConfig& cfg = SimConfig());
+    
+    bool open() override;
+    void close() override {}
+    void set_pin(JtagPin::Type pin, bool value) override { (void)pin; (void)value; }
+    bool get_pin(JtagPin::Type pin) override { (void)pin; return false; }
+    void delay(unsigned us) override;
+    uint64_t now_us() const override { return tck; }
+    uint32_t set_clock(uint32_t khz) override;
+    
+    void queue_tms(uint32_t tms, int len) override;
+    void queue_shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) override;
+    bool flush() override;
+    
+    // Simulated time in TCK periods (1 us each), USB time included
+    uint64_t ticks() const { return tck; }
+    
+    // One TCK edge; returns TDO as it was before the shift
+    bool clock(bool tms, bool tdi);
+    
+    // A TDO bit as the host sees it at the current TCK
+    bool sample(bool tdo);
+
+private:
+    void tick();
+    void usb_bytes(uint64_t out, uint64_t in);
+    
+    void capture_dr();
+    void update_dr();
+    uint32_t ap_access(bool read, uint8_t reg, uint32_t data);
+    void bus_busy(uint32_t addr);
+    
+    uint32_t bus_read(uint32_t addr, int size);
+    bool cs_read(uint32_t addr, uint32_t* v);
+    void bus_write(uint32_t addr, int size, uint32_t value);
+    uint32_t scs_read(uint32_t addr);
+    void scs_write(uint32_t addr, uint32_t value);
+    uint32_t flash_reg_read(uint32_t addr);
+    void flash_reg_write(uint32_t addr, uint32_t value);
+    void flash_program(uint32_t addr, int size, uint32_t value);
+    void crc_write(uint32_t addr, uint32_t value);
+    
+    bool executable(uint32_t addr) const;
+    bool fpb_hit(uint32_t pc) const;
+    void core_reset();
+    void step();
+    uint32_t add_flags(uint32_t a, uint32_t b, bool carry);
+    void nz_flags(uint32_t v);
+    bool condition(int cond) const;
+    
+    SimConfig cfg;
+    uint64_t tck;
+    uint64_t pending_out;   // USB bytes queued since the last flush
+    uint64_t pending_in;
+    uint32_t khz;
+    uint32_t noise;         // xorshift state for bits sampled too fast
+    
+    // TAP
+    TapState state;
+    uint8_t ir;
+    uint64_t sr;
+    int sr_len;
+    
+    // DP and MEM-AP
+    uint32_t ctrl;
+    uint32_t select;
+    uint32_t rdbuff;
+    uint32_t csw;
+    uint32_t tar;
+    uint64_t ap_busy_until;
+    bool waited;            // the scan in progress was answered WAIT
+    
+    // Memory
+    std::vector<uint8_t> flash;
+    std::vector<uint8_t> sram;
+    std::map<uint32_t, uint32_t> other;
+    
+    // Flash controller
+    bool flash_locked;
+    int key_step;
+    uint32_t flash_cr;
+    uint32_t flash_sr;
+    uint32_t flash_ar;
+    uint64_t flash_busy_until;
+    
+    uint32_t crc;
+    
+    // Core
+    uint32_t r[17];   // R0-R15, xPSR
+    bool halted;
+    bool lockup;
+    uint32_t dhcsr;
+    uint32_t dcrdr;
+    
+    // Breakpoint unit
+    static const int FP_CODE = 6;
+    uint32_t fp_ctrl;
+    uint32_t fp_comp[FP_CODE];
+};
+
+// Identical simulated parts daisy-chained: TDI enters the last one, TDO
+// leaves the first, so part i is chain index i.
+class SimChain : public JtagAdapter {
+public:
+    explicit SimChain(int count);
+    
+    bool open() override;
+    void close() override {}
+    void set_pin(JtagPin::Type pin, bool value) override { (void)pin; (void)value; }
+    bool get_pin(JtagPin::Type pin) override { (void)pin; return false; }
+    void delay(unsigned us) override;
+    uint64_t now_us() const override { return parts[0].ticks(); }
+    uint32_t set_clock(uint32_t khz) override;
+    
+    void queue_tms(uint32_t tms, int len) override;
+    void queue_shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) override;
+    bool flush() override { return true; }
+    
+    SimAdapter& part(int i) { return parts[i]; }
+
+private:
+    bool clock(bool tms, bool tdi);
+    
+    std::vector<SimAdapter> parts;
+};
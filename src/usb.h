@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Which FTDI device an adapter opens. An empty serial or path matches
+// any, so by default the first device with the VID/PID is used.
+struct UsbMatch {
+    uint32_t vid = 0x0403;
+    uint32_t pid = 0x6010;
+    std::string serial;
+    std::string path;   // "bus-port.port..." with libftdi, D2XX location ID on Windows
+};
+
+// One attached device, as listed by usb_list()
+struct UsbDevice {
+    std::string serial;
+    std::string path;
+    std::string description;
+};
+
+inline bool usb_matches(const UsbMatch& m, const UsbDevice& d) {
+    if (!m.serial.empty() && m.serial != d.serial) return false;
+    if (!m.path.empty() && m.path != d.path) return false;
+    return true;
+}
@@ -1,26 +1,75 @@
 #include "jtag.h"
+#include "bitbang.h"
+#include "mpsse.h"
+#include "usb.h"
+#include "perf.h"
 #include <windows.h>
 #include "FTD2XX.H"
+#include <cstdio>
 #include <iostream>
+#include <string>
+#include <vector>
+
+// The D2XX device list, filtered by VID/PID. Paths are location IDs.
+inline bool usb_nodes(const UsbMatch& m, std::vector<FT_DEVICE_LIST_INFO_NODE>& nodes) {
+    DWORD count = 0;
+    if (FT_CreateDeviceInfoList(&count) != FT_OK) return false;
+    
+    nodes.resize(count);
+    if (count && FT_GetDeviceInfoList(nodes.data(), &count) != FT_OK) return false;
+    nodes.resize(count);
+    
+    std::vector<FT_DEVICE_LIST_INFO_NODE> keep;
+    for (const auto& n : nodes) {
+        if (n.ID == ((m.vid << 16) | m.pid)) keep.push_back(n);
+    }
+    nodes.swap(keep);
+    return true;
+}
+
+inline UsbDevice usb_device(const FT_DEVICE_LIST_INFO_NODE& n) {
+    char loc[16];
+    snprintf(loc, sizeof(loc), "0x%lx", (unsigned long)n.LocId);
+    return {n.SerialNumber, loc, n.Description};
+}
+
+// Every attached device with the VID/PID that also fits serial and path
+inline bool usb_list(const UsbMatch& m, std::vector<UsbDevice>& out) {
+    out.clear();
+    std::vector<FT_DEVICE_LIST_INFO_NODE> nodes;
+    if (!usb_nodes(m, nodes)) return false;
+    
+    for (const auto& n : nodes) {
+        UsbDevice dev = usb_device(n);
+        if (usb_matches(m, dev)) out.push_back(dev);
+    }
+    return true;
+}
+
+// Open the first device m picks out, by location so that two devices
+// with the same serial can still be told apart
+inline FT_STATUS usb_open(const UsbMatch& m, FT_HANDLE* handle) {
+    std::vector<FT_DEVICE_LIST_INFO_NODE> nodes;
+    if (!usb_nodes(m, nodes)) return FT_OTHER_ERROR;
+    
+    for (const auto& n : nodes) {
+        if (!usb_matches(m, usb_device(n))) continue;
+        return FT_OpenEx((PVOID)(uintptr_t)n.LocId, FT_OPEN_BY_LOCATION, handle);
+    }
+    return FT_DEVICE_NOT_FOUND;
+}
 
 class WinFtdiAdapter : public JtagAdapter {
 public:
-    WinFtdiAdapter(uint32_t vid = 0x0403, uint32_t pid = 0x6010) 
-        : handle(nullptr), vid(vid), pid(pid), state(0), bytesWritten(0) {}
+    WinFtdiAdapter(const UsbMatch& usb)
+        : handle(nullptr), usb(usb) {}
     
     ~WinFtdiAdapter() {
         if (handle) close();
     }
     
     bool open() override {
-        DWORD devCount = 0;
-        FT_STATUS status = FT_CreateDeviceInfoList(&devCount);
-        if (status != FT_OK || devCount == 0) {
-            std::cerr << "No FTDI devices found\n";
-            return false;
-        }
-        
-        status = FT_Open(0, &handle);
+        FT_STATUS status = usb_open(usb, &handle);
         if (status != FT_OK) {
             std::cerr << "Failed to open FTDI device: " << status << "\n";
             return false;
@@ -44,10 +93,9 @@ public:
         }
         
         // Initial state - all outputs low
-        state = 0;
-        FT_Write(handle, &state, 1, &bytesWritten);
-        
-        return true;
+        q.clear();
+        q.set(0xff, 0);
+        return flush();
     }
     
     void close() override {
@@ -60,35 +108,337 @@ public:
     void set_pin(JtagPin::Type pin, bool value) override {
         uint8_t mask = 0;
         switch (pin) {
-            case JtagPin::TCK: mask = 0x01; break;
-            case JtagPin::TMS: mask = 0x02; break;
-            case JtagPin::TDI: mask = 0x04; break;
-            case JtagPin::TRST: mask = 0x08; break;
+            case JtagPin::TCK: mask = BitbangQueue::TCK; break;
+            case JtagPin::TMS: mask = BitbangQueue::TMS; break;
+            case JtagPin::TDI: mask = BitbangQueue::TDI; break;
+            case JtagPin::TRST: mask = BitbangQueue::TRST; break;
             default: return;
         }
         
-        if (value) state |= mask;
-        else state &= ~mask;
+        q.set(mask, value);
+        flush();
+    }
+    
+    bool get_pin(JtagPin::Type pin) override {
+        if (pin != JtagPin::TDO) return false;
+        
+        flush();
+        UCHAR val;
+        FT_GetBitMode(handle, &val);
+        return val & BitbangQueue::TDO;
+    }
+    
+    void delay(unsigned us) override {
+        flush();
+        Sleep(us / 1000);
+    }
+    
+    void queue_tms(uint32_t tms, int len) override {
+        q.tms(tms, len);
+    }
+    
+    void queue_shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) override {
+        q.shift(tdi, tdo, len, exit);
+    }
+    
+    // Same scheme as FtdiAdapter: one FT_Write per capture point
+    bool flush() override {
+        if (q.empty()) return true;
+        PerfTimer t;
+        
+        bool ok = true;
+        size_t pos = 0;
+        for (const auto& c : q.captures()) {
+            for (int i = 0; i < c.len; i++) {
+                size_t sample = c.offset + 2 * i + 1;
+                ok &= write_stream(pos, sample);
+                pos = sample;
+                
+                UCHAR val = 0;
+                if (FT_GetBitMode(handle, &val) != FT_OK) ok = false;
+                stats_.transfers++;
+                stats_.bytes_in++;
+                if (val & BitbangQueue::TDO) c.dst[i/8] |= (1 << (i % 8));
+                else c.dst[i/8] &= ~(1 << (i % 8));
+            }
+        }
+        ok &= write_stream(pos, q.stream().size());
+        
+        q.clear();
+        stats_.usb_us += t.us();
+        return ok;
+    }
+    
+private:
+    bool write_stream(size_t from, size_t to) {
+        if (to <= from) return true;
+        DWORD written = 0;
+        DWORD n = to - from;
+        stats_.transfers++;
+        stats_.bytes_out += n;
+        FT_STATUS status = FT_Write(handle, (LPVOID)(q.stream().data() + from), n, &written);
+        return status == FT_OK && written == n;
+    }
+    
+    FT_HANDLE handle;
+    UsbMatch usb;
+    BitbangQueue q;
+};
+
+// Synchronous bitbang through D2XX, see SyncBitbangAdapter in ftdi.cpp
+class WinSyncBitbangAdapter : public JtagAdapter {
+public:
+    WinSyncBitbangAdapter(const UsbMatch& usb, uint32_t khz = 1000)
+        : handle(nullptr), usb(usb), khz(khz) {}
+    
+    ~WinSyncBitbangAdapter() {
+        if (handle) close();
+    }
+    
+    bool open() override {
+        FT_STATUS status = usb_open(usb, &handle);
+        if (status != FT_OK) {
+            std::cerr << "Failed to open FTDI device: " << status << "\n";
+            return false;
+        }
+        
+        status = FT_SetBitMode(handle, 0x0f, 0x04);  // BITMODE_SYNCBB
+        if (status != FT_OK) {
+            std::cerr << "Failed to set synchronous bitbang mode\n";
+            FT_Close(handle);
+            handle = nullptr;
+            return false;
+        }
+        
+        // Bitbang bytes go out at 16x the baud rate, two bytes per TCK
+        FT_SetBaudRate(handle, khz * 1000 * 2 / 16);
+        FT_SetLatencyTimer(handle, 1);
+        FT_SetTimeouts(handle, 5000, 5000);
+        FT_Purge(handle, FT_PURGE_RX | FT_PURGE_TX);
         
-        DWORD written;
-        FT_Write(handle, &state, 1, &written);
+        q.clear();
+        q.set(0xff, 0);
+        return flush();
+    }
+    
+    void close() override {
+        if (handle) {
+            FT_Close(handle);
+            handle = nullptr;
+        }
+    }
+    
+    void set_pin(JtagPin::Type pin, bool value) override {
+        uint8_t mask = 0;
+        switch (pin) {
+            case JtagPin::TCK: mask = BitbangQueue::TCK; break;
+            case JtagPin::TMS: mask = BitbangQueue::TMS; break;
+            case JtagPin::TDI: mask = BitbangQueue::TDI; break;
+            case JtagPin::TRST: mask = BitbangQueue::TRST; break;
+            default: return;
+        }
+        
+        q.set(mask, value);
+        flush();
     }
     
     bool get_pin(JtagPin::Type pin) override {
         if (pin != JtagPin::TDO) return false;
         
-        uint8_t val;
+        flush();
+        UCHAR val;
         FT_GetBitMode(handle, &val);
-        return val & 0x10;  // TDO on bit 4
+        return val & BitbangQueue::TDO;
     }
     
     void delay(unsigned us) override {
+        flush();
         Sleep(us / 1000);
     }
     
+    void queue_tms(uint32_t tms, int len) override {
+        q.tms(tms, len);
+    }
+    
+    void queue_shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) override {
+        q.shift(tdi, tdo, len, exit);
+    }
+    
+    // The baud rate tops out at 3 MBd, 24 MHz of TCK on paper
+    uint32_t set_clock(uint32_t want) override {
+        if (!flush()) return 0;
+        khz = want < 24000 ? want : 24000;
+        FT_SetBaudRate(handle, khz * 1000 * 2 / 16);
+        return khz;
+    }
+    
+    bool flush() override {
+        if (q.empty()) return true;
+        
+        const auto& s = q.stream();
+        rx.resize(s.size());
+        PerfTimer t;
+        
+        bool ok = true;
+        for (size_t pos = 0; ok && pos < s.size(); pos += WINDOW) {
+            DWORD n = s.size() - pos < WINDOW ? s.size() - pos : WINDOW;
+            DWORD done = 0;
+            ok = FT_Write(handle, (LPVOID)(s.data() + pos), n, &done) == FT_OK && done == n &&
+                 FT_Read(handle, rx.data() + pos, n, &done) == FT_OK && done == n;
+            stats_.transfers += 2;
+            stats_.bytes_out += n;
+            stats_.bytes_in += n;
+        }
+        stats_.usb_us += t.us();
+        
+        if (ok) q.decode_sync(rx.data());
+        else std::cerr << "Sync bitbang transfer failed\n";
+        
+        q.clear();
+        return ok;
+    }
+    
 private:
+    static constexpr size_t WINDOW = 256;
+    
+    FT_HANDLE handle;
+    UsbMatch usb;
+    uint32_t khz;
+    BitbangQueue q;
+    std::vector<uint8_t> rx;
+};
+
+// MPSSE engine through D2XX, see MpsseAdapter in ftdi.cpp
+class WinMpsseAdapter : public JtagAdapter {
+public:
+    WinMpsseAdapter(const UsbMatch& usb, uint32_t khz = 1000)
+        : handle(nullptr), usb(usb), khz(khz) {}
+    
+    ~WinMpsseAdapter() {
+        if (handle) close();
+    }
+    
+    bool open() override {
+        FT_STATUS status = usb_open(usb, &handle);
+        if (status != FT_OK) {
+            std::cerr << "Failed to open FTDI device: " << status << "\n";
+            return false;
+        }
+        
+        FT_ResetDevice(handle);
+        FT_Purge(handle, FT_PURGE_RX | FT_PURGE_TX);
+        FT_SetLatencyTimer(handle, 1);
+        FT_SetTimeouts(handle, 5000, 5000);
+        FT_SetBitMode(handle, 0, 0x00);  // BITMODE_RESET
+        
+        status = FT_SetBitMode(handle, MpsseQueue::DIRECTION, 0x02);  // BITMODE_MPSSE
+        if (status != FT_OK) {
+            std::cerr << "Failed to enter MPSSE mode\n";
+            FT_Close(handle);
+            handle = nullptr;
+            return false;
+        }
+        
+        q.clear();
+        q.setup(khz);
+        return flush();
+    }
+    
+    void close() override {
+        if (handle) {
+            FT_SetBitMode(handle, 0, 0x00);
+            FT_Close(handle);
+            handle = nullptr;
+        }
+    }
+    
+    void set_pin(JtagPin::Type pin, bool value) override {
+        uint8_t mask = 0;
+        switch (pin) {
+            case JtagPin::TCK: mask = MpsseQueue::TCK; break;
+            case JtagPin::TMS: mask = MpsseQueue::TMS; break;
+            case JtagPin::TDI: mask = MpsseQueue::TDI; break;
+            case JtagPin::TRST: mask = MpsseQueue::TRST; break;
+            default: return;
+        }
+        
+        q.set_pins(mask, value);
+        flush();
+    }
+    
+    bool get_pin(JtagPin::Type pin) override {
+        if (pin != JtagPin::TDO) return false;
+        
+        bool tdo = false;
+        q.get_pins(&tdo);
+        flush();
+        return tdo;
+    }
+    
+    void delay(unsigned us) override {
+        flush();
+        Sleep(us / 1000);
+    }
+    
+    void queue_tms(uint32_t tms, int len) override {
+        q.tms(tms, len);
+    }
+    
+    void queue_shift(const uint8_t* tdi, uint8_t* tdo, int len, bool exit) override {
+        while (len > CHUNK_BITS) {
+            q.shift(tdi, tdo, CHUNK_BITS, false);
+            if (tdi) tdi += CHUNK_BITS / 8;
+            if (tdo) tdo += CHUNK_BITS / 8;
+            len -= CHUNK_BITS;
+            flush();
+        }
+        
+        q.shift(tdi, tdo, len, exit);
+        if (q.read_size() >= READ_LIMIT || q.write_size() >= WRITE_LIMIT)
+            flush();
+    }
+    
+    uint32_t set_clock(uint32_t want) override {
+        q.clock(want);
+        if (!flush()) return 0;
+        khz = want;
+        return MpsseQueue::frequency(MpsseQueue::divisor(khz));
+    }
+    
+    bool flush() override {
+        if (q.empty()) return true;
+        
+        const auto& cmd = q.commands();
+        PerfTimer t;
+        DWORD n = 0;
+        FT_STATUS status = FT_Write(handle, (LPVOID)cmd.data(), cmd.size(), &n);
+        bool ok = status == FT_OK && n == cmd.size();
+        stats_.transfers++;
+        stats_.bytes_out += cmd.size();
+        
+        if (ok && q.read_size()) {
+            rx.resize(q.read_size());
+            status = FT_Read(handle, rx.data(), rx.size(), &n);
+            ok = status == FT_OK && n == rx.size();
+            stats_.transfers++;
+            stats_.bytes_in += rx.size();
+            if (ok) q.decode(rx.data());
+        }
+        stats_.usb_us += t.us();
+        
+        if (!ok) std::cerr << "MPSSE transfer failed\n";
+        q.clear();
+        return ok;
+    }
+    
+private:
+    static constexpr int CHUNK_BITS = 2048 * 8;
+    static constexpr size_t READ_LIMIT = 2048;
+    static constexpr size_t WRITE_LIMIT = 64 * 1024;
+    
     FT_HANDLE handle;
-    uint32_t vid, pid;
-    uint8_t state;
-    DWORD bytesWritten;
+    UsbMatch usb;
+    uint32_t khz;
+    MpsseQueue q;
+    std::vector<uint8_t> rx;
 };